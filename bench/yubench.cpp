@@ -0,0 +1,593 @@
+#include "../yuasm.h"
+#include "../yulinker.h"
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <map>
+#include <chrono>
+#include <filesystem>
+#include <cstdint>
+#include <algorithm>
+#include <atomic>
+#include <new>
+#include <cstdlib>
+#include <thread>
+
+// Benchmarks for the assembler and the linker.
+// A deterministic corpus is generated into a temporary directory, assembled and linked, and a few
+// hot static methods are timed in isolation. Results are rates (higher is better) or allocation
+// counts (lower is better) and are compared against the stored baseline in bench/baseline.txt.
+// Rates depend on the host the baseline was recorded on, so only the allocation counts fail the run
+// unless --gate-rates is given.
+
+// Every heap allocation in the process is counted so the scanner's steady state can be checked
+static std::atomic<long long> allocations{0};
+
+void* operator new(std::size_t size) {
+    allocations++;
+    void* ptr = std::malloc(size ? size : 1);
+    if (ptr == nullptr) {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+void operator delete(void* ptr) noexcept {
+    std::free(ptr);
+}
+
+void operator delete(void* ptr, std::size_t) noexcept {
+    std::free(ptr);
+}
+
+struct BenchConfig {
+    int files = 16; // N translation units
+    int sections = 32; // M sections per file
+    int macros = 64; // K macros spread over the include chain
+    int include_depth = 8; // length of the #include chain every file pulls in
+    int instrs_per_section = 24;
+    uint32_t seed = 1;
+    std::string baseline_path = "bench/baseline.txt";
+    bool update_baseline = false;
+    double tolerance = 0.25; // allowed slowdown before a result counts as a regression
+    bool gate_rates = false; // --gate-rates, slower rates fail the run too, for a baseline from the same host
+    int repetitions = 5; // every benchmark reports its fastest repetition
+};
+
+struct Corpus {
+    std::vector<std::string> fpaths;
+    std::vector<std::string> symbols;
+    long long lines = 0; // source lines the assembler has to scan, headers counted per inclusion
+    long long relocations = 0;
+};
+
+struct Result {
+    std::string name;
+    double value;
+    bool higher_is_better;
+};
+
+// Small xorshift generator so the corpus is identical on every platform
+class Rng {
+public:
+    Rng(uint32_t seed) : state(seed ? seed : 1) {}
+
+    uint32_t next() {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        return state;
+    }
+
+    int below(int n) {
+        return next() % n;
+    }
+
+private:
+    uint32_t state;
+};
+
+// Discards everything, used to silence the per-instruction output of the assembler
+class NullBuffer : public std::streambuf {
+protected:
+    int overflow(int c) override {
+        return c;
+    }
+
+    std::streamsize xsputn(const char*, std::streamsize n) override {
+        return n;
+    }
+};
+
+class Benchmark {
+public:
+    Benchmark(BenchConfig set_config) : config(set_config) {}
+
+    int run();
+
+private:
+    BenchConfig config;
+    std::vector<Result> results;
+    int failures = 0; // checks that aren't about speed, like parallel output matching serial output
+
+    Corpus generate_corpus(std::filesystem::path dir);
+    void bench_assembler(const Corpus& corpus);
+    void bench_parallel_assembler(const Corpus& corpus);
+    void bench_linker(const Corpus& corpus);
+    void bench_param_to_int();
+    void bench_get_category(const Corpus& corpus);
+    void bench_eval_instr();
+    void bench_find_symbol(const Corpus& corpus);
+    void bench_scan_allocations(const Corpus& corpus);
+    void record(std::string name, double amount, double elapsed);
+    void record_lower(std::string name, double value);
+    int compare_with_baseline();
+
+    static double seconds_since(std::chrono::steady_clock::time_point start);
+};
+
+int Benchmark::run() {
+    std::filesystem::path baseline_path = std::filesystem::absolute(config.baseline_path);
+    config.baseline_path = baseline_path.string();
+
+    std::filesystem::path dir = std::filesystem::temp_directory_path() / "yubench_corpus";
+    std::filesystem::remove_all(dir);
+    std::filesystem::create_directories(dir / "inc");
+    std::filesystem::path prev_cwd = std::filesystem::current_path();
+
+    Corpus corpus = generate_corpus(dir);
+    std::cout << "Corpus: " << corpus.fpaths.size() << " files, " << corpus.lines << " lines, "
+              << corpus.relocations << " relocations\n\n";
+
+    std::filesystem::current_path(dir); // the assembler writes objects/ and out/ relative to the working directory
+
+    NullBuffer null_buffer;
+    std::streambuf* cout_buf = std::cout.rdbuf(&null_buffer);
+    std::streambuf* cerr_buf = std::cerr.rdbuf(&null_buffer);
+
+    bench_assembler(corpus);
+    bench_parallel_assembler(corpus);
+    bench_linker(corpus);
+    bench_param_to_int();
+    bench_get_category(corpus);
+    bench_eval_instr();
+    bench_find_symbol(corpus);
+    bench_scan_allocations(corpus);
+
+    std::cout.rdbuf(cout_buf);
+    std::cerr.rdbuf(cerr_buf);
+
+    std::filesystem::current_path(prev_cwd);
+    std::filesystem::remove_all(dir);
+
+    return compare_with_baseline();
+}
+
+Corpus Benchmark::generate_corpus(std::filesystem::path dir) {
+    Corpus corpus;
+    Rng rng(config.seed);
+
+    // Include chain: inc/h0.yuh includes h1.yuh at its end and so on, each one defines a share of the macros.
+    // The first 16 macros name registers, the rest are constants, some of them expressions.
+    std::vector<std::string> reg_macros;
+    std::vector<std::string> const_macros;
+    long long header_lines = 0;
+    int macros_per_header = (config.macros + config.include_depth - 1) / config.include_depth;
+    int macro_i = 0;
+    for (int d=0; d<config.include_depth; d++) {
+        std::ofstream header(dir / "inc" / ("h" + std::to_string(d) + ".yuh"));
+        for (int k=0; k<macros_per_header && macro_i<config.macros; k++, macro_i++) {
+            if (macro_i < 16) {
+                std::string name = "reg" + std::to_string(macro_i);
+                header << "#define " << name << " " << macro_i << " // register alias\n";
+                reg_macros.push_back(name);
+            } else {
+                std::string name = "k" + std::to_string(macro_i);
+                if (!const_macros.empty() && rng.below(2) == 0) {
+                    header << "#define " << name << " (" << const_macros.back() << " + " << rng.below(64) * 4 << ")\n";
+                } else {
+                    header << "#define " << name << " 0x" << std::hex << 0x8000 + rng.below(0x4000) * 4 << std::dec << "\n";
+                }
+                const_macros.push_back(name);
+            }
+            header_lines++;
+        }
+
+        // included last so that expressions in deeper headers can refer to the macros above
+        if (d + 1 < config.include_depth) {
+            header << "#include \"h" << d + 1 << ".yuh\"\n";
+            header_lines++;
+        }
+    }
+    if (reg_macros.empty()) {
+        reg_macros.push_back("0");
+    }
+    if (const_macros.empty()) {
+        const_macros.push_back("0x8000");
+    }
+
+    for (int i=0; i<config.files; i++) {
+        for (int j=0; j<config.sections; j++) {
+            corpus.symbols.push_back("f" + std::to_string(i) + "_s" + std::to_string(j));
+        }
+    }
+
+    const char* alu_ops[] = {"add", "sub", "mul", "and", "or", "xor", "lt", "gte", "lshift", "eq"};
+    for (int i=0; i<config.files; i++) {
+        std::string fpath = (dir / ("f" + std::to_string(i) + ".yuasm")).string();
+        std::ofstream file(fpath);
+        long long lines = 0;
+
+        file << "#include \"inc/h0.yuh\"\n\n";
+        lines += 2;
+
+        for (int j=0; j<config.sections; j++) {
+            file << "." << corpus.symbols[i * config.sections + j] << ":\n";
+            lines++;
+
+            for (int k=0; k<config.instrs_per_section; k++) {
+                int kind = rng.below(100);
+                std::string rd = reg_macros[rng.below(reg_macros.size())];
+                std::string rs1 = reg_macros[rng.below(reg_macros.size())];
+                std::string rs2 = reg_macros[rng.below(reg_macros.size())];
+
+                file << "    ";
+                if (kind < 40) {
+                    file << alu_ops[rng.below(10)] << " " << rd << " " << rs1 << " " << rs2;
+                } else if (kind < 60) {
+                    if (rng.below(2) == 0) {
+                        file << "loadm " << rd << " " << const_macros[rng.below(const_macros.size())];
+                    } else {
+                        file << "loadm " << rd << " -" << rng.below(1000);
+                    }
+                } else if (kind < 70) {
+                    file << "stored 0x" << std::hex << 0x8000 + rng.below(0x400) * 4 << std::dec << " " << rs1;
+                } else if (kind < 85) {
+                    file << "jumpif " << corpus.symbols[i * config.sections + rng.below(config.sections)] << " " << rs1;
+                    corpus.relocations++;
+                } else {
+                    file << "br " << corpus.symbols[rng.below(corpus.symbols.size())];
+                    corpus.relocations++;
+                }
+                if (rng.below(8) == 0) {
+                    file << " // generated";
+                }
+                file << "\n";
+                lines++;
+            }
+
+            file << "    ret\n\n";
+            lines += 2;
+        }
+
+        corpus.fpaths.push_back(fpath);
+        corpus.lines += lines + header_lines;
+    }
+
+    return corpus;
+}
+
+void Benchmark::bench_assembler(const Corpus& corpus) {
+    for (int rep=0; rep<config.repetitions; rep++) {
+        auto start = std::chrono::steady_clock::now();
+        for (const std::string& fpath : corpus.fpaths) {
+            Yuasm yuasm(fpath);
+        }
+        record("assemble_lines_per_sec", corpus.lines, seconds_since(start));
+    }
+}
+
+void Benchmark::bench_parallel_assembler(const Corpus& corpus) {
+    // All translation units glued into one big file behind a single include, assembled with -j
+    std::string fpath = "all.yuasm";
+    long long lines = 1;
+    {
+        std::ofstream all(fpath);
+        all << "#include \"inc/h0.yuh\"\n";
+        for (const std::string& part : corpus.fpaths) {
+            std::ifstream file(part);
+            std::string line;
+            std::getline(file, line); // its own #include
+            while (std::getline(file, line)) {
+                all << line << "\n";
+                lines++;
+            }
+        }
+    }
+
+    auto read_object = []() {
+        std::ifstream file("objects/" + Yuasm::generate_ofname("all.yuasm"), std::ios::binary);
+        std::stringstream ss;
+        ss << file.rdbuf();
+        return ss.str();
+    };
+
+    Yuasm serial(fpath);
+    std::string expected = read_object();
+
+    YuasmOptions options;
+    options.jobs = std::max(2, (int) std::thread::hardware_concurrency());
+    options.min_chunk_bytes = 16 * 1024;
+    for (int rep=0; rep<config.repetitions; rep++) {
+        auto start = std::chrono::steady_clock::now();
+        Yuasm yuasm(fpath, options);
+        record("parallel_assemble_lines_per_sec", lines, seconds_since(start));
+    }
+
+    if (read_object() != expected) {
+        failures++;
+    }
+}
+
+void Benchmark::bench_linker(const Corpus& corpus) {
+    std::vector<std::string> objects;
+    for (const std::string& fpath : corpus.fpaths) {
+        objects.push_back("objects/" + Yuasm::generate_ofname(fpath));
+    }
+
+    for (int rep=0; rep<config.repetitions; rep++) {
+        auto start = std::chrono::steady_clock::now();
+        Linker linker(objects, true);
+        record("link_relocations_per_sec", corpus.relocations, seconds_since(start));
+    }
+}
+
+void Benchmark::bench_param_to_int() {
+    const std::vector<std::string> params = {"12", "0x8100", "0b1011", "999999", "0xFFFFF", "7", "0x123456", "15"};
+    const int iterations = 1000000;
+
+    uint32_t sink = 0;
+    for (int rep=0; rep<config.repetitions; rep++) {
+        auto start = std::chrono::steady_clock::now();
+        for (int i=0; i<iterations; i++) {
+            sink += Yuasm::param_to_int(params[i % params.size()]);
+        }
+        record("param_to_int_per_sec", iterations, seconds_since(start));
+    }
+
+    if (sink == 0) {
+        std::cerr << newl; // keeps the loop from being optimized away
+    }
+}
+
+void Benchmark::bench_get_category(const Corpus& corpus) {
+    std::ifstream file(corpus.fpaths[0]);
+    std::stringstream ss;
+    ss << file.rdbuf();
+    std::string text = ss.str();
+    const long long target_chars = 50000000;
+
+    int sink = 0;
+    for (int rep=0; rep<config.repetitions; rep++) {
+        long long scanned = 0;
+        auto start = std::chrono::steady_clock::now();
+        while (scanned < target_chars) {
+            for (char ch : text) {
+                sink += Yuasm::get_category(ch);
+            }
+            scanned += text.size();
+        }
+        record("get_category_chars_per_sec", scanned, seconds_since(start));
+    }
+
+    if (sink == 0) {
+        std::cerr << newl;
+    }
+}
+
+void Benchmark::bench_eval_instr() {
+    struct BenchInstr {
+        std::string op;
+        std::array<std::string, Yuasm::MAX_PARAMS> params;
+        int n_params;
+    };
+    const std::vector<BenchInstr> instrs = {
+        {"add", {"1", "2", "3"}, 3},
+        {"loadm", {"3", "0x8100"}, 2},
+        {"loadm", {"4", "-16"}, 2},
+        {"stored", {"0x8104", "3"}, 2},
+        {"lt", {"8", "9", "6"}, 3},
+        {"jumpif", {"loop", "8"}, 2},
+        {"br", {"helper"}, 1},
+        {"ret", {}, 0},
+    };
+    const int iterations = 500000;
+
+    Yuasm yuasm;
+    for (int rep=0; rep<config.repetitions; rep++) {
+        auto start = std::chrono::steady_clock::now();
+        for (int i=0; i<iterations; i++) {
+            const auto& instr = instrs[i % instrs.size()];
+            yuasm.eval_instr(instr.op, instr.params, instr.n_params);
+            if (yuasm.instructions.size() >= 4096) {
+                yuasm.instructions.clear();
+                yuasm.callers.clear();
+            }
+        }
+        record("eval_instr_per_sec", iterations, seconds_since(start));
+    }
+}
+
+void Benchmark::bench_find_symbol(const Corpus& corpus) {
+    std::vector<std::string> objects;
+    for (const std::string& fpath : corpus.fpaths) {
+        objects.push_back("objects/" + Yuasm::generate_ofname(fpath));
+    }
+    Linker linker(objects, true);
+
+    const int iterations = 10000;
+    long long sink = 0;
+    for (int rep=0; rep<config.repetitions; rep++) {
+        auto start = std::chrono::steady_clock::now();
+        for (int i=0; i<iterations; i++) {
+            sink += linker.find_symbol(corpus.symbols[(i * 7919) % corpus.symbols.size()]);
+        }
+        record("find_symbol_per_sec", iterations, seconds_since(start));
+    }
+
+    if (sink == 0) {
+        std::cerr << newl;
+    }
+}
+
+void Benchmark::bench_scan_allocations(const Corpus& corpus) {
+    // Assemble the same file twice in one instance, the second pass reuses the grown scanning buffers
+    // so whatever it still allocates per instruction is the steady state of the scanner
+    Yuasm yuasm;
+    long long allocs = 0;
+    for (int pass=0; pass<2; pass++) {
+        yuasm.instructions.clear();
+        yuasm.callers.clear();
+        yuasm.functions.clear();
+        yuasm.macros.clear();
+        yuasm.pc = 0;
+        yuasm.state = Yuasm::SCAN_FIRST;
+
+        long long before = allocations;
+        if (!yuasm.open_new_file(corpus.fpaths[0]) || !yuasm.mainloop()) {
+            return;
+        }
+        allocs = allocations - before;
+    }
+
+    if (!yuasm.instructions.empty()) {
+        record_lower("scan_allocs_per_1k_instrs", 1000.0 * allocs / yuasm.instructions.size());
+    }
+}
+
+void Benchmark::record(std::string name, double amount, double elapsed) {
+    // Keep the fastest repetition, it is the one least disturbed by the rest of the system
+    double rate = amount / elapsed;
+    for (auto& result : results) {
+        if (result.name == name) {
+            result.value = std::max(result.value, rate);
+            return;
+        }
+    }
+    results.push_back({name, rate, true});
+}
+
+void Benchmark::record_lower(std::string name, double value) {
+    results.push_back({name, value, false});
+}
+
+int Benchmark::compare_with_baseline() {
+    std::map<std::string, double> baseline;
+    std::ifstream baseline_file(config.baseline_path);
+    std::string line;
+    while (std::getline(baseline_file, line)) {
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+        std::istringstream ls(line);
+        std::string name;
+        double val;
+        if (ls >> name >> val) {
+            baseline[name] = val;
+        }
+    }
+
+    int regressions = 0;
+    std::cout << std::left << std::setw(30) << "benchmark" << std::right << std::setw(16) << "current"
+              << std::setw(16) << "baseline" << std::setw(10) << "change" << "\n";
+    for (const auto& result : results) {
+        std::cout << std::left << std::setw(30) << result.name << std::right << std::fixed << std::setprecision(0)
+                  << std::setw(16) << result.value;
+
+        auto it = baseline.find(result.name);
+        if (it == baseline.end() || it->second <= 0) {
+            std::cout << std::setw(16) << "-" << "\n";
+            continue;
+        }
+
+        double change = result.value / it->second - 1.0;
+        std::cout << std::setw(16) << it->second << std::setw(9) << std::showpos << std::setprecision(1)
+                  << change * 100 << "%" << std::noshowpos;
+        bool regressed = result.higher_is_better ? change < -config.tolerance : change > config.tolerance;
+        if (regressed && result.higher_is_better && !config.gate_rates) {
+            std::cout << "  slower";
+        } else if (regressed) {
+            std::cout << "  REGRESSION";
+            regressions++;
+        }
+        std::cout << "\n";
+    }
+
+    if (failures > 0) {
+        std::cout << "\nParallel assembly produced a different object than serial assembly\n";
+        return 1;
+    }
+
+    if (config.update_baseline) {
+        std::ofstream out(config.baseline_path);
+        out << "# yubench baseline, rates are higher is better, *_allocs_* counts are lower is better\n";
+        out << "# regenerate with: build/yubench --update-baseline\n";
+        for (const auto& result : results) {
+            out << result.name << " " << std::fixed << std::setprecision(0) << result.value << "\n";
+        }
+        std::cout << "\nBaseline written to " << config.baseline_path << "\n";
+        return 0;
+    }
+
+    if (regressions > 0) {
+        std::cout << "\n" << regressions << " benchmark(s) regressed by more than "
+                  << std::setprecision(0) << config.tolerance * 100 << "%\n";
+        return 1;
+    }
+    return 0;
+}
+
+double Benchmark::seconds_since(std::chrono::steady_clock::time_point start) {
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count() > 0 ? elapsed.count() : 1e-9;
+}
+
+int main(int argc, char* argv[]) {
+    BenchConfig config;
+
+    for (int i=1; i<argc; i++) {
+        std::string arg (argv[i]);
+        bool has_val = i + 1 < argc;
+
+        if (arg == "--files" && has_val) {
+            config.files = std::stoi(argv[++i]);
+        } else if (arg == "--sections" && has_val) {
+            config.sections = std::stoi(argv[++i]);
+        } else if (arg == "--macros" && has_val) {
+            config.macros = std::stoi(argv[++i]);
+        } else if (arg == "--include-depth" && has_val) {
+            config.include_depth = std::stoi(argv[++i]);
+        } else if (arg == "--instrs" && has_val) {
+            config.instrs_per_section = std::stoi(argv[++i]);
+        } else if (arg == "--seed" && has_val) {
+            config.seed = std::stoul(argv[++i]);
+        } else if (arg == "--baseline" && has_val) {
+            config.baseline_path = argv[++i];
+        } else if (arg == "--repetitions" && has_val) {
+            config.repetitions = std::stoi(argv[++i]);
+        } else if (arg == "--tolerance" && has_val) {
+            config.tolerance = std::stod(argv[++i]) / 100.0;
+        } else if (arg == "--update-baseline") {
+            config.update_baseline = true;
+        } else if (arg == "--gate-rates") {
+            config.gate_rates = true;
+        } else {
+            std::cout << "Usage: yubench [--files N] [--sections M] [--macros K] [--include-depth D] [--instrs I]\n";
+            std::cout << "               [--seed S] [--repetitions R] [--baseline FILE] [--tolerance PERCENT] [--update-baseline]\n";
+            std::cout << "               [--gate-rates]\n";
+            return 1;
+        }
+    }
+
+    if (config.files < 1 || config.sections < 1 || config.include_depth < 1 || config.instrs_per_section < 1 || config.repetitions < 1) {
+        std::cout << "Corpus dimensions must be at least 1\n";
+        return 1;
+    }
+
+    Benchmark benchmark(config);
+    return benchmark.run();
+}
@@ -1,2 +1,2 @@
 mkdir -p build
-g++ yuasm_main.cpp yuasm.cpp yulinker.cpp -o build/yuasm
+g++ -pthread yuasm_main.cpp yuasm_cli.cpp yuwatch.cpp yuasm.cpp yuopt.cpp yulinker.cpp yustats.cpp yufile.cpp -o build/yuasm
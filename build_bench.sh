@@ -0,0 +1,2 @@
+mkdir -p build
+g++ -O2 -pthread bench/yubench.cpp yuasm.cpp yuopt.cpp yulinker.cpp yustats.cpp yufile.cpp -o build/yubench
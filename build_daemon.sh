@@ -0,0 +1,3 @@
+mkdir -p build
+g++ -pthread yuasmd_main.cpp yuasmd.cpp yudaemon.cpp yuasm_cli.cpp yuwatch.cpp yulinker_cli.cpp yuasm.cpp yuopt.cpp yulinker.cpp yustats.cpp yufile.cpp -o build/yuasmd
+g++ yuasmc_main.cpp yudaemon.cpp -o build/yuasmc
@@ -1,2 +1,2 @@
 mkdir -p build
-g++ yulinker_main.cpp yulinker.cpp -o build/yulinker
+g++ yulinker_main.cpp yulinker_cli.cpp yulinker.cpp yustats.cpp yufile.cpp -o build/yulinker
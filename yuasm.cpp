@@ -1,5 +1,7 @@
 #include "yuasm.h"
 #include "yulinker.h"
+#include "yuopt.h"
+#include "yufile.h"
 
 #include <cctype>
 #include <iostream>
@@ -9,34 +11,84 @@
 #include <memory>
 #include <string>
 #include <map>
-#include <cmath>
 #include <iomanip>
 #include <filesystem>
+#include <algorithm>
+#include <cstdio>
+#include <sstream>
+#include <thread>
+#include <exception>
+
+Yuasm::Yuasm(std::string first_fname, YuasmOptions set_options) : options(set_options) {
+    obj_fpath = options.obj_fpath.empty() ? options.obj_dir + "/" + generate_ofname(first_fname) : options.obj_fpath;
+    create_objects_dir_safely(obj_fpath);
+    bool assembled = define_option_macros() && open_new_file(first_fname) && (options.jobs > 1 ? assemble_parallel() : mainloop());
+    if (options.stats != nullptr && encoding_hits + encoding_misses > 0) {
+        options.stats->count("asm.encoding_cache.hits", encoding_hits);
+        options.stats->count("asm.encoding_cache.misses", encoding_misses);
+        options.stats->count("asm.encoding_cache.hit_pct", encoding_hits * 100 / (encoding_hits + encoding_misses));
+    }
+    if (assembled && apply_visibility()) {
+        optimize();
+        resolve_local_branches();
+        object_written = write_object();
+        if (object_written && options.write_deps) {
+            write_depfile();
+        }
+        if (options.auto_link) {
+            link_object();
+        }
+    }
+}
 
-Yuasm::Yuasm(std::string first_fname) {
-    create_objects_dir_safely();
-    ofname = generate_ofname(first_fname);
-    if (open_new_file(first_fname)) {
-        mainloop();
+bool Yuasm::define_option_macros() {
+    for (const auto& [name, value] : options.defines) {
+        std::string macro_val = value;
+        if (!macro_val.empty() && macro_val[0] == '(') { // evaluated once, like the value of a #define
+            try {
+                macro_val = std::to_string(eval_const_expr(macro_val, macros));
+            } catch (const std::runtime_error& e) {
+                *log_err << "Error: -D " << name << ": " << e.what() << newl;
+                return false;
+            }
+        }
+        macros.insert({name, macro_val}); // the first definition stays, so these win over a #define in the source
     }
+    return true;
 }
 
 bool Yuasm::mainloop() {
+    Stats::Timer lexing_timer(options.stats, Stats::LEXING);
+
     while (!files.empty()) {
         // Get the next character in line
-        char ch;
-        (*(files.top())).get(ch);
+        SourceFile& source = *files.top();
+        bool at_eof = source.pos >= source.text.size();
+        char ch = at_eof ? '\0' : source.text[source.pos++];
 
         // If EOF is reached and an instruction is currently being read, trigger an instruction processing cycle by emulating an EOL character,
         // otherwise the last instruction isn't processed.
         // If no instruction is in the buffer quit the program.
-        if ((*(files.top())).eof()) {
-            if ((!buffer0.empty() || !buffer1.empty()) && state != BLOCK_COMMENT && state != BLOCK_COMMENT_END) {
+        if (at_eof) {
+            if ((!buffer0.empty() || !buffer1.empty() || line_action != NO_LINE_ACTION) && state != BLOCK_COMMENT && state != BLOCK_COMMENT_END) {
                 ch = '\n';
             } else {
+                if (!reps.empty() && reps.back().file_depth == files.size()) {
+                    print_line_to_std_err();
+                    *log_err << "Error: missing #endrep for the #rep on line " << reps.back().line << newl;
+                    return false;
+                }
+                if (!conds.empty() && conds.back().file_depth == files.size()) {
+                    print_line_to_std_err();
+                    *log_err << "Error: missing #endif for the #if on line " << conds.back().line << newl;
+                    return false;
+                }
+                if (!macro_calls.empty() && macro_calls.back().file_depth == files.size()) {
+                    end_macro_call();
+                }
                 buffer0.clear();
                 buffer1.clear();
-                params.clear();
+                n_params = 0;
                 files.pop();
                 fnames.pop();
                 line_counters.pop();
@@ -45,9 +97,12 @@ bool Yuasm::mainloop() {
         }
 
         int category = get_category(ch);
+        if (!at_eof) {
+            chars_scanned++;
+        }
 
         if (DEBUG_LEVEL >= 2) {
-            std::cout << "Ch: " << ch << ", State: " << print_state() << ", Category: " << category << ",PC: " << pc << newl; // DEBUG
+            *log_out << "Ch: " << ch << ", State: " << print_state() << ", Category: " << category << ",PC: " << pc << newl; // DEBUG
         }
 
         // Main FSM
@@ -82,7 +137,7 @@ bool Yuasm::mainloop() {
                     case SC:
                     case AST: {
                         print_line_to_std_err();
-                        std::cerr << "Error: invalid character: " << ch << newl;
+                        *log_err << "Error: invalid character: " << ch << newl;
                         return false;
                     }
 
@@ -121,7 +176,7 @@ bool Yuasm::mainloop() {
 
                     default: {
                         print_line_to_std_err();
-                        std::cerr << "Error: invalid character: " << ch << ", expected semicolon, comment, or new line" << newl;
+                        *log_err << "Error: invalid character: " << ch << ", expected semicolon, comment, or new line" << newl;
                         return false;
                     }
                 }
@@ -151,7 +206,7 @@ bool Yuasm::mainloop() {
 
                     default: {
                         print_line_to_std_err();
-                        std::cerr << "Error: invalid character: " << ch  << "(" << (int) ch << ")" << ", expected comment or new line" << newl;
+                        *log_err << "Error: invalid character: " << ch  << "(" << (int) ch << ")" << ", expected comment or new line" << newl;
                         return false;
                     }
                 }
@@ -166,7 +221,7 @@ bool Yuasm::mainloop() {
                         state = LINE_COMMENT;
 
                         if (DEBUG_LEVEL >= 2) {
-                            std::cout << "Beginning line comment\n";
+                            *log_out << "Beginning line comment\n";
                         }
                         break;
                     }
@@ -175,14 +230,14 @@ bool Yuasm::mainloop() {
                         state = BLOCK_COMMENT;
 
                         if (DEBUG_LEVEL >= 2) {
-                            std::cout << "Beginning block comment\n";
+                            *log_out << "Beginning block comment\n";
                         }
                         break;
                     }
 
                     default: {
                         print_line_to_std_err();
-                        std::cerr << "Error: expected '/' or '*' but got " << ch << "(" << (int) ch << ")" << newl;
+                        *log_err << "Error: expected '/' or '*' but got " << ch << "(" << (int) ch << ")" << newl;
                         return false;
                     }
                 }
@@ -220,14 +275,14 @@ bool Yuasm::mainloop() {
 
 
             case LINE_COMMENT_END: { // useless state
-                std::cout << "[TODO] useless state LINE_COMMENT_END" << newl;
+                *log_out << "[TODO] useless state LINE_COMMENT_END" << newl;
                 switch (category) {
                     case SLASH: {
                         state = SCAN_FIRST;
                         state_before_block_comment = INVALID_STATE;
 
                         if (DEBUG_LEVEL >= 2) {
-                            std::cout << "End of line comment\n";
+                            *log_out << "End of line comment\n";
                         }
                         break;
                     }
@@ -246,7 +301,7 @@ bool Yuasm::mainloop() {
                         state_before_block_comment = INVALID_STATE;
 
                         if (DEBUG_LEVEL >= 2) {
-                            std::cout << "End of block comment\n";
+                            *log_out << "End of block comment\n";
                         }
                     }
 
@@ -258,11 +313,23 @@ bool Yuasm::mainloop() {
 
 
             case SCAN_PREPROC_DEF: {
+                if (is_line_directive(buffer0)) {
+                    if (category == SP || category == CR) {
+                        state = SCAN_DIRECTIVE_ARGS;
+                        break;
+                    } else if (category == LF || category == SC || category == SLASH) {
+                        if (!finish_directive((Input) category)) {
+                            return false;
+                        }
+                        break;
+                    }
+                }
+
                 switch (category) {
                     case LF:
                     case CR: { // these are invalid, we expect a keyword
                         print_line_to_std_err();
-                        std::cerr << "Error: expected keyword for preprocessing directive\n";
+                        *log_err << "Error: expected keyword for preprocessing directive\n";
                         return false;
                     }
                      
@@ -276,7 +343,7 @@ bool Yuasm::mainloop() {
                             buffer0.push_back(ch);
                         } else {
                             print_line_to_std_err();
-                            std::cerr << "Error: identifiers can't begin with numbers\n";
+                            *log_err << "Error: identifiers can't begin with numbers\n";
                             return false;
                         }
                         break;
@@ -284,7 +351,7 @@ bool Yuasm::mainloop() {
 
                     // We can't have spaces before the keyword, it has to be connected to the '#'
                     case SP: {
-                        std::string buffer_str(buffer0.begin(), buffer0.end());
+                        const std::string& buffer_str = buffer0;
                         if (buffer_str == "define") {
                             state = SCAN_PREPROC_SUB;
                             buffer0.clear();
@@ -293,7 +360,7 @@ bool Yuasm::mainloop() {
                             buffer0.clear();
                         } else {
                             print_line_to_std_err();
-                            std::cerr << "Error: invalid preprocessor directive: " << buffer_str << newl;
+                            *log_err << "Error: invalid preprocessor directive: " << buffer_str << newl;
                             return false;
                         }
                         break;
@@ -306,11 +373,11 @@ bool Yuasm::mainloop() {
                             break;
                         } else {
                             print_line_to_std_err();
-                            std::cerr << "Error: expected parameters for preprocessor directive" << newl;
+                            *log_err << "Error: expected parameters for preprocessor directive" << newl;
                             return false;
                         }
 
-                        std::string buffer_str(buffer0.begin(), buffer0.end());
+                        const std::string& buffer_str = buffer0;
                         if (buffer_str == "define") {
                             state = SCAN_PREPROC_SUB;
                             buffer0.clear();
@@ -319,7 +386,7 @@ bool Yuasm::mainloop() {
                             buffer0.clear();
                         } else {
                             print_line_to_std_err();
-                            std::cerr << "Error: invalid preprocessor directive: " << buffer_str << newl;
+                            *log_err << "Error: invalid preprocessor directive: " << buffer_str << newl;
                             return false;
                         }
                         break;
@@ -327,7 +394,7 @@ bool Yuasm::mainloop() {
 
                     default: {
                         print_line_to_std_err();
-                        std::cerr << "Error: invalid character for preprocessor directive key: " << ch << newl;
+                        *log_err << "Error: invalid character for preprocessor directive key: " << ch << newl;
                         return false;
                     }
                 }
@@ -341,7 +408,7 @@ bool Yuasm::mainloop() {
                     case LF:
                     case CR: { // these are invalid, we expect a parameter
                         print_line_to_std_err();
-                        std::cerr << "Error: expected macro name for preprocessing directive\n";
+                        *log_err << "Error: expected macro name for preprocessing directive\n";
                         return false;
                     }
                      
@@ -355,7 +422,7 @@ bool Yuasm::mainloop() {
                             buffer0.push_back(ch);
                         } else {
                             print_line_to_std_err();
-                            std::cerr << "Error: identifiers can't begin with numbers\n";
+                            *log_err << "Error: identifiers can't begin with numbers\n";
                             return false;
                         }
                         break;
@@ -368,7 +435,6 @@ bool Yuasm::mainloop() {
                             break;
                         }
 
-                        std::string buffer_str(buffer0.begin(), buffer0.end());
                         state = SCAN_PREPROC_VAL;
                         break;
                     }
@@ -380,14 +446,13 @@ bool Yuasm::mainloop() {
                             // Ignore leading spaces
                             break;
                         }
-                        std::string buffer_str(buffer0.begin(), buffer0.end());
                         state = SCAN_PREPROC_VAL;
                         break;
                     }
 
                     default: {
                         print_line_to_std_err();
-                        std::cerr << "Error: invalid character for macro name: " << ch << newl;
+                        *log_err << "Error: invalid character for macro name: " << ch << newl;
                         return false;
                     }
                 }
@@ -397,6 +462,9 @@ bool Yuasm::mainloop() {
 
 
             case SCAN_PREPROC_VAL: {
+                if (after_expr && !end_expr_param((Input) category, ch)) {
+                    return false;
+                }
                 switch (category) {
                     case NUM:
                     case AL: { // scan value
@@ -409,7 +477,7 @@ bool Yuasm::mainloop() {
                             buffer1.push_back(ch);
                         } else {
                             print_line_to_std_err();
-                            std::cerr << "Error: invalid character for macro value: " << ch << newl;
+                            *log_err << "Error: invalid character for macro value: " << ch << newl;
                             return false;
                         }
                         break;
@@ -424,8 +492,8 @@ bool Yuasm::mainloop() {
                             break;
                         }
 
-                        std::string macro_name(buffer0.begin(), buffer0.end());
-                        std::string macro_val(buffer1.begin(), buffer1.end());
+                        std::string macro_name = buffer0;
+                        std::string macro_val = buffer1;
                         macros.insert({macro_name, macro_val});
 
                         buffer0.clear();
@@ -440,16 +508,16 @@ bool Yuasm::mainloop() {
                         }
 
                         if (DEBUG_LEVEL >= 1) {
-                            std::cout << "# Macro Definition Complete #\n"; // DEBUG
-                            std::cout << "Key: " << macro_name << ", Value: " << macro_val << "\n\n";
+                            *log_out << "# Macro Definition Complete #\n"; // DEBUG
+                            *log_out << "Key: " << macro_name << ", Value: " << macro_val << "\n\n";
                         }
                         break;
                     }
 
                     case LF:
                     case CR: {
-                        std::string macro_name(buffer0.begin(), buffer0.end());
-                        std::string macro_val(buffer1.begin(), buffer1.end());
+                        std::string macro_name = buffer0;
+                        std::string macro_val = buffer1;
                         macros.insert({macro_name, macro_val});
 
                         buffer0.clear();
@@ -462,8 +530,8 @@ bool Yuasm::mainloop() {
                         }
 
                         if (DEBUG_LEVEL >= 1) {
-                            std::cout << "# Macro Definition Complete #\n"; // DEBUG
-                            std::cout << "Key: " << macro_name << ", Value: " << macro_val << "\n\n";
+                            *log_out << "# Macro Definition Complete #\n"; // DEBUG
+                            *log_out << "Key: " << macro_name << ", Value: " << macro_val << "\n\n";
                         }
                         break;
                     }
@@ -475,8 +543,8 @@ bool Yuasm::mainloop() {
                             break;
                         }
 
-                        std::string macro_name(buffer0.begin(), buffer0.end());
-                        std::string macro_val(buffer1.begin(), buffer1.end());
+                        std::string macro_name = buffer0;
+                        std::string macro_val = buffer1;
                         macros.insert({macro_name, macro_val});
 
                         buffer0.clear();
@@ -485,21 +553,28 @@ bool Yuasm::mainloop() {
                         state = COMMENT_SCAN_BEGIN; // guaranteed to be line comment
 
                         if (DEBUG_LEVEL >= 1) {
-                            std::cout << "# Macro Definition Complete #\n"; // DEBUG
-                            std::cout << "Key: " << macro_name << ", Value: " << macro_val << "\n\n";
+                            *log_out << "# Macro Definition Complete #\n"; // DEBUG
+                            *log_out << "Key: " << macro_name << ", Value: " << macro_val << "\n\n";
+                        }
+                        break;
+                    }
+
+                    case PAREN_OPEN: {
+                        if (!begin_expr()) {
+                            return false;
                         }
                         break;
                     }
 
                     case SC: {
                         print_line_to_std_err();
-                        std::cerr << "Error: semicolon not allowed after preprocessor directives" << newl;
+                        *log_err << "Error: semicolon not allowed after preprocessor directives" << newl;
                         return false;
                     }
 
                     default: {
                         print_line_to_std_err();
-                        std::cerr << "Error: invalid character for macro value: " << ch << newl;
+                        *log_err << "Error: invalid character for macro value: " << ch << newl;
                         return false;
                     }
                 }
@@ -527,13 +602,13 @@ bool Yuasm::mainloop() {
                         }
 
                         print_line_to_std_err();
-                        std::cerr << "Error: expected double quote mark ('\"') but got '/'" << newl;
+                        *log_err << "Error: expected double quote mark ('\"') but got '/'" << newl;
                         return false;
                     }
 
                     default: {
                         print_line_to_std_err();
-                        std::cerr << "Error: invalid character: " << ch << newl;
+                        *log_err << "Error: invalid character: " << ch << newl;
                         return false;
                     }
                 }
@@ -559,36 +634,44 @@ bool Yuasm::mainloop() {
                     }
                     
                     case QUOTE: {
-                        std::string fpath(buffer0.begin(), buffer0.end());
+                        std::string fpath = buffer0;
                         std::filesystem::path cur_fpath = fnames.top();
                         std::filesystem::path parent_folder_path = cur_fpath.parent_path();
                         parent_folder_path /= "";
                         std::string folder_str = parent_folder_path.string();
                         fpath = folder_str + fpath;
-                        std::unique_ptr<std::ifstream> file = std::make_unique<std::ifstream>(fpath);
-                        if (!(*file)) {
+                        std::unique_ptr<SourceFile> file = std::make_unique<SourceFile>();
+                        if (!read_source(fpath, file.get())) {
                             print_line_to_std_err();
-                            std::cerr << "Error: file not found: " << fpath << std::endl;
+                            *log_err << "Error: file not found: " << fpath << std::endl;
                             return false;
                         }
+                        if (options.stats != nullptr) {
+                            options.stats->count("asm.bytes_in", file->text.size());
+                        }
                         files.push(std::move(file));
                         line_counters.push(1);
                         line_buffer.clear();
                         fnames.push(fpath);
+                        dependencies.push_back(fpath);
+
+                        if (options.stats != nullptr) {
+                            options.stats->count_max("asm.include_depth_max", files.size() - 1);
+                        }
 
                         buffer0.clear();
                         state = SCAN_FIRST;
 
                         if (DEBUG_LEVEL >= 1) {
-                            std::cout << "# Include Complete #\n"; // DEBUG
-                            std::cout << "File name: " << fpath << "\n\n";
+                            *log_out << "# Include Complete #\n"; // DEBUG
+                            *log_out << "File name: " << fpath << "\n\n";
                         }
                         break;
                     }
 
                     default: { // EOF
                         print_line_to_std_err();
-                        std::cerr << "Error: invalid file name\n";
+                        *log_err << "Error: invalid file name\n";
                         return false;
                     }
                 }
@@ -605,7 +688,7 @@ bool Yuasm::mainloop() {
 
                     case NUM: {
                         print_line_to_std_err();
-                        std::cerr << "Error: function names can't begin with numbers" << newl;
+                        *log_err << "Error: function names can't begin with numbers" << newl;
                         return false;
                     }
 
@@ -623,13 +706,13 @@ bool Yuasm::mainloop() {
                         }
 
                         print_line_to_std_err();
-                        std::cerr << "Error: missing function name" << newl;
+                        *log_err << "Error: missing function name" << newl;
                         return false;
                     }
 
                     default: {
                         print_line_to_std_err();
-                        std::cerr << "Error: invalid character: " << ch << newl;
+                        *log_err << "Error: invalid character: " << ch << newl;
                         return false;
                     }
                 }
@@ -639,6 +722,19 @@ bool Yuasm::mainloop() {
 
 
             case SCAN_FUNC_NAME: {
+                // .data, .text, .word, .fill, .ascii, .global and .local, the name directly followed by a colon is still a section
+                if (is_data_directive(buffer0) || is_visibility_directive(buffer0)) {
+                    if (category == SP || category == CR) {
+                        state = SCAN_DIRECTIVE_ARGS;
+                        break;
+                    } else if (category == LF || category == SC || category == SLASH) {
+                        if (!finish_directive((Input) category)) {
+                            return false;
+                        }
+                        break;
+                    }
+                }
+
                 switch (category) {
                     case AL:
                     case NUM: {
@@ -648,8 +744,19 @@ bool Yuasm::mainloop() {
 
                     case COLON:
                     case SP: {
-                        std::string buffer_str(buffer0.begin(), buffer0.end());
-                        functions.insert({buffer_str, pc});
+                        if (!macro_calls.empty() && macro_calls.back().file_depth == files.size()) {
+                            const std::vector<std::string>& labels = macro_calls.back().macro->labels;
+                            if (std::find(labels.begin(), labels.end(), buffer0) != labels.end()) {
+                                substitute_macro(&buffer0); // every expansion defines its own copy of the label
+                            }
+                        }
+
+                        std::string_view buffer_str = symbols.intern(buffer0);
+                        if (in_data) {
+                            data_labels.insert({buffer_str, (int) data.size() * 4});
+                        } else {
+                            functions.insert({buffer_str, pc});
+                        }
 
                         buffer0.clear();
 
@@ -660,9 +767,9 @@ bool Yuasm::mainloop() {
                         }
 
                         if (DEBUG_LEVEL >= 1) {
-                            std::cout << "# Function Definition Complete #\n";
-                            std::cout << "Function name: " << buffer_str << newl;
-                            std::cout << "Function address: " << pc << "\n\n";
+                            *log_out << "# Function Definition Complete #\n";
+                            *log_out << "Function name: " << buffer_str << newl;
+                            *log_out << "Function address: " << pc << "\n\n";
                         }
                         break;
                     }
@@ -674,11 +781,11 @@ bool Yuasm::mainloop() {
                             break;
                         } else {
                             print_line_to_std_err();
-                            std::cerr << "Error: expected colon" << newl;
+                            *log_err << "Error: expected colon" << newl;
                             return false;
                         }
 
-                        std::string buffer_str(buffer0.begin(), buffer0.end());
+                        std::string_view buffer_str = symbols.intern(buffer0);
                         functions.insert({buffer_str, pc});
 
                         buffer0.clear();
@@ -690,16 +797,16 @@ bool Yuasm::mainloop() {
                         }
 
                         if (DEBUG_LEVEL >= 1) {
-                            std::cout << "# Function Definition Complete #\n";
-                            std::cout << "Function name: " << buffer_str << newl;
-                            std::cout << "Function address: " << pc << "\n\n";
+                            *log_out << "# Function Definition Complete #\n";
+                            *log_out << "Function name: " << buffer_str << newl;
+                            *log_out << "Function address: " << pc << "\n\n";
                         }
                         break;
                     }
 
                     default: {
                         print_line_to_std_err();
-                        std::cerr << "Error: invalid character in function name: " << ch << newl;
+                        *log_err << "Error: invalid character in function name: " << ch << newl;
                         return false;
                     }
                 }
@@ -727,15 +834,70 @@ bool Yuasm::mainloop() {
                         }
 
                         print_line_to_std_err();
-                        std::cerr << "Error: missing colon" << newl;
+                        *log_err << "Error: missing colon" << newl;
                         return false;
                     }
 
                     default: {
                         print_line_to_std_err();
-                        std::cerr << "Error: invalid character: " << ch << newl;
+                        *log_err << "Error: invalid character: " << ch << newl;
+                        return false;
+                    }
+                }
+                break;
+            }
+
+
+
+            case SCAN_DIRECTIVE_ARGS: {
+                if (args_quote) { // everything goes into the string until the closing quote
+                    if (category == LF) {
+                        print_line_to_std_err();
+                        *log_err << "Error: missing closing quote" << newl;
                         return false;
                     }
+                    buffer1.push_back(ch);
+                    if (args_escape) {
+                        args_escape = false;
+                    } else if (ch == '\\') {
+                        args_escape = true;
+                    } else if (category == QUOTE) {
+                        args_quote = false;
+                    }
+                    break;
+                }
+
+                switch (category) {
+                    case QUOTE: {
+                        args_quote = true;
+                        buffer1.push_back(ch);
+                        break;
+                    }
+
+                    case SLASH: {
+                        Input next = get_next_char_category();
+                        if (next == SLASH || next == AST) {
+                            if (!finish_directive(SLASH)) {
+                                return false;
+                            }
+                        } else {
+                            buffer1.push_back(ch); // division in an expression
+                        }
+                        break;
+                    }
+
+                    case LF:
+                    case SC: {
+                        if (!finish_directive((Input) category)) {
+                            return false;
+                        }
+                        break;
+                    }
+
+                    default: {
+                        buffer1.push_back(ch); // the arguments are checked as a whole
+                        break;
+                    }
                 }
                 break;
             }
@@ -747,8 +909,7 @@ bool Yuasm::mainloop() {
                     case SC:
                     case LF:
                     case CR: { // these are invalid, we expect a parameter
-                        std::string instr(buffer0.begin(), buffer0.end());
-                        if (!eval_instr(instr, params)) {
+                        if (!eval_instr(buffer0, params, n_params)) {
                             return false;
                         }
 
@@ -773,8 +934,7 @@ bool Yuasm::mainloop() {
                             break;
                         }
 
-                        std::string instr(buffer0.begin(), buffer0.end());
-                        if (!eval_instr(instr, params)) {
+                        if (!eval_instr(buffer0, params, n_params)) {
                             return false;
                         }
 
@@ -796,7 +956,7 @@ bool Yuasm::mainloop() {
                             buffer0.push_back(ch);
                         } else {
                             print_line_to_std_err();
-                            std::cerr << "Error: identifiers can't begin with numbers\n";
+                            *log_err << "Error: identifiers can't begin with numbers\n";
                             return false;
                         }
                         break;
@@ -804,14 +964,14 @@ bool Yuasm::mainloop() {
 
                     case SP: {
                         // First check if it's a macro expansion
-                        expand_macro(&buffer0, macros);
+                        substitute_macro(&buffer0);
                         
-                        std::string buffer_str(buffer0.begin(), buffer0.end());
+                        const std::string& buffer_str = buffer0;
                         if (get_no_of_params_for_instr(buffer_str) >= 0) { // means instruction is valid
                             state = SCAN_PARAM_NO_COMMA_YES_DASH;
                         } else {
                             print_line_to_std_err();
-                            std::cerr << "Error: invalid instruction (1): " << buffer_str << newl;
+                            *log_err << "Error: invalid instruction (1): " << buffer_str << newl;
                             return false;
                         }
                         break;
@@ -821,16 +981,62 @@ bool Yuasm::mainloop() {
                     // spaces after the function name are not allowed
                     // More important note: this is redundant due to the jump instruction
                     // TODO maybe actually implement func() calls
+                    // #macro macros are called like this too, with their arguments between the parentheses
                     case PAREN_OPEN: {
+                        if (function_macros.find(buffer0) != function_macros.end()) {
+                            macro_args_depth = 0;
+                            state = SCAN_MACRO_ARGS;
+                            break;
+                        }
                         state = WAIT_PAREN_CLOSE;
                         break;
                     }
 
                     default: {
                         print_line_to_std_err();
-                        std::cerr << "Error: invalid character for instruction or macro: " << ch << newl;
+                        *log_err << "Error: invalid character for instruction or macro: " << ch << newl;
+                        return false;
+                    }
+                }
+                break;
+            }
+
+
+
+            case SCAN_MACRO_ARGS: {
+                switch (category) {
+                    case PAREN_OPEN: {
+                        macro_args_depth++;
+                        buffer1.push_back(ch);
+                        break;
+                    }
+
+                    case PAREN_CLOSE: {
+                        if (macro_args_depth > 0) {
+                            macro_args_depth--;
+                            buffer1.push_back(ch);
+                            break;
+                        }
+
+                        if (!begin_macro_call()) {
+                            return false;
+                        }
+                        buffer0.clear();
+                        buffer1.clear();
+                        state = SC_OR_COMMENT_UNTIL_LF;
+                        break;
+                    }
+
+                    case LF: {
+                        print_line_to_std_err();
+                        *log_err << "Error: expected ')'\n";
                         return false;
                     }
+
+                    default: {
+                        buffer1.push_back(ch); // the arguments are split at the closing parenthesis
+                        break;
+                    }
                 }
                 break;
             }
@@ -840,11 +1046,11 @@ bool Yuasm::mainloop() {
             case WAIT_PAREN_CLOSE: {
                 switch (category) {
                     case PAREN_CLOSE: {
-                        std::string buffer_str(buffer0.begin(), buffer0.end());
-                        int func_pc = functions[buffer_str];
+                        auto func_it = functions.find(buffer0);
+                        int func_pc = (func_it != functions.end()) ? func_it->second : 0;
                         
                         if (DEBUG_LEVEL >= 1) {
-                            std::cout << "# Calling function " << buffer_str << " at address " << func_pc << " #\n\n";
+                            *log_out << "# Calling function " << buffer0 << " at address " << func_pc << " #\n\n";
                         }
 
                         buffer0.clear();
@@ -855,7 +1061,7 @@ bool Yuasm::mainloop() {
                     // No spaces or anything between the parentheses
                     default: {
                         print_line_to_std_err();
-                        std::cerr << "Error: expected ')'\n";
+                        *log_err << "Error: expected ')'\n";
                         return false;
                     }
                 }
@@ -867,6 +1073,9 @@ bool Yuasm::mainloop() {
             case SCAN_PARAM_NO_COMMA_NO_DASH:
             case SCAN_PARAM_NO_COMMA_YES_DASH:
             case SCAN_PARAM_YES_COMMA_YES_DASH: {
+                if (after_expr && !end_expr_param((Input) category, ch)) {
+                    return false;
+                }
                 switch (category) {
                     case NUM:
                     case AL: {
@@ -879,7 +1088,7 @@ bool Yuasm::mainloop() {
                             break; // allow leading spaces
                         }
 
-                        expand_macro(&buffer1, macros);
+                        substitute_macro(&buffer1);
                         if (state == SCAN_PARAM_NO_COMMA_NO_DASH) {
                             if (buffer1.at(0) == '-') { // if there's a negative sign in the macro and a negative sign before it, cancel out the negatives
                                 buffer1.erase(buffer1.begin());
@@ -887,13 +1096,14 @@ bool Yuasm::mainloop() {
                                 buffer1.insert(buffer1.begin(), '-');
                             }
                         }
-                        std::string param(buffer1.begin(), buffer1.end());
-                        params.push_back(param);
+                        if (!push_param()) {
+                            return false;
+                        }
                         buffer1.clear();
                         state = SCAN_PARAM_YES_COMMA_YES_DASH;
 
                         if (DEBUG_LEVEL >= 2) {
-                            std::cout << "Saved parameter: " << param << " at SCAN_PARAM_X case SP" << newl;
+                            *log_out << "Saved parameter: " << params[n_params - 1] << " at SCAN_PARAM_X case SP" << newl;
                         }
                         break;
                     }
@@ -901,7 +1111,7 @@ bool Yuasm::mainloop() {
                     case LF:
                     case SC: {
                         if (buffer1.size() > 0) {
-                            expand_macro(&buffer1, macros);
+                            substitute_macro(&buffer1);
                             if (state == SCAN_PARAM_NO_COMMA_NO_DASH) {
                                 if (buffer1.at(0) == '-') { // if there's a negative sign in the macro and a negative sign before it, cancel out the negatives
                                     buffer1.erase(buffer1.begin());
@@ -909,11 +1119,12 @@ bool Yuasm::mainloop() {
                                     buffer1.insert(buffer1.begin(), '-');
                                 }
                             }
-                            std::string param(buffer1.begin(), buffer1.end());
-                            params.push_back(param);
+                            if (!push_param()) {
+                                return false;
+                            }
 
                             if (DEBUG_LEVEL >= 2) {
-                                std::cout << "Saved parameter: " << param << " at SCAN_PARAM_X case LF SLASH SC" << newl;
+                                *log_out << "Saved parameter: " << params[n_params - 1] << " at SCAN_PARAM_X case LF SLASH SC" << newl;
                             }
                         } else {
                             if (state == SCAN_PARAM_NO_COMMA_YES_DASH || state == SCAN_PARAM_NO_COMMA_NO_DASH) {
@@ -924,24 +1135,23 @@ bool Yuasm::mainloop() {
                                 // we can make sure it's not sure first case by checking if there are any parameters
                                 // if it's a no parameter instruction we don't want to throw an error
                                 if (DEBUG_LEVEL >= 2) {
-                                    std::cout << "params.size(): " << params.size() << ", buffer1.size(): " << buffer1.size() << newl;
+                                    *log_out << "n_params: " << n_params << ", buffer1.size(): " << buffer1.size() << newl;
                                 }
-                                if (params.size() > 0 && buffer1.empty()) { // buffer1.empty() is guaranteed but still
+                                if (n_params > 0 && buffer1.empty()) { // buffer1.empty() is guaranteed but still
                                     print_line_to_std_err();
-                                    std::cerr << "Error: comma not allowed here" << newl;
+                                    *log_err << "Error: comma not allowed here" << newl;
                                     return false;
                                 }
                             }
                         }
 
-                        std::string instr(buffer0.begin(), buffer0.end());
-                        if (!eval_instr(instr, params)) {
+                        if (!eval_instr(buffer0, params, n_params)) {
                             return false;
                         }
 
                         buffer1.clear();
                         buffer0.clear();
-                        params.clear();
+                        n_params = 0;
                         pc += 4;
 
                         if (category == LF) {
@@ -950,7 +1160,7 @@ bool Yuasm::mainloop() {
                             state = NOTHING_OR_COMMENT_UNTIL_LF;
                         } else {
                             print_line_to_std_err();
-                            std::cerr << "Error: Invalid char: " << ch << newl;
+                            *log_err << "Error: Invalid char: " << ch << newl;
                             return false;
                         }
                         break;
@@ -964,7 +1174,7 @@ bool Yuasm::mainloop() {
                         }
 
                         if (buffer1.size() > 0) {
-                            expand_macro(&buffer1, macros);
+                            substitute_macro(&buffer1);
                             if (state == SCAN_PARAM_NO_COMMA_NO_DASH) {
                                 if (buffer1.at(0) == '-') { // if there's a negative sign in the macro and a negative sign before it, cancel out the negatives
                                     buffer1.erase(buffer1.begin());
@@ -972,11 +1182,12 @@ bool Yuasm::mainloop() {
                                     buffer1.insert(buffer1.begin(), '-');
                                 }
                             }
-                            std::string param(buffer1.begin(), buffer1.end());
-                            params.push_back(param);
+                            if (!push_param()) {
+                                return false;
+                            }
 
                             if (DEBUG_LEVEL >= 2) {
-                                std::cout << "Saved parameter: " << param << " at SCAN_PARAM_X case LF SLASH SC" << newl;
+                                *log_out << "Saved parameter: " << params[n_params - 1] << " at SCAN_PARAM_X case LF SLASH SC" << newl;
                             }
                         } else {
                             if (state == SCAN_PARAM_NO_COMMA_YES_DASH || state == SCAN_PARAM_NO_COMMA_NO_DASH) {
@@ -987,24 +1198,23 @@ bool Yuasm::mainloop() {
                                 // we can make sure it's not sure first case by checking if there are any parameters
                                 // if it's a no parameter instruction we don't want to throw an error
                                 if (DEBUG_LEVEL >= 2) {
-                                    std::cout << "params.size(): " << params.size() << ", buffer1.size(): " << buffer1.size() << newl;
+                                    *log_out << "n_params: " << n_params << ", buffer1.size(): " << buffer1.size() << newl;
                                 }
-                                if (params.size() > 0 && buffer1.empty()) { // buffer1.empty() is guaranteed but still
+                                if (n_params > 0 && buffer1.empty()) { // buffer1.empty() is guaranteed but still
                                     print_line_to_std_err();
-                                    std::cerr << "Error: comma not allowed here" << newl;
+                                    *log_err << "Error: comma not allowed here" << newl;
                                     return false;
                                 }
                             }
                         }
 
-                        std::string instr(buffer0.begin(), buffer0.end());
-                        if (!eval_instr(instr, params)) {
+                        if (!eval_instr(buffer0, params, n_params)) {
                             return false;
                         }
 
                         buffer1.clear();
                         buffer0.clear();
-                        params.clear();
+                        n_params = 0;
                         pc += 4;
 
                         state_before_block_comment = state; // not necessary since guaranteed to be line comment?
@@ -1019,12 +1229,12 @@ bool Yuasm::mainloop() {
                                 state = SCAN_PARAM_NO_COMMA_NO_DASH;
                             } else {
                                 print_line_to_std_err();
-                                std::cerr << "Error: can't have negative sign in the middle of an identifier" << newl;
+                                *log_err << "Error: can't have negative sign in the middle of an identifier" << newl;
                                 return false;
                             }
                         } else if (state == SCAN_PARAM_NO_COMMA_NO_DASH) {
                             print_line_to_std_err();
-                            std::cerr << "Error: double negation is not allowed" << newl;
+                            *log_err << "Error: double negation is not allowed" << newl;
                             return false;
                         }
                         break;
@@ -1038,37 +1248,46 @@ bool Yuasm::mainloop() {
                             if (buffer1.empty()) {
                                 state = SCAN_PARAM_NO_COMMA_YES_DASH;
                             } else {
-                                expand_macro(&buffer1, macros);
-                                std::string param(buffer1.begin(), buffer1.end());
-                                params.push_back(param);
+                                substitute_macro(&buffer1);
+                                if (!push_param()) {
+                                    return false;
+                                }
                                 state = SCAN_PARAM_NO_COMMA_YES_DASH;
                                 buffer1.clear();
 
                                 if (DEBUG_LEVEL >= 2) {
-                                    std::cout << "Saved parameter: " << param << " at SCAN_PARAM_YES_COMMA_YES_DASH" << newl;
+                                    *log_out << "Saved parameter: " << params[n_params - 1] << " at SCAN_PARAM_YES_COMMA_YES_DASH" << newl;
                                 }
                             }
                         } else if (state == SCAN_PARAM_NO_COMMA_NO_DASH || state == SCAN_PARAM_NO_COMMA_YES_DASH) {
                             if (buffer1.empty()) {
                                 print_line_to_std_err();
-                                std::cerr << "Error: comma not allowed here" << newl;
+                                *log_err << "Error: comma not allowed here" << newl;
                                 return false;
                             } else {
                                 // being here means the comma is used to terminate a parameter which is ok
-                                expand_macro(&buffer1, macros);
-                                std::string param(buffer1.begin(), buffer1.end());
-                                params.push_back(param);
+                                substitute_macro(&buffer1);
+                                if (!push_param()) {
+                                    return false;
+                                }
                                 state = SCAN_PARAM_YES_COMMA_YES_DASH;
                                 buffer1.clear();
 
                                 if (DEBUG_LEVEL >= 2) {
-                            std::cout << "Saved parameter: " << param << " at SCAN_PARAM_NO_COMMA_X" << newl;
-                        }
+                                    *log_out << "Saved parameter: " << params[n_params - 1] << " at SCAN_PARAM_NO_COMMA_X" << newl;
+                                }
                             }
                         }
                         break;
                     }
 
+                    case PAREN_OPEN: {
+                        if (!begin_expr()) {
+                            return false;
+                        }
+                        break;
+                    }
+
                     case CR: {
                         // TODO ignore for now
                         break;
@@ -1076,9 +1295,43 @@ bool Yuasm::mainloop() {
 
                     default: {
                         print_line_to_std_err();
-                        std::cerr << "Error: invalid character: " << ch << newl;
+                        *log_err << "Error: invalid character: " << ch << newl;
+                        return false;
+                    }
+                }
+                break;
+            }
+
+
+
+            case SCAN_EXPR: {
+                switch (category) {
+                    case LF: {
+                        print_line_to_std_err();
+                        *log_err << "Error: unterminated constant expression, expected ')'" << newl;
                         return false;
                     }
+
+                    case PAREN_OPEN: {
+                        expr_buffer.push_back(ch);
+                        expr_depth++;
+                        break;
+                    }
+
+                    case PAREN_CLOSE: {
+                        expr_buffer.push_back(ch);
+                        expr_depth--;
+                        if (expr_depth == 0 && !finish_expr()) {
+                            return false;
+                        }
+                        break;
+                    }
+
+                    default: {
+                        // operators, operands and spaces, the evaluator checks the syntax
+                        expr_buffer.push_back(ch);
+                        break;
+                    }
                 }
                 break;
             }
@@ -1087,60 +1340,261 @@ bool Yuasm::mainloop() {
         if (ch == '\n') {
             line_buffer.clear();
             line_counters.top()++;
+            if (line_action != NO_LINE_ACTION && !end_of_line_action()) {
+                return false;
+            }
         } else {
             line_buffer.push_back(ch); // used to print error info
         }
     }
 
-    write_object();
-    link_object();
+    if (options.stats != nullptr) {
+        options.stats->count("asm.chars_scanned", chars_scanned);
+    }
 
     if (DEBUG_LEVEL >= 1) {
-        std::cout << "########\n\n";
-        std::cout << "List of Macros:\n";
+        *log_out << "########\n\n";
+        *log_out << "List of Macros:\n";
         for (auto it = macros.begin(); it != macros.end(); ++it) {
-            std::cout << "Key: " << it->first << ", Value: " << it->second << newl;
+            *log_out << "Key: " << it->first << ", Value: " << it->second << newl;
         }
 
-        std::cout << newl;
-        std::cout << "List of Functions:\n";
+        *log_out << newl;
+        *log_out << "List of Functions:\n";
         for (auto it = functions.begin(); it != functions.end(); ++it) {
-            std::cout << "Function: " << it->first << ", Address: " << it->second << newl;
+            *log_out << "Function: " << it->first << ", Address: " << it->second << newl;
+        }
+        *log_out << newl;
+    }
+
+    return true;
+}
+
+bool Yuasm::assemble_parallel() {
+    SourceSplit split = split_source(files.top()->text, options.jobs, options.min_chunk_bytes);
+    if (split.chunks.size() < 2) {
+        return mainloop();
+    }
+
+    // The first chunk has all the includes, it is assembled here so its macros are known before the workers start
+    std::string text = std::move(files.top()->text);
+    std::string fname = fnames.top();
+    files.top()->text = text.substr(0, split.chunks[0].end);
+    files.top()->pos = 0;
+    if (!mainloop()) {
+        return false;
+    }
+
+    struct Worker {
+        Yuasm yuasm;
+        std::stringstream out; // read back with rdbuf, which an ostringstream doesn't allow
+        std::stringstream err;
+        Stats stats;
+        bool ok = false;
+        std::exception_ptr exception;
+    };
+
+    size_t n_workers = split.chunks.size() - 1;
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::vector<std::thread> threads;
+    size_t next_define = 0;
+    std::string defines; // the #define lines before the current chunk, replayed by its worker
+    for (size_t i=0; i<n_workers; i++) {
+        const SourceSplit::Chunk& chunk = split.chunks[i + 1];
+        while (next_define < split.define_lines.size() && split.define_lines[next_define].first < chunk.begin) {
+            defines.append(text, split.define_lines[next_define].first, split.define_lines[next_define].second - split.define_lines[next_define].first);
+            defines.push_back('\n');
+            next_define++;
+        }
+
+        workers.push_back(std::make_unique<Worker>());
+        Worker* worker = workers.back().get();
+        worker->yuasm.options = options;
+        worker->yuasm.options.stats = nullptr; // replaying the defines isn't counted, serial assembly scans them once
+        worker->yuasm.macros = macros;
+        worker->yuasm.function_macros = function_macros; // #macro is a directive, so they are all in the first chunk
+        worker->yuasm.log_out = &worker->out;
+        worker->yuasm.log_err = &worker->err;
+
+        auto prelude = std::make_unique<SourceFile>();
+        prelude->text = defines;
+        auto body = std::make_unique<SourceFile>();
+        body->text = text.substr(chunk.begin, chunk.end - chunk.begin);
+
+        Stats* stats = (options.stats != nullptr) ? &worker->stats : nullptr;
+        threads.emplace_back([worker, stats, fname, first_line = chunk.first_line, prelude = std::move(prelude), body = std::move(body)]() mutable {
+            Yuasm& yuasm = worker->yuasm;
+            try {
+                yuasm.files.push(std::move(prelude));
+                yuasm.fnames.push(fname);
+                yuasm.line_counters.push(1);
+                if (!yuasm.mainloop()) {
+                    return;
+                }
+
+                yuasm.options.stats = stats;
+                yuasm.chars_scanned = 0;
+                yuasm.files.push(std::move(body));
+                yuasm.fnames.push(fname);
+                yuasm.line_counters.push(first_line);
+                worker->ok = yuasm.mainloop();
+            } catch (...) {
+                worker->exception = std::current_exception();
+            }
+        });
+    }
+
+    Stats::Timer timer(options.stats, Stats::LEXING);
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+
+    // Stitch the chunks together in source order, everything a worker found is relative to its own pc of zero,
+    // and its macro expansions are numbered from zero as well
+    int expansion_offset = macro_expansions;
+    for (std::unique_ptr<Worker>& worker : workers) {
+        if (worker->out.tellp() > 0) {
+            *log_out << worker->out.rdbuf();
+        }
+        if (worker->err.tellp() > 0) {
+            *log_err << worker->err.rdbuf();
+        }
+        if (worker->exception) {
+            std::rethrow_exception(worker->exception);
+        }
+        if (!worker->ok) {
+            return false;
+        }
+
+        Yuasm& chunk = worker->yuasm;
+        bool renumber = (chunk.macro_expansions > 0 && expansion_offset > 0);
+        for (auto it = chunk.functions.begin(); it != chunk.functions.end(); ++it) {
+            std::string_view name = renumber ? symbols.intern(renumber_local_label(it->first, expansion_offset)) : it->first;
+            if (functions.find(name) == functions.end()) {
+                functions.insert({symbols.intern(name), it->second + pc});
+            }
+        }
+        for (auto it = chunk.callers.begin(); it != chunk.callers.end(); ++it) {
+            std::string_view name = renumber ? symbols.intern(renumber_local_label(it->first, expansion_offset)) : it->first;
+            callers.push_back({symbols.intern(name), it->second + pc});
+        }
+        expansion_offset += chunk.macro_expansions;
+        for (std::string_view name : chunk.global_names) {
+            global_names.insert(symbols.intern(name));
+        }
+        for (std::string_view name : chunk.local_names) {
+            local_names.insert(symbols.intern(name));
+        }
+        instructions.insert(instructions.end(), chunk.instructions.begin(), chunk.instructions.end());
+        encoding_hits += chunk.encoding_hits;
+        encoding_misses += chunk.encoding_misses;
+        pc += chunk.pc;
+        macro_expansions = expansion_offset;
+
+        if (options.stats != nullptr) {
+            options.stats->merge(worker->stats);
+            options.stats->count("asm.parallel_chunks");
         }
-        std::cout << newl;
     }
 
     return true;
 }
 
-bool Yuasm::eval_instr(std::string instr, std::vector<std::string> params) {
+bool Yuasm::eval_instr(std::string_view instr, const std::array<std::string, MAX_PARAMS>& params, int n_params) {
+    Stats::Timer timer(options.stats, Stats::ENCODING);
+    if (options.stats != nullptr) {
+        options.stats->count("asm.instructions." + std::string(instr));
+    }
+
     if (DEBUG_LEVEL >= 1) {
-        std::cout << "# Instruction Complete #\n";
-        std::cout << "Instruction: " << instr << newl;
-        for (int i=0; i<params.size(); i++) {
-            std::cout << "Parameter: " << params[i] << newl;
+        *log_out << "# Instruction Complete #\n";
+        *log_out << "Instruction: " << instr << newl;
+        for (int i=0; i<n_params; i++) {
+            *log_out << "Parameter: " << params[i] << newl;
         }
-        std::cout << newl;
+        *log_out << newl;
+    }
+
+    encoding_key.assign(instr);
+    for (int i=0; i<n_params; i++) {
+        encoding_key.push_back('\n'); // can't be part of a parameter
+        encoding_key.append(params[i]);
+    }
+    auto cached = encoding_cache.find(encoding_key);
+    if (cached != encoding_cache.end() && !in_data) {
+        instructions.push_back(cached->second.word);
+        *log_out << cached->second.listing;
+        encoding_hits++;
+        return true;
+    }
+    encoding_misses++;
+
+    // A line that uses a symbol also adds a caller at its pc, which a cached word would leave out.
+    // Symbols are the only parameters that don't start with a digit or a minus, so those lines
+    // and the ones that don't fit in the cache anymore are encoded without capturing the listing.
+    bool may_relocate = false;
+    for (int i=0; i<n_params; i++) {
+        may_relocate = may_relocate || (!params[i].empty() && !is_numeric(params[i][0]) && params[i][0] != '-');
+    }
+    if (may_relocate || encoding_cache.size() >= MAX_ENCODING_CACHE) {
+        return encode_instr(instr, params, n_params);
+    }
+
+    // The listing line is kept with the word, so a hit prints the same output
+    size_t n_callers = callers.size();
+    std::ostream* listing_out = log_out;
+    listing_buffer.text.clear();
+    log_out = &encoding_listing;
+    bool encoded = encode_instr(instr, params, n_params);
+    log_out = listing_out;
+    log_out->write(listing_buffer.text.data(), listing_buffer.text.size());
+    if (!encoded) {
+        return false;
+    }
+
+    if (callers.size() == n_callers) {
+        encoding_cache.insert({encoding_key, {instructions.back(), listing_buffer.text}});
+    }
+    return true;
+}
+
+ListingBuffer::int_type ListingBuffer::overflow(int_type ch) {
+    if (!traits_type::eq_int_type(ch, traits_type::eof())) {
+        text.push_back(traits_type::to_char_type(ch));
     }
+    return traits_type::not_eof(ch);
+}
+
+std::streamsize ListingBuffer::xsputn(const char* s, std::streamsize n) {
+    text.append(s, n);
+    return n;
+}
 
+bool Yuasm::encode_instr(std::string_view instr, const std::array<std::string, MAX_PARAMS>& params, int n_params) {
     int no_of_params = get_no_of_params_for_instr(instr);
     if (no_of_params < 0) {
         print_line_to_std_err();
-        std::cerr << "Error: invalid instruction (2): " << instr << newl;
+        *log_err << "Error: invalid instruction (2): " << instr << newl;
+        return false;
+    }
+
+    if (in_data) {
+        print_line_to_std_err();
+        *log_err << "Error: instructions aren't allowed in a data section, use .text first" << newl;
         return false;
     }
 
-    if (no_of_params != params.size()) {
+    if (no_of_params != n_params) {
         print_line_to_std_err();
-        std::cerr << "Error: expected " << no_of_params << " arguments, got " << params.size() << newl;
+        *log_err << "Error: expected " << no_of_params << " arguments, got " << n_params << newl;
         return false;
     }
 
-    for (int i=0; i<params.size(); i++) { // check for illegal negatives
+    for (int i=0; i<n_params; i++) { // check for illegal negatives
         if (params[i][0] == '-') {
             if (instr != "loadm") {
                 print_line_to_std_err();
-                std::cerr << "Error: parameter can not be negative: " << params[i] << newl;
+                *log_err << "Error: parameter can not be negative: " << params[i] << newl;
                 return false;
             }
         }
@@ -1157,19 +1611,25 @@ bool Yuasm::eval_instr(std::string instr, std::vector<std::string> params) {
 
         if (params[0][0] == '-') {
             print_line_to_std_err();
-            std::cerr << "Error: rd value can not be negative\n";
+            *log_err << "Error: rd value can not be negative\n";
             return false;
         }
 
         uint32_t rd = param_to_int(params[0]) & 0xF;
-        uint32_t val = param_to_int(params[1]) & 0xFFFFF;
+        uint32_t val = 0;
+        if (is_alphabetic(params[1][0])) {
+            // A data label, the linker puts its address here
+            callers.push_back({symbols.intern(params[1]), pc});
+        } else {
+            val = param_to_int(params[1]) & 0xFFFFF;
+        }
 
         instr_int |= rd << 20;
         instr_int |= val;
         instr_int |= 0x0 << 24;
 
         if (DEBUG_LEVEL >= 0) {
-            std::cout << "Unsigned Load Immediate, rd=" << rd << ", val=" << val << " --> " << get_instr_as_hex(instr_int) << newl;
+            *log_out << "Unsigned Load Immediate, rd=" << rd << ", val=" << val << " --> " << get_instr_as_hex(instr_int) << newl;
         }
 
     } else if (instr == "loadm") {
@@ -1177,20 +1637,24 @@ bool Yuasm::eval_instr(std::string instr, std::vector<std::string> params) {
 
         if (params[0][0] == '-') {
             print_line_to_std_err();
-            std::cerr << "Error: rd value can not be negative\n";
+            *log_err << "Error: rd value can not be negative\n";
             return false;
         }
 
         bool neg = false;
-        if (params[1][0] == '-') {
+        std::string_view val_param = params[1];
+        if (val_param[0] == '-') {
             neg = true;
-            //std::cout << "old params 1: " << params[1] << newl;
-            params[1] = params[1].substr(1);
-            //std::cout << "new params 1: " << params[1] << newl;
+            val_param.remove_prefix(1);
         }
 
         uint32_t rd = param_to_int(params[0]) & 0xF;
-        uint32_t val = param_to_int(params[1]) & 0xFFFFF;
+        uint32_t val = 0;
+        if (!neg && is_alphabetic(val_param[0])) {
+            callers.push_back({symbols.intern(val_param), pc});
+        } else {
+            val = param_to_int(val_param) & 0xFFFFF;
+        }
         if (neg) {
             val = twos_complement(val) & 0xFFFFF;
         }
@@ -1200,7 +1664,7 @@ bool Yuasm::eval_instr(std::string instr, std::vector<std::string> params) {
         instr_int |= 0x1 << 24;
 
         if (DEBUG_LEVEL >= 0) {
-            std::cout << "Load Immediate, rd=" << rd << ", val=" << val << " --> " << get_instr_as_hex(instr_int) << newl;
+            *log_out << "Load Immediate, rd=" << rd << ", val=" << val << " --> " << get_instr_as_hex(instr_int) << newl;
         }
 
     } else if (instr == "loadr") {
@@ -1214,7 +1678,7 @@ bool Yuasm::eval_instr(std::string instr, std::vector<std::string> params) {
         instr_int |= 0x02 << 24;
 
         if (DEBUG_LEVEL >= 0) {
-            std::cout << "Load Direct, rd=" << rd << ", raddr=" << raddr << " --> " << get_instr_as_hex(instr_int) << newl;
+            *log_out << "Load Direct, rd=" << rd << ", raddr=" << raddr << " --> " << get_instr_as_hex(instr_int) << newl;
         }
 
     } else if (instr == "storen") {
@@ -1228,7 +1692,7 @@ bool Yuasm::eval_instr(std::string instr, std::vector<std::string> params) {
         instr_int |= 0x03 << 24;
 
         if (DEBUG_LEVEL >= 0) {
-            std::cout << "Store Indirect, raddr=" << raddr << ", rs=" << rs << " --> " << get_instr_as_hex(instr_int) << newl;
+            *log_out << "Store Indirect, raddr=" << raddr << ", rs=" << rs << " --> " << get_instr_as_hex(instr_int) << newl;
         }
 
     } else if (instr == "add") {
@@ -1244,7 +1708,7 @@ bool Yuasm::eval_instr(std::string instr, std::vector<std::string> params) {
         instr_int |= 0x10 << 24;
 
         if (DEBUG_LEVEL >= 0) {
-            std::cout << "Add, rd=" << rd << ", rs1=" << rs1 << ", rs2=" << rs2 << " --> " << get_instr_as_hex(instr_int) << newl;
+            *log_out << "Add, rd=" << rd << ", rs1=" << rs1 << ", rs2=" << rs2 << " --> " << get_instr_as_hex(instr_int) << newl;
         }
     } else if (instr == "sub") {
         // Arguments: rd, rs1, rs2
@@ -1259,7 +1723,7 @@ bool Yuasm::eval_instr(std::string instr, std::vector<std::string> params) {
         instr_int |= 0x11 << 24;
 
         if (DEBUG_LEVEL >= 0) {
-            std::cout << "Subtract, rd=" << rd << ", rs1=" << rs1 << ", rs2=" << rs2 << " --> " << get_instr_as_hex(instr_int) << newl;
+            *log_out << "Subtract, rd=" << rd << ", rs1=" << rs1 << ", rs2=" << rs2 << " --> " << get_instr_as_hex(instr_int) << newl;
         }
     } else if (instr == "lt") {
         // Arguments: rd, rs1, rs2
@@ -1274,7 +1738,7 @@ bool Yuasm::eval_instr(std::string instr, std::vector<std::string> params) {
         instr_int |= 0x50 << 24;
 
         if (DEBUG_LEVEL >= 0) {
-            std::cout << "Less Than, rd=" << rd << ", rs1=" << rs1 << ", rs2=" << rs2 << " --> " << get_instr_as_hex(instr_int) << newl;
+            *log_out << "Less Than, rd=" << rd << ", rs1=" << rs1 << ", rs2=" << rs2 << " --> " << get_instr_as_hex(instr_int) << newl;
         }
     } else if (instr == "lte") {
         // Arguments: rd, rs1, rs2
@@ -1289,7 +1753,7 @@ bool Yuasm::eval_instr(std::string instr, std::vector<std::string> params) {
         instr_int |= 0x51 << 24;
 
         if (DEBUG_LEVEL >= 0) {
-            std::cout << "Less Than or Equal To, rd=" << rd << ", rs1=" << rs1 << ", rs2=" << rs2 << " --> " << get_instr_as_hex(instr_int) << newl;
+            *log_out << "Less Than or Equal To, rd=" << rd << ", rs1=" << rs1 << ", rs2=" << rs2 << " --> " << get_instr_as_hex(instr_int) << newl;
         }
     } else if (instr == "gt") {
         // Arguments: rd, rs1, rs2
@@ -1304,7 +1768,7 @@ bool Yuasm::eval_instr(std::string instr, std::vector<std::string> params) {
         instr_int |= 0x52 << 24;
 
         if (DEBUG_LEVEL >= 0) {
-            std::cout << "Greater Than, rd=" << rd << ", rs1=" << rs1 << ", rs2=" << rs2 << " --> " << get_instr_as_hex(instr_int) << newl;
+            *log_out << "Greater Than, rd=" << rd << ", rs1=" << rs1 << ", rs2=" << rs2 << " --> " << get_instr_as_hex(instr_int) << newl;
         }
     } else if (instr == "gte") {
         // Arguments: rd, rs1, rs2
@@ -1319,7 +1783,7 @@ bool Yuasm::eval_instr(std::string instr, std::vector<std::string> params) {
         instr_int |= 0x53 << 24;
 
         if (DEBUG_LEVEL >= 0) {
-            std::cout << "Greater Than or Equal To, rd=" << rd << ", rs1=" << rs1 << ", rs2=" << rs2 << " --> " << get_instr_as_hex(instr_int) << newl;
+            *log_out << "Greater Than or Equal To, rd=" << rd << ", rs1=" << rs1 << ", rs2=" << rs2 << " --> " << get_instr_as_hex(instr_int) << newl;
         }
     } else if (instr == "eq") {
         // Arguments: rd, rs1, rs2
@@ -1334,17 +1798,17 @@ bool Yuasm::eval_instr(std::string instr, std::vector<std::string> params) {
         instr_int |= 0x54 << 24;
 
         if (DEBUG_LEVEL >= 0) {
-            std::cout << "Equal To, rd=" << rd << ", rs1=" << rs1 << ", rs2=" << rs2 << " --> " << get_instr_as_hex(instr_int) << newl;
+            *log_out << "Equal To, rd=" << rd << ", rs1=" << rs1 << ", rs2=" << rs2 << " --> " << get_instr_as_hex(instr_int) << newl;
         }
     } else if (instr == "jump") {
         // Arguments: val
         // val should be a function name
 
         uint32_t val = 0;
-        std::string val_str = params[0];
+        std::string_view val_str = params[0];
         if (!is_numeric(val_str[0])) {
             // It's a function name
-            callers.insert({val_str, pc});
+            callers.push_back({symbols.intern(val_str), pc});
             val = 0;
         } else {
             val = param_to_int(params[0]) & 0xFFFFFF;
@@ -1354,7 +1818,7 @@ bool Yuasm::eval_instr(std::string instr, std::vector<std::string> params) {
         instr_int |= 0x20 << 24;
 
         if (DEBUG_LEVEL >= 0) {
-            std::cout << "Jump To Section, val=" << val << " --> " << get_instr_as_hex(instr_int) << newl;
+            *log_out << "Jump To Section, val=" << val << " --> " << get_instr_as_hex(instr_int) << newl;
         }
     } else if (instr == "jumpd") {
         // Arguments: rs
@@ -1365,17 +1829,17 @@ bool Yuasm::eval_instr(std::string instr, std::vector<std::string> params) {
         instr_int |= 0x21 << 24;
 
         if (DEBUG_LEVEL >= 0) {
-            std::cout << "Jump Direct, rs=" << rs << " --> " << get_instr_as_hex(instr_int) << newl;
+            *log_out << "Jump Direct, rs=" << rs << " --> " << get_instr_as_hex(instr_int) << newl;
         }
     } else if (instr == "jumpif") {
         // Arguments: val, rcond
         // val should be a function name
 
         uint32_t val = 0;
-        std::string val_str = params[0];
+        std::string_view val_str = params[0];
         if (!is_numeric(val_str[0])) {
             // It's a function name
-            callers.insert({val_str, pc});
+            callers.push_back({symbols.intern(val_str), pc});
             val = 0;
         } else {
             val = param_to_int(params[0]) & 0xFFFFF;
@@ -1388,7 +1852,7 @@ bool Yuasm::eval_instr(std::string instr, std::vector<std::string> params) {
         instr_int |= 0x22 << 24;
 
         if (DEBUG_LEVEL >= 0) {
-            std::cout << "Jump If Immediate, val=" << val << ", rcond=" << rcond << " --> " << get_instr_as_hex(instr_int) << newl;
+            *log_out << "Jump If Immediate, val=" << val << ", rcond=" << rcond << " --> " << get_instr_as_hex(instr_int) << newl;
         }
     } else if (instr == "jumpifd") {
         // Arguments: rs, rcond
@@ -1401,7 +1865,7 @@ bool Yuasm::eval_instr(std::string instr, std::vector<std::string> params) {
         instr_int |= 0x23 << 24;
 
         if (DEBUG_LEVEL >= 0) {
-            std::cout << "Jump If Direct, rs=" << rs << ", rcond=" << rcond << " --> " << get_instr_as_hex(instr_int) << newl;
+            *log_out << "Jump If Direct, rs=" << rs << ", rcond=" << rcond << " --> " << get_instr_as_hex(instr_int) << newl;
         }
     } else if (instr == "ret") {
         // Arguments: none
@@ -1409,7 +1873,7 @@ bool Yuasm::eval_instr(std::string instr, std::vector<std::string> params) {
         instr_int |= 0x24 << 24;
 
         if (DEBUG_LEVEL >= 0) {
-            std::cout << "Return" << " --> " << get_instr_as_hex(instr_int) << newl;
+            *log_out << "Return" << " --> " << get_instr_as_hex(instr_int) << newl;
         }
     } else if (instr == "end") {
         // Arguments: none
@@ -1417,17 +1881,17 @@ bool Yuasm::eval_instr(std::string instr, std::vector<std::string> params) {
         instr_int |= 0x25 << 24;
 
         if (DEBUG_LEVEL >= 0) {
-            std::cout << "End" << " --> " << get_instr_as_hex(instr_int) << newl;
+            *log_out << "End" << " --> " << get_instr_as_hex(instr_int) << newl;
         }
     } else if (instr == "br") {
         // Arguments: val
         // val should be a function name
 
         uint32_t val = 0;
-        std::string val_str = params[0];
+        std::string_view val_str = params[0];
         if (!is_numeric(val_str[0])) {
             // It's a function name
-            callers.insert({val_str, pc});
+            callers.push_back({symbols.intern(val_str), pc});
             val = 0;
         } else {
             val = param_to_int(params[0]) & 0xFFFFF;
@@ -1437,18 +1901,18 @@ bool Yuasm::eval_instr(std::string instr, std::vector<std::string> params) {
         instr_int |= 0x26 << 24;
 
         if (DEBUG_LEVEL >= 0) {
-            std::cout << "Branch, val=" << val << " --> " << get_instr_as_hex(instr_int) << newl;
+            *log_out << "Branch, val=" << val << " --> " << get_instr_as_hex(instr_int) << newl;
         }
     } else if (instr == "brif") {
         // Arguments: val, rcond
         // val should be a function name
 
         uint32_t val = 0;
-        std::string val_str = params[0];
+        std::string_view val_str = params[0];
         if (!is_numeric(val_str[0])) {
             // It's a function name
 
-            callers.insert({val_str, pc});
+            callers.push_back({symbols.intern(val_str), pc});
             val = 0;
         } else {
             val = param_to_int(params[0]) & 0xFFFFF;
@@ -1461,12 +1925,17 @@ bool Yuasm::eval_instr(std::string instr, std::vector<std::string> params) {
         instr_int |= 0x27 << 24;
 
         if (DEBUG_LEVEL >= 0) {
-            std::cout << "Branch If, val=" << val << ", rcond=" << rcond << " --> " << get_instr_as_hex(instr_int) << newl;
+            *log_out << "Branch If, val=" << val << ", rcond=" << rcond << " --> " << get_instr_as_hex(instr_int) << newl;
         }
     } else if (instr == "stored") {
         // Arguments: addr, rs
 
-        uint32_t addr = param_to_int(params[0]) & 0xFFFFF;
+        uint32_t addr = 0;
+        if (is_alphabetic(params[0][0])) {
+            callers.push_back({symbols.intern(params[0]), pc});
+        } else {
+            addr = param_to_int(params[0]) & 0xFFFFF;
+        }
         uint32_t rs = param_to_int(params[1]) & 0xF;
 
         instr_int |= addr << 4;
@@ -1474,20 +1943,25 @@ bool Yuasm::eval_instr(std::string instr, std::vector<std::string> params) {
         instr_int |= 0x04 << 24;
 
         if (DEBUG_LEVEL >= 0) {
-            std::cout << "Store Direct, addr=" << addr << ", rs=" << rs << " --> " << get_instr_as_hex(instr_int) << newl;
+            *log_out << "Store Direct, addr=" << addr << ", rs=" << rs << " --> " << get_instr_as_hex(instr_int) << newl;
         }
     } else if (instr == "loadd") {
         // Arguments: rd, addr
 
         uint32_t rd = param_to_int(params[0]) & 0xF;
-        uint32_t addr = param_to_int(params[1]) & 0xFFFFF;
+        uint32_t addr = 0;
+        if (is_alphabetic(params[1][0])) {
+            callers.push_back({symbols.intern(params[1]), pc});
+        } else {
+            addr = param_to_int(params[1]) & 0xFFFFF;
+        }
 
         instr_int |= rd << 20;
         instr_int |= addr;
         instr_int |= 0x05 << 24;
 
         if (DEBUG_LEVEL >= 0) {
-            std::cout << "Load Direct, rd=" << rd << ", addr=" << addr << " --> " << get_instr_as_hex(instr_int) << newl;
+            *log_out << "Load Direct, rd=" << rd << ", addr=" << addr << " --> " << get_instr_as_hex(instr_int) << newl;
         }
     } else if (instr == "lshift") {
         // Arguments: rd, rs1, rs2
@@ -1502,7 +1976,7 @@ bool Yuasm::eval_instr(std::string instr, std::vector<std::string> params) {
         instr_int |= 0x40 << 24;
 
         if (DEBUG_LEVEL >= 0) {
-            std::cout << "Left Shift, rd=" << rd << ", rs1=" << rs1 << ", rs2=" << rs2 << " --> " << get_instr_as_hex(instr_int) << newl;
+            *log_out << "Left Shift, rd=" << rd << ", rs1=" << rs1 << ", rs2=" << rs2 << " --> " << get_instr_as_hex(instr_int) << newl;
         }
     } else if (instr == "rshift") {
         // Arguments: rd, rs1, rs2
@@ -1517,7 +1991,7 @@ bool Yuasm::eval_instr(std::string instr, std::vector<std::string> params) {
         instr_int |= 0x41 << 24;
 
         if (DEBUG_LEVEL >= 0) {
-            std::cout << "Right Shift, rd=" << rd << ", rs1=" << rs1 << ", rs2=" << rs2 << " --> " << get_instr_as_hex(instr_int) << newl;
+            *log_out << "Right Shift, rd=" << rd << ", rs1=" << rs1 << ", rs2=" << rs2 << " --> " << get_instr_as_hex(instr_int) << newl;
         }
     } else if (instr == "mul") {
         // Arguments: rd, rs1, rs2
@@ -1532,7 +2006,7 @@ bool Yuasm::eval_instr(std::string instr, std::vector<std::string> params) {
         instr_int |= 0x12 << 24;
 
         if (DEBUG_LEVEL >= 0) {
-            std::cout << "Multiply, rd=" << rd << ", rs1=" << rs1 << ", rs2=" << rs2 << " --> " << get_instr_as_hex(instr_int) << newl;
+            *log_out << "Multiply, rd=" << rd << ", rs1=" << rs1 << ", rs2=" << rs2 << " --> " << get_instr_as_hex(instr_int) << newl;
         }
     } else if (instr == "div") {
         // Arguments: rd, rs1, rs2
@@ -1547,7 +2021,7 @@ bool Yuasm::eval_instr(std::string instr, std::vector<std::string> params) {
         instr_int |= 0x13 << 24;
 
         if (DEBUG_LEVEL >= 0) {
-            std::cout << "Divide, rd=" << rd << ", rs1=" << rs1 << ", rs2=" << rs2 << " --> " << get_instr_as_hex(instr_int) << newl;
+            *log_out << "Divide, rd=" << rd << ", rs1=" << rs1 << ", rs2=" << rs2 << " --> " << get_instr_as_hex(instr_int) << newl;
         }
     } else if (instr == "and") {
         // Arguments: rd, rs1, rs2
@@ -1562,7 +2036,7 @@ bool Yuasm::eval_instr(std::string instr, std::vector<std::string> params) {
         instr_int |= 0x30 << 24;
 
         if (DEBUG_LEVEL >= 0) {
-            std::cout << "And, rd=" << rd << ", rs1=" << rs1 << ", rs2=" << rs2 << " --> " << get_instr_as_hex(instr_int) << newl;
+            *log_out << "And, rd=" << rd << ", rs1=" << rs1 << ", rs2=" << rs2 << " --> " << get_instr_as_hex(instr_int) << newl;
         }
     } else if (instr == "or") {
         // Arguments: rd, rs1, rs2
@@ -1577,7 +2051,7 @@ bool Yuasm::eval_instr(std::string instr, std::vector<std::string> params) {
         instr_int |= 0x31 << 24;
 
         if (DEBUG_LEVEL >= 0) {
-            std::cout << "Or, rd=" << rd << ", rs1=" << rs1 << ", rs2=" << rs2 << " --> " << get_instr_as_hex(instr_int) << newl;
+            *log_out << "Or, rd=" << rd << ", rs1=" << rs1 << ", rs2=" << rs2 << " --> " << get_instr_as_hex(instr_int) << newl;
         }
     } else if (instr == "nand") {
         // Arguments: rd, rs1, rs2
@@ -1592,7 +2066,7 @@ bool Yuasm::eval_instr(std::string instr, std::vector<std::string> params) {
         instr_int |= 0x32 << 24;
 
         if (DEBUG_LEVEL >= 0) {
-            std::cout << "Nand, rd=" << rd << ", rs1=" << rs1 << ", rs2=" << rs2 << " --> " << get_instr_as_hex(instr_int) << newl;
+            *log_out << "Nand, rd=" << rd << ", rs1=" << rs1 << ", rs2=" << rs2 << " --> " << get_instr_as_hex(instr_int) << newl;
         }
     } else if (instr == "nor") {
         // Arguments: rd, rs1, rs2
@@ -1607,7 +2081,7 @@ bool Yuasm::eval_instr(std::string instr, std::vector<std::string> params) {
         instr_int |= 0x33 << 24;
 
         if (DEBUG_LEVEL >= 0) {
-            std::cout << "Nor, rd=" << rd << ", rs1=" << rs1 << ", rs2=" << rs2 << " --> " << get_instr_as_hex(instr_int) << newl;
+            *log_out << "Nor, rd=" << rd << ", rs1=" << rs1 << ", rs2=" << rs2 << " --> " << get_instr_as_hex(instr_int) << newl;
         }
     } else if (instr == "xor") {
         // Arguments: rd, rs1, rs2
@@ -1622,7 +2096,7 @@ bool Yuasm::eval_instr(std::string instr, std::vector<std::string> params) {
         instr_int |= 0x34 << 24;
 
         if (DEBUG_LEVEL >= 0) {
-            std::cout << "Xor, rd=" << rd << ", rs1=" << rs1 << ", rs2=" << rs2 << " --> " << get_instr_as_hex(instr_int) << newl;
+            *log_out << "Xor, rd=" << rd << ", rs1=" << rs1 << ", rs2=" << rs2 << " --> " << get_instr_as_hex(instr_int) << newl;
         }
     }
 
@@ -1633,153 +2107,279 @@ bool Yuasm::eval_instr(std::string instr, std::vector<std::string> params) {
 
 bool Yuasm::open_new_file(std::string fname) {
     if (!std::filesystem::exists(fname)) {
-        std::cerr << "Error: file not found" << newl;
+        *log_err << "Error: file not found" << newl;
         return false;
     }
-    std::unique_ptr<std::ifstream> file = std::make_unique<std::ifstream>(fname);
-    if (!(*file)) {
-        print_line_to_std_err();
-        std::cerr << "Error: file not found" << newl;
+    std::unique_ptr<SourceFile> file = std::make_unique<SourceFile>();
+    if (!read_source(fname, file.get())) {
+        *log_err << "Error: file not found" << newl;
         return false;
     }
+    if (options.stats != nullptr) {
+        options.stats->count("asm.bytes_in", file->text.size());
+    }
     files.push(std::move(file));
     fnames.push(fname);
     line_counters.push(1);
+    dependencies.push_back(fname);
     return true;
 }
 
-bool Yuasm::write_object() {
-    std::ofstream obj_file("objects/" + ofname, std::ios::binary);
-    unsigned char instr_bytes[4];
-
-    // Write N_defs
-
-    uint32_t N_defs = functions.size();
-
-    instr_bytes[0] = (N_defs) & 0xFF;
-    instr_bytes[1] = (N_defs >> 8) & 0xFF;
-    instr_bytes[2] = (N_defs >> 16) & 0xFF;
-    instr_bytes[3] = (N_defs >> 24) & 0xFF;
+bool Yuasm::optimize() {
+    if (options.opt_level < 1 && options.inline_budget <= 0) {
+        return true;
+    }
 
-    obj_file.write(reinterpret_cast<const char*>(&instr_bytes[3]), sizeof(instr_bytes[0]));
-    obj_file.write(reinterpret_cast<const char*>(&instr_bytes[2]), sizeof(instr_bytes[0]));
-    obj_file.write(reinterpret_cast<const char*>(&instr_bytes[1]), sizeof(instr_bytes[0]));
-    obj_file.write(reinterpret_cast<const char*>(&instr_bytes[0]), sizeof(instr_bytes[0]));
+    Optimizer optimizer(&instructions, &functions, &callers, log_out, options.stats, &hidden_sections);
+    int rewrites = 0;
+    if (options.inline_budget > 0) {
+        rewrites += optimizer.inline_leaf_sections(options.inline_budget); // first, so the other passes see the inlined code
+    }
+    if (options.opt_level >= 1) {
+        rewrites += optimizer.peephole();
+    }
+    if (options.opt_level >= 2) {
+        // each pass can open up work for the other one
+        for (int round=0; round<4; round++) {
+            int round_rewrites = optimizer.dataflow();
+            round_rewrites += optimizer.peephole();
+            if (options.opt_level >= 3) {
+                round_rewrites += optimizer.hoist_loop_invariants();
+            }
+            rewrites += round_rewrites;
+            if (round_rewrites == 0) {
+                break;
+            }
+        }
+    }
+    optimizer.store();
+    pc = instructions.size() * 4;
 
-    // Write DEFs
+    if (DEBUG_LEVEL >= 0) {
+        *log_out << "Optimizer made " << rewrites << " rewrite(s), " << instructions.size() << " instruction(s) left\n";
+    }
+    return true;
+}
 
-    for (std::map<std::string, int>::iterator it = functions.begin(); it != functions.end(); ++it) {
-        std::string symbol_name = it->first;
-        int len = symbol_name.size();
-        int loc = it->second;
-        
-        if (len > 65535) {
-            print_line_to_std_err();
-            std::cerr << "Error: symbol name length must be at most 16 bits\n";
+// Decides which sections are left out of the object's DEFs. Without any .global every section is exported
+// unless it is .local, otherwise only the .global ones are. Local sections of macros are never exported.
+bool Yuasm::apply_visibility() {
+    for (std::string_view name : global_names) {
+        if (local_names.count(name) > 0) {
+            *log_err << "Error: " << name << " is declared both .global and .local" << newl;
             return false;
         }
-
-        // write len
-        instr_bytes[0] = (len) & 0xFF;
-        instr_bytes[1] = (len >> 8) & 0xFF;
-        obj_file.write(reinterpret_cast<const char*>(&instr_bytes[1]), sizeof(instr_bytes[0]));
-        obj_file.write(reinterpret_cast<const char*>(&instr_bytes[0]), sizeof(instr_bytes[0]));
-
-        // write symbol_name
-        for (int i=0; i<len; i++) {
-            unsigned char cur_char = symbol_name[i];
-            obj_file.write(reinterpret_cast<const char*>(&cur_char), sizeof(cur_char));
+        if (functions.find(name) == functions.end()) {
+            *log_err << "Error: .global " << name << " is not a section" << (data_labels.count(name) > 0 ? ", data labels are always exported" : "") << newl;
+            return false;
+        }
+    }
+    for (std::string_view name : local_names) {
+        if (functions.find(name) == functions.end()) {
+            *log_err << "Error: .local " << name << " is not a section" << (data_labels.count(name) > 0 ? ", data labels are always exported" : "") << newl;
+            return false;
         }
-
-        // write loc
-
-        instr_bytes[0] = (loc) & 0xFF;
-        instr_bytes[1] = (loc >> 8) & 0xFF;
-        instr_bytes[2] = (loc >> 16) & 0xFF;
-        instr_bytes[3] = (loc >> 24) & 0xFF;
-
-        obj_file.write(reinterpret_cast<const char*>(&instr_bytes[3]), sizeof(instr_bytes[0]));
-        obj_file.write(reinterpret_cast<const char*>(&instr_bytes[2]), sizeof(instr_bytes[0]));
-        obj_file.write(reinterpret_cast<const char*>(&instr_bytes[1]), sizeof(instr_bytes[0]));
-        obj_file.write(reinterpret_cast<const char*>(&instr_bytes[0]), sizeof(instr_bytes[0]));
     }
 
-    // Write N_callers
+    for (auto it = functions.begin(); it != functions.end(); ++it) {
+        std::string_view name = it->first;
+        bool hidden = (local_names.count(name) > 0) || (!global_names.empty() && global_names.count(name) == 0)
+                      || name.find('.') != std::string_view::npos;
+        if (hidden) {
+            hidden_sections.insert(name);
+        }
+    }
 
-    uint32_t N_callers = callers.size();
+    if (options.stats != nullptr) {
+        options.stats->count("asm.exported_symbols", functions.size() - hidden_sections.size());
+        options.stats->count("asm.hidden_symbols", hidden_sections.size());
+    }
+    return true;
+}
 
-    instr_bytes[0] = (N_callers) & 0xFF;
-    instr_bytes[1] = (N_callers >> 8) & 0xFF;
-    instr_bytes[2] = (N_callers >> 16) & 0xFF;
-    instr_bytes[3] = (N_callers >> 24) & 0xFF;
+// Branches to a section of this object are patched here, only branches to other objects and data references
+// are left to the linker. A section of this object wins over one of the same name in an earlier object.
+// The branches are still listed in the object so the linker can move the code when it inlines or reorders.
+void Yuasm::resolve_local_branches() {
+    Stats::Timer timer(options.stats, Stats::RELOCATION);
+
+    size_t kept = 0;
+    for (size_t i=0; i<callers.size(); i++) {
+        auto [symbol, loc] = callers[i];
+        uint32_t& instr = instructions[loc / 4];
+        uint32_t op = instr >> 24;
+        auto it = functions.find(symbol);
+        if (it == functions.end() || (op != 0x20 && op != 0x22 && op != 0x26 && op != 0x27)) {
+            callers[kept++] = callers[i];
+            continue;
+        }
 
-    obj_file.write(reinterpret_cast<const char*>(&instr_bytes[3]), sizeof(instr_bytes[0]));
-    obj_file.write(reinterpret_cast<const char*>(&instr_bytes[2]), sizeof(instr_bytes[0]));
-    obj_file.write(reinterpret_cast<const char*>(&instr_bytes[1]), sizeof(instr_bytes[0]));
-    obj_file.write(reinterpret_cast<const char*>(&instr_bytes[0]), sizeof(instr_bytes[0]));
+        // same encoding as Linker::place_symbols, jump and br take 24 bits, jumpif and brif 20 bits above rcond
+        uint32_t distance = (uint32_t) (it->second - loc);
+        if (op == 0x20 || op == 0x26) {
+            instr = (instr & 0xFF000000) | (distance & 0xFFFFFF);
+        } else {
+            instr = (instr & 0xFF00000F) | ((distance & 0xFFFFF) << 4);
+        }
+        local_branches.push_back({loc, it->second});
+    }
+    callers.resize(kept);
 
-    // Write CALLs
+    if (options.stats != nullptr) {
+        options.stats->count("asm.local_branches", local_branches.size());
+    }
+}
 
-    for (std::map<std::string, int>::iterator it = callers.begin(); it != callers.end(); ++it) {
-        std::string symbol_name = it->first;
-        int len = symbol_name.size();
-        int loc = it->second;
-        
-        if (len > 65535) {
-            print_line_to_std_err();
-            std::cerr << "Error: symbol name length must be at most 16 bits\n";
-            return false;
+bool Yuasm::write_object() {
+    Stats::Timer timer(options.stats, Stats::OBJECT_WRITING);
+
+    // The callers are grouped by symbol name
+    std::vector<std::pair<std::string_view, int>> sorted_callers = callers;
+    std::stable_sort(sorted_callers.begin(), sorted_callers.end(), [](const auto& a, const auto& b) {
+        return a.first < b.first;
+    });
+
+    // The size of the object is known before anything is written, see object_file_structure.txt
+    size_t size = 4 * 5 + data.size() * 4 + local_branches.size() * 8 + instructions.size() * 4;
+    uint32_t N_defs = 0;
+    for (auto it = functions.begin(); it != functions.end(); ++it) {
+        if (hidden_sections.count(it->first) == 0) {
+            size += 2 + it->first.size() + 4;
+            N_defs++;
         }
+    }
+    for (auto it = sorted_callers.begin(); it != sorted_callers.end(); ++it) {
+        size += 2 + it->first.size() + 4;
+    }
+    for (auto it = data_labels.begin(); it != data_labels.end(); ++it) {
+        size += 2 + it->first.size() + 4;
+    }
+    for (const std::map<std::string_view, int>* names : {&functions, &data_labels}) {
+        for (auto it = names->begin(); it != names->end(); ++it) {
+            if (it->first.size() > 65535) {
+                print_line_to_std_err();
+                *log_err << "Error: symbol name length must be at most 16 bits\n";
+                return false;
+            }
+        }
+    }
 
-        // write len
-        instr_bytes[0] = (len) & 0xFF;
-        instr_bytes[1] = (len >> 8) & 0xFF;
-        obj_file.write(reinterpret_cast<const char*>(&instr_bytes[1]), sizeof(instr_bytes[0]));
-        obj_file.write(reinterpret_cast<const char*>(&instr_bytes[0]), sizeof(instr_bytes[0]));
-
-        // write symbol_name
-        for (int i=0; i<len; i++) {
-            unsigned char cur_char = symbol_name[i];
-            obj_file.write(reinterpret_cast<const char*>(&cur_char), sizeof(cur_char));
+    OutputFile obj_file(obj_fpath, size, options.sync_output);
+    if (!obj_file.open()) {
+        *log_err << "Error: " << obj_file.error() << newl;
+        return false;
+    }
+    unsigned char* out = obj_file.data();
+
+    auto write_u32 = [&out](uint32_t val) {
+        out[0] = val >> 24;
+        out[1] = val >> 16;
+        out[2] = val >> 8;
+        out[3] = val;
+        out += 4;
+    };
+    auto write_symbol = [&out, &write_u32](std::string_view symbol_name, uint32_t loc) {
+        out[0] = symbol_name.size() >> 8;
+        out[1] = symbol_name.size();
+        out = std::copy(symbol_name.begin(), symbol_name.end(), out + 2);
+        write_u32(loc);
+    };
+
+    // Write N_defs and DEFs, the hidden sections are only used within this object
+
+    write_u32(N_defs);
+    for (auto it = functions.begin(); it != functions.end(); ++it) {
+        if (hidden_sections.count(it->first) == 0) {
+            write_symbol(it->first, it->second);
         }
+    }
+
+    // Write N_callers and CALLs
+
+    write_u32(sorted_callers.size());
+    for (auto it = sorted_callers.begin(); it != sorted_callers.end(); ++it) {
+        write_symbol(it->first, it->second);
+    }
+
+    // Write N_data_defs, DATA_DEFs, the data size and the data
+
+    write_u32(data_labels.size());
+    for (auto it = data_labels.begin(); it != data_labels.end(); ++it) {
+        write_symbol(it->first, it->second);
+    }
 
-        // write loc
+    write_u32(data.size() * 4);
+    for (uint32_t word : data) {
+        write_u32(word);
+    }
 
-        instr_bytes[0] = (loc) & 0xFF;
-        instr_bytes[1] = (loc >> 8) & 0xFF;
-        instr_bytes[2] = (loc >> 16) & 0xFF;
-        instr_bytes[3] = (loc >> 24) & 0xFF;
+    // Write N_locals and LOCALs, the branches resolve_local_branches already patched
 
-        obj_file.write(reinterpret_cast<const char*>(&instr_bytes[3]), sizeof(instr_bytes[0]));
-        obj_file.write(reinterpret_cast<const char*>(&instr_bytes[2]), sizeof(instr_bytes[0]));
-        obj_file.write(reinterpret_cast<const char*>(&instr_bytes[1]), sizeof(instr_bytes[0]));
-        obj_file.write(reinterpret_cast<const char*>(&instr_bytes[0]), sizeof(instr_bytes[0]));
+    write_u32(local_branches.size());
+    for (const auto& [loc, target] : local_branches) {
+        write_u32(loc);
+        write_u32(target);
     }
 
     // Write instructions
 
-    for (int i=0; i<instructions.size(); i++) {
-        uint32_t instr_int = instructions[i];
-        unsigned char instr_bytes[4];
-        instr_bytes[0] = (instr_int) & 0xFF;
-        instr_bytes[1] = (instr_int >> 8) & 0xFF;
-        instr_bytes[2] = (instr_int >> 16) & 0xFF;
-        instr_bytes[3] = (instr_int >> 24) & 0xFF;
+    for (uint32_t instr_int : instructions) {
+        write_u32(instr_int);
+    }
 
-        obj_file.write(reinterpret_cast<const char*>(&instr_bytes[3]), sizeof(instr_bytes[0]));
-        obj_file.write(reinterpret_cast<const char*>(&instr_bytes[2]), sizeof(instr_bytes[0]));
-        obj_file.write(reinterpret_cast<const char*>(&instr_bytes[1]), sizeof(instr_bytes[0]));
-        obj_file.write(reinterpret_cast<const char*>(&instr_bytes[0]), sizeof(instr_bytes[0]));
+    if (!obj_file.commit()) {
+        *log_err << "Error: " << obj_file.error() << newl;
+        return false;
     }
 
-    obj_file.close();
+    if (options.stats != nullptr) {
+        options.stats->count("asm.bytes_out", size);
+    }
     return true;
 }
 
 bool Yuasm::link_object() {
     std::vector<std::string> obj_vec;
-    obj_vec.push_back("objects/" + ofname);
-    Linker linker(obj_vec, false);
+    obj_vec.push_back(obj_fpath);
+    LinkerOptions linker_options;
+    linker_options.stats = options.stats;
+    linker_options.data_base = options.data_base;
+    linker_options.sync_output = options.sync_output;
+    linker_options.out_dir = options.out_dir;
+    linker_options.file_cache = options.file_cache;
+    Linker linker(obj_vec, false, linker_options);
+    return true;
+}
+
+// A Makefile rule with the object as the target, which make and ninja (deps = gcc) both read
+bool Yuasm::write_depfile() {
+    std::string dep_fpath = options.dep_fpath;
+    if (dep_fpath.empty()) {
+        dep_fpath = std::filesystem::path(obj_fpath).replace_extension(".d").string();
+    } else {
+        create_objects_dir_safely(dep_fpath);
+    }
+
+    std::string rule = escape_make_path(obj_fpath) + ":";
+    std::set<std::string> seen; // a header included twice is listed once
+    for (const std::string& fpath : dependencies) {
+        std::string normal = std::filesystem::path(fpath).lexically_normal().string();
+        if (seen.insert(normal).second) {
+            rule += " \\\n  " + escape_make_path(normal);
+        }
+    }
+    rule.push_back('\n');
+
+    OutputFile dep_file(dep_fpath, rule.size(), options.sync_output);
+    if (!dep_file.open()) {
+        *log_err << "Error: " << dep_file.error() << newl;
+        return false;
+    }
+    std::copy(rule.begin(), rule.end(), dep_file.data());
+    if (!dep_file.commit()) {
+        *log_err << "Error: " << dep_file.error() << newl;
+        return false;
+    }
     return true;
 }
 
@@ -1806,43 +2406,776 @@ std::string Yuasm::print_state() {
         case SCAN_FUNC_LEAD: return "SCAN_FUNC_LEAD";
         case SCAN_FUNC_NAME: return "SCAN_FUNC_NAME";
         case SCAN_FUNC_TRAIL: return "SCAN_FUNC_TRAIL";
+        case SCAN_DIRECTIVE_ARGS: return "SCAN_DIRECTIVE_ARGS";
+        case SCAN_MACRO_ARGS: return "SCAN_MACRO_ARGS";
         case SCAN_INCLUDE_LEAD: return "SCAN_INCLUDE_LEAD";
+        case SCAN_EXPR: return "SCAN_EXPR";
         default: return "UNKNOWN";
     }
 }
 
 void Yuasm::print_line_to_std_err() {
-    if ((*(files.top())).eof()) {
-        std::cerr << fnames.top() << " line " << line_counters.top() << ": " << std::string(line_buffer.data(), line_buffer.size()) << newl;
+    if (files.empty()) {
         return;
     }
 
-    // Read until the end of the line
-    (*(files.top())).seekg(-1, std::ios::cur); // because we also want to catch the current character
-    char ch;
-    while (!(*(files.top())).eof() && ch != '\n') {
-        (*(files.top())).get(ch);
-        if (ch == '\n') {
-            break;
-        }
-        line_buffer.push_back(ch);
+    const SourceFile& source = *files.top();
+    if (source.pos >= source.text.size()) {
+        *log_err << fnames.top() << " line " << line_counters.top() << ": " << std::string(line_buffer.data(), line_buffer.size()) << newl;
+        return;
     }
+
+    // Add the rest of the line, starting from the current character
+    size_t begin = (source.pos > 0) ? source.pos - 1 : 0;
+    size_t end = source.text.find('\n', begin);
+    if (end == std::string::npos) {
+        end = source.text.size();
+    }
+    line_buffer.insert(line_buffer.end(), source.text.begin() + begin, source.text.begin() + end);
     
-    std::cerr << fnames.top() << " line " << line_counters.top() << ": " << std::string(line_buffer.data(), line_buffer.size()) << newl;
+    *log_err << fnames.top() << " line " << line_counters.top() << ": " << std::string(line_buffer.data(), line_buffer.size()) << newl;
 
     line_buffer.clear(); // in case we want to keep the program running
 }
 
 Yuasm::Input Yuasm::get_next_char_category() {
-    char ch;
-    (*(files.top())).get(ch);
-    (*(files.top())).seekg(-1, std::ios::cur); // move the cursor back to avoid causing problems
-    return get_category(ch);
+    const SourceFile& source = *files.top();
+    if (source.pos >= source.text.size()) {
+        return INPUT_EOF;
+    }
+    return get_category(source.text[source.pos]);
+}
+
+bool Yuasm::push_param() {
+    if (n_params >= MAX_PARAMS) {
+        print_line_to_std_err();
+        *log_err << "Error: too many arguments, no instruction takes more than " << MAX_PARAMS << newl;
+        return false;
+    }
+
+    params[n_params].assign(buffer1); // reuses the capacity of the previous instruction's parameter
+    n_params++;
+    return true;
+}
+
+void Yuasm::substitute_macro(std::string* buffer) {
+    if (options.stats == nullptr) {
+        expand_macro(buffer, macros);
+        return;
+    }
+
+    Stats::Timer timer(options.stats, Stats::MACRO_EXPANSION);
+    if (expand_macro(buffer, macros)) {
+        options.stats->count("asm.macro_hits");
+    } else {
+        options.stats->count("asm.macro_misses");
+    }
+}
+
+bool Yuasm::finish_directive(Input category) {
+    bool ok = false;
+    if (is_data_directive(buffer0)) {
+        ok = eval_data_directive(buffer0, buffer1);
+    } else if (is_visibility_directive(buffer0)) {
+        ok = eval_visibility_directive(buffer0, buffer1);
+    } else {
+        ok = eval_preproc_directive(buffer0, buffer1);
+    }
+    if (!ok) {
+        return false;
+    }
+    buffer0.clear();
+    buffer1.clear();
+
+    if (category == LF) {
+        state = SCAN_FIRST;
+    } else if (category == SLASH) {
+        state_before_block_comment = NOTHING_OR_COMMENT_UNTIL_LF;
+        state = COMMENT_SCAN_BEGIN;
+    } else {
+        state = NOTHING_OR_COMMENT_UNTIL_LF;
+    }
+    return true;
+}
+
+// .global a, b and .local a, b, the names don't have to be defined yet
+bool Yuasm::eval_visibility_directive(std::string_view directive, std::string_view args) {
+    std::vector<std::string> names = split_args(args);
+    if (names.empty()) {
+        print_line_to_std_err();
+        *log_err << "Error: ." << directive << " expects section names" << newl;
+        return false;
+    }
+
+    for (const std::string& name : names) {
+        bool valid = !name.empty() && is_alphabetic(name[0]);
+        for (char ch : name) {
+            valid = valid && (is_alphabetic(ch) || is_numeric(ch));
+        }
+        if (!valid) {
+            print_line_to_std_err();
+            *log_err << "Error: invalid section name in ." << directive << ": " << name << newl;
+            return false;
+        }
+        (directive == "global" ? global_names : local_names).insert(symbols.intern(name));
+    }
+    return true;
+}
+
+bool Yuasm::eval_preproc_directive(std::string_view directive, std::string_view args) {
+    size_t first = args.find_first_not_of(" \r");
+    args = (first == std::string_view::npos) ? std::string_view() : args.substr(first, args.find_last_not_of(" \r") - first + 1);
+
+    if (directive == "rep") {
+        // #rep count [index_macro], the count can be a constant expression
+        RepFrame frame;
+        frame.index_macro = "rep_index";
+        std::string_view count_expr = args;
+        size_t last_space = args.find_last_of(' ');
+        if (last_space != std::string_view::npos && is_alphabetic(args[last_space + 1])
+            && args.find_first_of("()", last_space) == std::string_view::npos) {
+            frame.index_macro = args.substr(last_space + 1);
+            count_expr = args.substr(0, last_space);
+        }
+        if (count_expr.empty()) {
+            print_line_to_std_err();
+            *log_err << "Error: #rep expects a count" << newl;
+            return false;
+        }
+
+        int32_t count = 0;
+        try {
+            count = eval_const_expr("(" + std::string(count_expr) + ")", macros);
+        } catch (const std::runtime_error& e) {
+            print_line_to_std_err();
+            *log_err << "Error: " << e.what() << newl;
+            return false;
+        }
+        if (count < 0 || count > (1 << 20)) {
+            print_line_to_std_err();
+            *log_err << "Error: #rep count must be between 0 and " << (1 << 20) << ", got " << count << newl;
+            return false;
+        }
+
+        frame.file_depth = files.size();
+        frame.line = line_counters.top();
+        frame.count = count;
+        auto it = macros.find(frame.index_macro);
+        frame.had_macro = (it != macros.end());
+        if (frame.had_macro) {
+            frame.saved_value = it->second;
+        }
+        macros[frame.index_macro] = "0";
+        reps.push_back(frame);
+        line_action = (count > 0) ? BEGIN_REP : SKIP_REP;
+
+        if (options.stats != nullptr) {
+            options.stats->count("asm.rep_blocks");
+        }
+        return true;
+    }
+
+    if (directive == "endrep") {
+        if (!args.empty()) {
+            print_line_to_std_err();
+            *log_err << "Error: #endrep takes no arguments" << newl;
+            return false;
+        }
+        if (reps.empty() || reps.back().file_depth != files.size()) {
+            print_line_to_std_err();
+            *log_err << "Error: #endrep without #rep" << newl;
+            return false;
+        }
+
+        RepFrame& frame = reps.back();
+        frame.index++;
+        if (frame.index < frame.count) {
+            macros[frame.index_macro] = std::to_string(frame.index);
+            line_action = REPEAT_REP;
+            return true;
+        }
+
+        if (frame.had_macro) {
+            macros[frame.index_macro] = frame.saved_value;
+        } else {
+            macros.erase(frame.index_macro);
+        }
+        reps.pop_back();
+        return true;
+    }
+
+    if (directive == "ifdef" || directive == "ifndef") {
+        if (args.empty() || args.find_first_of(" (") != std::string_view::npos) {
+            print_line_to_std_err();
+            *log_err << "Error: #" << directive << " expects a macro name" << newl;
+            return false;
+        }
+        bool defined = (macros.find(args) != macros.end() || function_macros.find(args) != function_macros.end());
+        return begin_cond(defined == (directive == "ifdef"));
+    }
+
+    if (directive == "if") {
+        if (args.empty()) {
+            print_line_to_std_err();
+            *log_err << "Error: #if expects a constant expression" << newl;
+            return false;
+        }
+        int32_t value = 0;
+        try {
+            value = eval_const_expr("(" + std::string(args) + ")", macros);
+        } catch (const std::runtime_error& e) {
+            print_line_to_std_err();
+            *log_err << "Error: " << e.what() << newl;
+            return false;
+        }
+        return begin_cond(value != 0);
+    }
+
+    if (directive == "else" || directive == "endif") {
+        if (!args.empty()) {
+            print_line_to_std_err();
+            *log_err << "Error: #" << directive << " takes no arguments" << newl;
+            return false;
+        }
+        if (conds.empty() || conds.back().file_depth != files.size()) {
+            print_line_to_std_err();
+            *log_err << "Error: #" << directive << " without #if" << newl;
+            return false;
+        }
+
+        if (directive == "endif") {
+            conds.pop_back();
+        } else if (conds.back().in_else) {
+            print_line_to_std_err();
+            *log_err << "Error: #else after #else for the #if on line " << conds.back().line << newl;
+            return false;
+        } else {
+            conds.back().in_else = true;
+            if (conds.back().taken) {
+                line_action = SKIP_BRANCH;
+            } else {
+                conds.back().taken = true; // skipped to here
+            }
+        }
+        return true;
+    }
+
+    if (directive == "macro") {
+        // #macro name(a, b), the parentheses can be left out if there are no parameters
+        auto is_identifier = [](std::string_view name) {
+            if (name.empty() || !is_alphabetic(name[0])) {
+                return false;
+            }
+            for (char ch : name) {
+                if (!is_alphabetic(ch) && !is_numeric(ch)) {
+                    return false;
+                }
+            }
+            return true;
+        };
+
+        size_t paren = args.find('(');
+        std::string_view name = args.substr(0, paren);
+        name = name.substr(0, name.find_last_not_of(' ') + 1);
+        if (!is_identifier(name)) {
+            print_line_to_std_err();
+            *log_err << "Error: invalid macro name: " << name << newl;
+            return false;
+        }
+
+        std::vector<std::string> params;
+        if (paren != std::string_view::npos) {
+            if (args.back() != ')') {
+                print_line_to_std_err();
+                *log_err << "Error: expected ')' after the parameters of macro " << name << newl;
+                return false;
+            }
+            params = split_args(args.substr(paren + 1, args.size() - paren - 2));
+            for (size_t i=0; i<params.size(); i++) {
+                if (!is_identifier(params[i])) {
+                    print_line_to_std_err();
+                    *log_err << "Error: invalid parameter name in macro " << name << ": " << params[i] << newl;
+                    return false;
+                }
+                if (std::find(params.begin(), params.begin() + i, params[i]) != params.begin() + i) {
+                    print_line_to_std_err();
+                    *log_err << "Error: duplicate parameter in macro " << name << ": " << params[i] << newl;
+                    return false;
+                }
+            }
+        }
+
+        pending_macro = name;
+        pending_args = std::move(params);
+        line_action = DEFINE_MACRO;
+        return true;
+    }
+
+    if (directive == "endmacro") {
+        if (!args.empty()) {
+            print_line_to_std_err();
+            *log_err << "Error: #endmacro takes no arguments" << newl;
+            return false;
+        }
+        if (!defining_macro) {
+            print_line_to_std_err();
+            *log_err << "Error: #endmacro without #macro" << newl;
+            return false;
+        }
+        defining_macro = false;
+        return true;
+    }
+
+    print_line_to_std_err();
+    *log_err << "Error: invalid preprocessor directive: " << directive << newl;
+    return false;
+}
+
+bool Yuasm::end_of_line_action() {
+    SourceFile& source = *files.top();
+    LineAction action = line_action;
+    line_action = NO_LINE_ACTION;
+
+    switch (action) {
+        case BEGIN_REP: {
+            reps.back().body_begin = source.pos;
+            reps.back().body_line = line_counters.top();
+            break;
+        }
+
+        case REPEAT_REP: {
+            source.pos = reps.back().body_begin;
+            line_counters.top() = reps.back().body_line;
+            break;
+        }
+
+        case SKIP_REP: {
+            if (skip_lines({"rep"}, "endrep", {"endrep"}).empty()) {
+                print_line_to_std_err();
+                *log_err << "Error: missing #endrep for the #rep on line " << reps.back().line << newl;
+                return false;
+            }
+            break;
+        }
+
+        case SKIP_BRANCH: {
+            // after an #else the next one is a stop as well, so it is reported
+            if (skip_lines({"if", "ifdef", "ifndef"}, "endif", {"else", "endif"}).empty()) {
+                print_line_to_std_err();
+                *log_err << "Error: missing #endif for the #if on line " << conds.back().line << newl;
+                return false;
+            }
+            break;
+        }
+
+        case DEFINE_MACRO: {
+            return define_macro();
+        }
+
+        case EXPAND_MACRO: {
+            return expand_macro_call();
+        }
+
+        default: {
+            break;
+        }
+    }
+    return true;
+}
+
+bool Yuasm::begin_cond(bool condition) {
+    conds.push_back({files.size(), line_counters.top(), condition});
+    if (!condition) {
+        line_action = SKIP_BRANCH;
+    }
+    if (options.stats != nullptr) {
+        options.stats->count(condition ? "asm.cond_taken" : "asm.cond_skipped");
+    }
+    return true;
+}
+
+// The body is copied up to the #endmacro, which is then evaluated by the FSM
+bool Yuasm::define_macro() {
+    const SourceFile& source = *files.top();
+    size_t begin = source.pos;
+    int body_line = line_counters.top();
+    if (skip_lines({"macro"}, "endmacro", {"endmacro"}).empty()) {
+        print_line_to_std_err();
+        *log_err << "Error: missing #endmacro for macro " << pending_macro << newl;
+        return false;
+    }
+
+    FunctionMacro macro;
+    macro.params = std::move(pending_args);
+    macro.body = source.text.substr(begin, source.pos - begin);
+    macro.fname = fnames.top();
+    macro.body_line = body_line;
+
+    // Sections defined in the body are local to each expansion, so a macro with a loop can be used more than once
+    const std::string& body = macro.body;
+    for (size_t pos=0; pos<body.size(); ) {
+        size_t line_end = std::min(body.find('\n', pos), body.size());
+        size_t first = body.find_first_not_of(" \t\r", pos);
+        if (first < line_end && body[first] == '.') {
+            size_t name_begin = std::min(body.find_first_not_of(' ', first + 1), line_end);
+            size_t name_end = name_begin;
+            while (name_end < line_end && (is_alphabetic(body[name_end]) || is_numeric(body[name_end]))) {
+                name_end++;
+            }
+            size_t colon = body.find_first_not_of(' ', name_end);
+            if (name_end > name_begin && colon < line_end && body[colon] == ':') {
+                std::string label = body.substr(name_begin, name_end - name_begin);
+                if (std::find(macro.params.begin(), macro.params.end(), label) != macro.params.end()) {
+                    print_line_to_std_err();
+                    *log_err << "Error: section " << label << " in macro " << pending_macro << " has the name of a parameter" << newl;
+                    return false;
+                }
+                macro.labels.push_back(label);
+            }
+        }
+        pos = line_end + 1;
+    }
+
+    if (DEBUG_LEVEL >= 1) {
+        *log_out << "# Macro Definition Complete #\n";
+        *log_out << "Macro name: " << pending_macro << ", parameters: " << macro.params.size() << ", local sections: " << macro.labels.size() << "\n\n";
+    }
+
+    function_macros.emplace(pending_macro, std::move(macro)); // like #define, the first definition stays
+    defining_macro = true;
+    return true;
+}
+
+// Called at the closing parenthesis, the arguments are evaluated here so they can use the parameters of an outer macro
+bool Yuasm::begin_macro_call() {
+    const FunctionMacro& macro = function_macros.find(buffer0)->second;
+    std::vector<std::string> args = split_args(buffer1);
+    if (args.size() != macro.params.size()) {
+        print_line_to_std_err();
+        *log_err << "Error: macro " << buffer0 << " takes " << macro.params.size() << " argument(s), got " << args.size() << newl;
+        return false;
+    }
+    if (macro_calls.size() >= MAX_MACRO_DEPTH) {
+        print_line_to_std_err();
+        *log_err << "Error: macro calls nested more than " << MAX_MACRO_DEPTH << " deep, does " << buffer0 << " call itself?" << newl;
+        return false;
+    }
+
+    for (std::string& arg : args) {
+        if (arg.empty()) {
+            print_line_to_std_err();
+            *log_err << "Error: missing argument in call to macro " << buffer0 << newl;
+            return false;
+        }
+
+        if (arg[0] == '(') {
+            try {
+                arg = std::to_string(eval_const_expr(arg, macros));
+            } catch (const std::runtime_error& e) {
+                print_line_to_std_err();
+                *log_err << "Error: " << e.what() << newl;
+                return false;
+            }
+        } else if (arg.find_first_of(" ()") != std::string::npos) {
+            print_line_to_std_err();
+            *log_err << "Error: invalid argument in call to macro " << buffer0 << ": " << arg << newl;
+            return false;
+        } else {
+            substitute_macro(&arg);
+        }
+    }
+
+    pending_macro = buffer0;
+    pending_args = std::move(args);
+    line_action = EXPAND_MACRO;
+    return true;
+}
+
+// The body is pushed like an included file, with the parameters and local labels defined as macros until it ends
+bool Yuasm::expand_macro_call() {
+    const FunctionMacro& macro = function_macros.find(pending_macro)->second;
+    MacroCall call;
+    call.file_depth = files.size() + 1;
+    call.macro = &macro;
+
+    auto bind = [&](const std::string& name, const std::string& value) {
+        auto it = macros.find(name);
+        if (it != macros.end()) {
+            call.saved.push_back({name, it->second});
+            it->second = value;
+        } else {
+            call.added.push_back(name);
+            macros.insert({name, value});
+        }
+    };
+    for (size_t i=0; i<macro.params.size(); i++) {
+        bind(macro.params[i], pending_args[i]);
+    }
+    for (const std::string& label : macro.labels) {
+        bind(label, local_label_name(label, macro_expansions));
+    }
+    macro_expansions++;
+
+    std::unique_ptr<SourceFile> file = std::make_unique<SourceFile>();
+    file->text = macro.body;
+    files.push(std::move(file));
+    fnames.push(macro.fname);
+    line_counters.push(macro.body_line);
+    macro_calls.push_back(std::move(call));
+
+    if (DEBUG_LEVEL >= 1) {
+        *log_out << "# Expanding macro " << pending_macro << " #\n\n";
+    }
+    if (options.stats != nullptr) {
+        options.stats->count("asm.macro_expansions");
+    }
+    return true;
+}
+
+void Yuasm::end_macro_call() {
+    MacroCall& call = macro_calls.back();
+    for (auto& [name, value] : call.saved) {
+        macros[name] = std::move(value);
+    }
+    for (const std::string& name : call.added) {
+        macros.erase(name);
+    }
+    macro_calls.pop_back();
+}
+
+// Moves over whole lines without the FSM, from the start of a line up to the start of the line with one
+// of the stop directives, which is left for the FSM to evaluate. Blocks that are opened inside are skipped
+// up to their closer, and block comments are followed so a directive inside one isn't seen.
+// Returns the directive it stopped at, or an empty view at the end of the file.
+std::string_view Yuasm::skip_lines(std::initializer_list<std::string_view> openers, std::string_view closer,
+                                   std::initializer_list<std::string_view> stops) {
+    SourceFile& source = *files.top();
+    const std::string& text = source.text;
+    int depth = 0;
+    bool in_block = false;
+
+    while (source.pos < text.size()) {
+        size_t line_end = text.find('\n', source.pos);
+        if (line_end == std::string::npos) {
+            line_end = text.size();
+        }
+
+        size_t first = text.find_first_not_of(" \t\r", source.pos);
+        if (!in_block && first < line_end && text[first] == '#') {
+            size_t name_end = first + 1;
+            while (name_end < line_end && (is_alphabetic(text[name_end]) || is_numeric(text[name_end]))) {
+                name_end++;
+            }
+            std::string_view name(text.data() + first + 1, name_end - first - 1);
+
+            if (depth == 0 && std::find(stops.begin(), stops.end(), name) != stops.end()) {
+                return name;
+            }
+            if (std::find(openers.begin(), openers.end(), name) != openers.end()) {
+                depth++;
+            } else if (name == closer && depth > 0) {
+                depth--;
+            }
+        }
+
+        for (size_t i=source.pos; i<line_end; i++) {
+            if (in_block && text[i] == '*' && i + 1 < line_end && text[i + 1] == '/') {
+                in_block = false;
+                i++;
+            } else if (!in_block && text[i] == '/' && i + 1 < line_end && (text[i + 1] == '/' || text[i + 1] == '*')) {
+                if (text[i + 1] == '/') {
+                    break;
+                }
+                in_block = true;
+                i++;
+            }
+        }
+
+        source.pos = std::min(line_end + 1, text.size());
+        line_counters.top()++;
+        if (options.stats != nullptr) {
+            options.stats->count("asm.skipped_lines");
+        }
+    }
+    return std::string_view();
+}
+
+bool Yuasm::eval_data_directive(std::string_view directive, std::string_view args) {
+    size_t first = args.find_first_not_of(" \r");
+    args = (first == std::string_view::npos) ? std::string_view() : args.substr(first, args.find_last_not_of(" \r") - first + 1);
+
+    if (directive == "data" || directive == "text") {
+        if (!args.empty()) {
+            print_line_to_std_err();
+            *log_err << "Error: ." << directive << " takes no arguments" << newl;
+            return false;
+        }
+        in_data = (directive == "data");
+        return true;
+    }
+
+    if (!in_data) {
+        print_line_to_std_err();
+        *log_err << "Error: ." << directive << " is only allowed in a data section, use .data first" << newl;
+        return false;
+    }
+
+    size_t offset = data.size() * 4;
+
+    if (directive == "ascii") {
+        // One word per character so the string can be walked with loadr, there is no terminating zero
+        if (args.size() < 2 || args.front() != '"' || args.back() != '"') {
+            print_line_to_std_err();
+            *log_err << "Error: .ascii expects a string in double quotes" << newl;
+            return false;
+        }
+        for (size_t i=1; i+1<args.size(); i++) {
+            char ch = args[i];
+            if (ch == '\\') {
+                switch (args[++i]) {
+                    case 'n': ch = '\n'; break;
+                    case 't': ch = '\t'; break;
+                    case '0': ch = '\0'; break;
+                    case '\\': ch = '\\'; break;
+                    case '"': ch = '"'; break;
+                    default: {
+                        print_line_to_std_err();
+                        *log_err << "Error: unknown escape sequence in string: \\" << args[i] << newl;
+                        return false;
+                    }
+                }
+            }
+            data.push_back((unsigned char) ch);
+        }
+    } else {
+        // .word and .fill take constant expressions separated by commas
+        std::vector<uint32_t> values;
+        size_t begin = 0;
+        int depth = 0;
+        for (size_t i=0; i<=args.size(); i++) {
+            if (i < args.size() && args[i] == '(') {
+                depth++;
+            } else if (i < args.size() && args[i] == ')') {
+                depth--;
+            } else if (i == args.size() || (args[i] == ',' && depth == 0)) {
+                std::string expr = "(" + std::string(args.substr(begin, i - begin)) + ")";
+                if (expr.find_first_not_of(" ()") == std::string::npos) {
+                    print_line_to_std_err();
+                    *log_err << "Error: missing value in ." << directive << newl;
+                    return false;
+                }
+                try {
+                    values.push_back((uint32_t) eval_const_expr(expr, macros));
+                } catch (const std::runtime_error& e) {
+                    print_line_to_std_err();
+                    *log_err << "Error: " << e.what() << newl;
+                    return false;
+                }
+                begin = i + 1;
+            }
+        }
+
+        if (directive == "word") {
+            data.insert(data.end(), values.begin(), values.end());
+        } else {
+            if (values.size() > 2 || (int32_t) values[0] < 0 || values[0] > (1 << 20)) {
+                print_line_to_std_err();
+                *log_err << "Error: .fill expects a count of at most " << (1 << 20) << " words and optionally a value" << newl;
+                return false;
+            }
+            data.insert(data.end(), values[0], values.size() > 1 ? values[1] : 0);
+        }
+    }
+
+    if (DEBUG_LEVEL >= 0) {
+        *log_out << "Data ." << directive << ", offset=" << offset << ", words=" << data.size() - offset / 4 << newl;
+    }
+    if (options.stats != nullptr) {
+        options.stats->count("asm.data_words", data.size() - offset / 4);
+    }
+    return true;
+}
+
+bool Yuasm::begin_expr() {
+    // Only a whole parameter or macro value can be an expression, optionally negated with a leading dash
+    if (!buffer1.empty() && !(state == SCAN_PREPROC_VAL && buffer1.size() == 1 && buffer1[0] == '-')) {
+        print_line_to_std_err();
+        *log_err << "Error: constant expressions must start at the beginning of a parameter" << newl;
+        return false;
+    }
+
+    state_before_expr = state;
+    state = SCAN_EXPR;
+    expr_buffer = "(";
+    expr_depth = 1;
+    return true;
+}
+
+bool Yuasm::finish_expr() {
+    Stats::Timer timer(options.stats, Stats::MACRO_EXPANSION);
+
+    int32_t val = 0;
+    try {
+        val = eval_const_expr(expr_buffer, macros);
+    } catch (const std::runtime_error& e) {
+        print_line_to_std_err();
+        *log_err << "Error: " << e.what() << newl;
+        return false;
+    }
+
+    if (!buffer1.empty()) { // negated macro value, the parameter states handle their own dash
+        val = (int32_t) twos_complement((uint32_t) val);
+    }
+
+    if (DEBUG_LEVEL >= 1) {
+        *log_out << "# Constant Expression Complete #\n";
+        *log_out << "Expression: " << expr_buffer << ", Value: " << val << "\n\n";
+    }
+
+    buffer1 = std::to_string(val);
+    expr_buffer.clear();
+    state = state_before_expr;
+    state_before_expr = INVALID_STATE;
+    after_expr = true;
+    return true;
+}
+
+bool Yuasm::end_expr_param(Input category, char ch) {
+    // The value of the expression is the whole parameter, so it has to end right after the ')'
+    after_expr = false;
+    if (category == AL || category == NUM || category == DASH || category == PAREN_OPEN) {
+        print_line_to_std_err();
+        *log_err << "Error: unexpected '" << ch << "' after constant expression" << newl;
+        return false;
+    }
+    return true;
+}
+
+std::string_view SymbolArena::intern(std::string_view name) {
+    auto it = names.find(name);
+    if (it != names.end()) {
+        return *it;
+    }
+
+    if (name.size() > BLOCK_SIZE - block_used) {
+        size_t block_size = std::max(BLOCK_SIZE, name.size());
+        blocks.push_back(std::make_unique<char[]>(block_size));
+        block_used = (block_size == BLOCK_SIZE) ? 0 : BLOCK_SIZE; // an oversized name gets a block of its own
+        if (block_size != BLOCK_SIZE) {
+            std::copy(name.begin(), name.end(), blocks.back().get());
+            return *names.insert(std::string_view(blocks.back().get(), name.size())).first;
+        }
+    }
+
+    char* dest = blocks.back().get() + block_used;
+    std::copy(name.begin(), name.end(), dest);
+    block_used += name.size();
+    return *names.insert(std::string_view(dest, name.size())).first;
 }
 
 // Static functions
 
-uint32_t Yuasm::param_to_int(std::string param) {
+uint32_t Yuasm::param_to_int(std::string_view param) {
     uint32_t res = 0;
 
     // Determine radix
@@ -1850,53 +3183,414 @@ uint32_t Yuasm::param_to_int(std::string param) {
     if (param.size() > 2) {
         if (param[0] == '0' && param[1] == 'x') {
             radix = 16;
-            for (char& c : param) { // convert to uppercase
-                c = std::toupper(static_cast<unsigned char>(c));
-            }
         } else if (param[0] == '0' && param[1] == 'b') {
             radix = 2;
         }
     }
 
-    int limit = 0;
-    if (radix != 10) {
-        limit = 2;
-    }
-    uint32_t di = 0; // digit index
-    for (int i=param.size()-1; i>limit-1; i--) {
+    size_t begin = (radix != 10) ? 2 : 0;
+    for (size_t i=begin; i<param.size(); i++) {
         char digit_char = param[i];
 
         uint32_t digit_value;
         if (radix == 10) {
             if (!is_numeric(digit_char)) {
-                throw std::runtime_error("Invalid decimal number: " + param);
+                throw std::runtime_error("Invalid decimal number: " + std::string(param));
             }
             digit_value = digit_char - '0';
         } else if (radix == 16) {
+            digit_char = std::toupper(static_cast<unsigned char>(digit_char));
             if (!is_hex_digit(digit_char)) {
-                throw std::runtime_error("Invalid hexadecimal number: " + param);
+                throw std::runtime_error("Invalid hexadecimal number: " + std::string(param));
             }
             digit_value = get_hex_value(digit_char);
-        } else if (radix == 2) {
+        } else {
             if (digit_char != '0' && digit_char != '1') {
-                throw std::runtime_error("Invalid binary number: " + param);
+                throw std::runtime_error("Invalid binary number: " + std::string(param));
             }
             digit_value = digit_char - '0';
         }
 
-        res += digit_value * std::pow(radix, di);
-        di++;
+        res = res * radix + digit_value;
     }
 
     return res;
 }
 
-void Yuasm::expand_macro(std::vector<char>* buffer, std::map<std::string, std::string> macro_list) {
-    std::string buffer_str(buffer->begin(), buffer->end());
-    if (macro_list.find(buffer_str) != macro_list.end()) {
-        std::string expansion = macro_list[buffer_str];
-        buffer->assign(expansion.begin(), expansion.end());
+bool Yuasm::expand_macro(std::string* buffer, const MacroMap& macro_list) {
+    auto it = macro_list.find(*buffer);
+    if (it == macro_list.end()) {
+        return false;
     }
+    buffer->assign(it->second);
+    return true;
+}
+
+SourceSplit Yuasm::split_source(const std::string& text, int n_chunks, size_t min_chunk_bytes) {
+    // A cheap pre-pass over the lines: it only knows about comments, quotes and directives.
+    // Chunks start at the beginning of a line that isn't inside a block comment, so every chunk starts
+    // in SCAN_FIRST. Everything up to the last directive other than #define stays in the first chunk,
+    // after that the macros only change through #define lines which are replayed by the later chunks.
+    const size_t candidate_spacing = std::min(min_chunk_bytes, (size_t) 4096);
+
+    SourceSplit split;
+    std::vector<std::pair<size_t, int>> candidates; // clean line starts (and their line numbers) at least candidate_spacing apart
+    std::vector<std::pair<size_t, size_t>> define_lines;
+    size_t barrier = 0;
+    int barrier_line = 1;
+    bool barrier_pending = false;
+    bool in_block = false;
+    bool in_data = false; // labels after .data are data labels, so a file that ends in a data section isn't split
+    size_t next_candidate = 0;
+    int line = 1;
+
+    for (size_t pos=0; pos<text.size(); line++) {
+        size_t line_end = text.find('\n', pos);
+        if (line_end == std::string::npos) {
+            line_end = text.size();
+        }
+
+        bool starts_in_block = in_block;
+        if (!in_block) {
+            if (barrier_pending) {
+                barrier = pos;
+                barrier_line = line;
+                barrier_pending = false;
+            }
+            if (pos >= next_candidate) {
+                candidates.push_back({pos, line});
+                next_candidate = pos + candidate_spacing;
+            }
+        }
+
+        size_t first = text.find_first_not_of(" \t\r", pos);
+        bool directive = !starts_in_block && first < line_end && text[first] == '#';
+        bool define = directive && text.compare(first + 1, 6, "define") == 0;
+
+        // Data directives stay in the first chunk too, the data location counter isn't split
+        if (!starts_in_block && first < line_end && text[first] == '.') {
+            size_t name_begin = std::min(text.find_first_not_of(" ", first + 1), line_end);
+            size_t name_end = name_begin;
+            while (name_end < line_end && (is_alphabetic(text[name_end]) || is_numeric(text[name_end]))) {
+                name_end++;
+            }
+            std::string_view name(text.data() + name_begin, name_end - name_begin);
+            if (is_data_directive(name) && (name_end == line_end || text[name_end] != ':')) {
+                directive = true;
+                if (name == "data" || name == "text") {
+                    in_data = (name == "data");
+                }
+            }
+        }
+
+        bool in_quote = false;
+        bool directive_after_block = false; // a directive right after the end of a block comment isn't seen above
+        for (size_t i=pos; i<line_end; i++) {
+            char ch = text[i];
+            char next = (i + 1 < line_end) ? text[i + 1] : '\0';
+            if (in_block) {
+                if (ch == '*' && next == '/') {
+                    in_block = false;
+                    i++;
+                }
+            } else if (in_quote) {
+                in_quote = (ch != '"');
+            } else if (ch == '"') {
+                in_quote = true;
+            } else if (ch == '/' && next == '/') {
+                break;
+            } else if (ch == '/' && next == '*') {
+                in_block = true;
+                i++;
+            } else if (starts_in_block && ch == '#') {
+                directive_after_block = true;
+            }
+        }
+
+        if ((directive && !define) || (define && in_block) || directive_after_block) {
+            barrier_pending = true; // the first chunk has to include this line
+            define_lines.clear();
+        } else if (define) {
+            define_lines.push_back({pos, line_end});
+        }
+
+        pos = line_end + 1;
+    }
+
+    if (barrier_pending || in_data) {
+        barrier = text.size();
+        barrier_line = line;
+    }
+
+    size_t body_size = text.size() - barrier;
+    size_t max_chunks = body_size / std::max(min_chunk_bytes, (size_t) 1);
+    n_chunks = std::min((size_t) n_chunks, max_chunks);
+    split.chunks.push_back({0, barrier, 1});
+    if (n_chunks < 2) {
+        split.chunks[0].end = text.size();
+        return split;
+    }
+
+    // Cut at the first clean line start after every 1/n of the rest of the file
+    split.chunks.push_back({barrier, text.size(), barrier_line});
+    size_t candidate = 0;
+    for (int i=1; i<n_chunks; i++) {
+        size_t target = barrier + body_size * i / n_chunks;
+        while (candidate < candidates.size() && (candidates[candidate].first < target || candidates[candidate].first <= split.chunks.back().begin)) {
+            candidate++;
+        }
+        if (candidate >= candidates.size()) {
+            break;
+        }
+        split.chunks.back().end = candidates[candidate].first;
+        split.chunks.push_back({candidates[candidate].first, text.size(), candidates[candidate].second});
+    }
+    split.define_lines = std::move(define_lines);
+    return split;
+}
+
+bool Yuasm::read_source(const std::string& fpath, SourceFile* source) {
+    if (options.file_cache != nullptr) {
+        bool cached = false;
+        const std::string* text = options.file_cache->read(fpath, &cached);
+        if (text == nullptr) {
+            return false;
+        }
+        if (options.stats != nullptr && cached) {
+            options.stats->count("asm.cached_files");
+        }
+        source->text = *text;
+        source->pos = 0;
+        return true;
+    }
+
+    std::ifstream file(fpath, std::ios::binary);
+    if (!file) {
+        return false;
+    }
+
+    file.seekg(0, std::ios::end);
+    std::streamoff size = file.tellg();
+    file.seekg(0, std::ios::beg);
+    source->text.resize(size > 0 ? size : 0);
+    file.read(source->text.data(), source->text.size());
+    source->pos = 0;
+    return true;
+}
+
+int32_t Yuasm::eval_const_expr(const std::string& expr, const MacroMap& macro_list, int depth) {
+    // Recursive descent, from lowest to highest precedence: '||', '&&', '|', '&', '==' '!=', '<' '<=' '>' '>=',
+    // '<<' '>>', '+' '-', '*' '/', unary '-' '~' '!', and finally numbers, macro names, defined(name) and parentheses.
+    // Comparisons and the logical operators give 1 or 0, mostly for #if.
+    // Arithmetic wraps around at 32 bits like the registers the values end up in.
+    if (depth > 32) {
+        throw std::runtime_error("macro nesting too deep in constant expression: " + expr);
+    }
+
+    struct Parser {
+        const std::string& text;
+        const MacroMap& macro_list;
+        int depth;
+        size_t i = 0;
+
+        void skip_spaces() {
+            while (i < text.size() && (text[i] == ' ' || text[i] == '\t' || text[i] == '\r')) {
+                i++;
+            }
+        }
+
+        bool accept(const char* op) {
+            skip_spaces();
+            size_t len = std::char_traits<char>::length(op);
+            if (text.compare(i, len, op) == 0) {
+                i += len;
+                return true;
+            }
+            return false;
+        }
+
+        // a one character operator that isn't the start of a longer one, so '<' but not "<<" or "<="
+        bool accept_alone(char op) {
+            skip_spaces();
+            if (i < text.size() && text[i] == op && (i + 1 == text.size() || (text[i + 1] != op && text[i + 1] != '='))) {
+                i++;
+                return true;
+            }
+            return false;
+        }
+
+        int32_t parse_logical_or() {
+            int32_t lhs = parse_logical_and();
+            while (accept("||")) {
+                int32_t rhs = parse_logical_and(); // both sides are evaluated, they have no side effects
+                lhs = (lhs != 0 || rhs != 0);
+            }
+            return lhs;
+        }
+
+        int32_t parse_logical_and() {
+            int32_t lhs = parse_or();
+            while (accept("&&")) {
+                int32_t rhs = parse_or();
+                lhs = (lhs != 0 && rhs != 0);
+            }
+            return lhs;
+        }
+
+        int32_t parse_or() {
+            int32_t lhs = parse_and();
+            while (accept_alone('|')) {
+                lhs = lhs | parse_and();
+            }
+            return lhs;
+        }
+
+        int32_t parse_and() {
+            int32_t lhs = parse_equality();
+            while (accept_alone('&')) {
+                lhs = lhs & parse_equality();
+            }
+            return lhs;
+        }
+
+        int32_t parse_equality() {
+            int32_t lhs = parse_relational();
+            while (true) {
+                if (accept("==")) {
+                    lhs = (lhs == parse_relational());
+                } else if (accept("!=")) {
+                    lhs = (lhs != parse_relational());
+                } else {
+                    return lhs;
+                }
+            }
+        }
+
+        int32_t parse_relational() {
+            int32_t lhs = parse_shift();
+            while (true) {
+                if (accept("<=")) {
+                    lhs = (lhs <= parse_shift());
+                } else if (accept(">=")) {
+                    lhs = (lhs >= parse_shift());
+                } else if (accept_alone('<')) {
+                    lhs = (lhs < parse_shift());
+                } else if (accept_alone('>')) {
+                    lhs = (lhs > parse_shift());
+                } else {
+                    return lhs;
+                }
+            }
+        }
+
+        int32_t parse_shift() {
+            int32_t lhs = parse_sum();
+            while (true) {
+                bool left = accept("<<");
+                if (!left && !accept(">>")) {
+                    return lhs;
+                }
+                int32_t rhs = parse_sum();
+                if (rhs < 0 || rhs > 31) {
+                    throw std::runtime_error("shift amount out of range in constant expression: " + text);
+                }
+                lhs = left ? (int32_t) ((uint32_t) lhs << rhs) : lhs >> rhs;
+            }
+        }
+
+        int32_t parse_sum() {
+            int32_t lhs = parse_product();
+            while (true) {
+                if (accept("+")) {
+                    lhs = (int32_t) ((uint32_t) lhs + (uint32_t) parse_product());
+                } else if (accept("-")) {
+                    lhs = (int32_t) ((uint32_t) lhs - (uint32_t) parse_product());
+                } else {
+                    return lhs;
+                }
+            }
+        }
+
+        int32_t parse_product() {
+            int32_t lhs = parse_unary();
+            while (true) {
+                if (accept("*")) {
+                    lhs = (int32_t) ((uint32_t) lhs * (uint32_t) parse_unary());
+                } else if (accept("/")) {
+                    int32_t rhs = parse_unary();
+                    if (rhs == 0) {
+                        throw std::runtime_error("division by zero in constant expression: " + text);
+                    }
+                    lhs = (rhs == -1) ? (int32_t) twos_complement((uint32_t) lhs) : lhs / rhs;
+                } else {
+                    return lhs;
+                }
+            }
+        }
+
+        int32_t parse_unary() {
+            if (accept("-")) {
+                return (int32_t) twos_complement((uint32_t) parse_unary());
+            }
+            if (accept("~")) {
+                return ~parse_unary();
+            }
+            if (accept_alone('!')) {
+                return (parse_unary() == 0);
+            }
+            return parse_primary();
+        }
+
+        int32_t parse_primary() {
+            if (accept("(")) {
+                int32_t val = parse_logical_or();
+                if (!accept(")")) {
+                    throw std::runtime_error("expected ')' in constant expression: " + text);
+                }
+                return val;
+            }
+
+            size_t begin = i;
+            while (i < text.size() && (is_alphabetic(text[i]) || is_numeric(text[i]))) {
+                i++;
+            }
+            if (begin == i) {
+                throw std::runtime_error("expected number or macro name in constant expression: " + text);
+            }
+
+            std::string token = text.substr(begin, i - begin);
+            if (is_numeric(token[0])) {
+                return (int32_t) param_to_int(token);
+            }
+
+            if (token == "defined" && accept("(")) {
+                skip_spaces();
+                size_t name_begin = i;
+                while (i < text.size() && (is_alphabetic(text[i]) || is_numeric(text[i]))) {
+                    i++;
+                }
+                std::string name = text.substr(name_begin, i - name_begin);
+                if (name.empty() || !accept(")")) {
+                    throw std::runtime_error("expected defined(name) in constant expression: " + text);
+                }
+                return macro_list.find(name) != macro_list.end();
+            }
+
+            auto it = macro_list.find(token);
+            if (it == macro_list.end()) {
+                throw std::runtime_error("undefined macro in constant expression: " + token);
+            }
+            return eval_const_expr(it->second, macro_list, depth + 1);
+        }
+    };
+
+    Parser parser {expr, macro_list, depth};
+    int32_t val = parser.parse_logical_or();
+    parser.skip_spaces();
+    if (parser.i != expr.size()) {
+        throw std::runtime_error("unexpected character '" + std::string(1, expr[parser.i]) + "' in constant expression: " + expr);
+    }
+    return val;
 }
 
 const Yuasm::Input Yuasm::get_category(char ch) {
@@ -1925,6 +3619,57 @@ const Yuasm::Input Yuasm::get_category(char ch) {
     return UNKNOWN;
 }
 
+bool Yuasm::is_data_directive(std::string_view name) {
+    return name == "data" || name == "text" || name == "word" || name == "fill" || name == "ascii";
+}
+
+bool Yuasm::is_visibility_directive(std::string_view name) {
+    return name == "global" || name == "local";
+}
+
+bool Yuasm::is_line_directive(std::string_view name) {
+    return name == "rep" || name == "endrep" || name == "macro" || name == "endmacro"
+        || name == "if" || name == "ifdef" || name == "ifndef" || name == "else" || name == "endif";
+}
+
+std::vector<std::string> Yuasm::split_args(std::string_view args) {
+    std::vector<std::string> result;
+    if (args.find_first_not_of(" \r") == std::string_view::npos) {
+        return result;
+    }
+
+    size_t begin = 0;
+    int depth = 0;
+    for (size_t i=0; i<=args.size(); i++) {
+        if (i < args.size() && args[i] == '(') {
+            depth++;
+        } else if (i < args.size() && args[i] == ')') {
+            depth--;
+        } else if (i == args.size() || (args[i] == ',' && depth == 0)) {
+            std::string_view arg = args.substr(begin, i - begin);
+            size_t first = arg.find_first_not_of(" \r");
+            arg = (first == std::string_view::npos) ? std::string_view() : arg.substr(first, arg.find_last_not_of(" \r") - first + 1);
+            result.emplace_back(arg);
+            begin = i + 1;
+        }
+    }
+    return result;
+}
+
+// The dot keeps the names apart from anything in the source, and they are never exported (see apply_visibility)
+std::string Yuasm::local_label_name(std::string_view label, int expansion) {
+    return std::string(label) + "." + std::to_string(expansion);
+}
+
+std::string Yuasm::renumber_local_label(std::string_view name, int offset) {
+    size_t dot = name.find('.');
+    if (dot == std::string_view::npos) {
+        return std::string(name);
+    }
+    int expansion = std::stoi(std::string(name.substr(dot + 1)));
+    return std::string(name.substr(0, dot + 1)) + std::to_string(expansion + offset);
+}
+
 bool Yuasm::is_alphabetic(char ch) {
     return (isalpha(ch) || (ch == '_'));
 }
@@ -1937,7 +3682,7 @@ uint32_t Yuasm::twos_complement(uint32_t val) {
     return ~val + 1;
 }
 
-uint32_t Yuasm::get_no_of_params_for_instr(std::string instr) {
+uint32_t Yuasm::get_no_of_params_for_instr(std::string_view instr) {
     if (instr == "loadm") {
         return 2;
     } else if (instr == "loadr") {
@@ -1999,7 +3744,7 @@ uint32_t Yuasm::get_no_of_params_for_instr(std::string instr) {
     } else if (instr == "uloadm") {
         return 2;
     }
-    throw std::runtime_error("Invalid instruction: " + instr);
+    throw std::runtime_error("Invalid instruction: " + std::string(instr));
 }
 
 bool Yuasm::is_hex_digit(char c) { // parameter must be uppercase
@@ -2019,32 +3764,39 @@ uint32_t Yuasm::get_hex_value(char c) { // parameter must be uppercase and a val
 }
 
 std::string Yuasm::get_instr_as_hex(uint32_t instr_int) {
-    unsigned char instr_bytes[4];
-    instr_bytes[0] = (instr_int) & 0xFF;
-    instr_bytes[1] = (instr_int >> 8) & 0xFF;
-    instr_bytes[2] = (instr_int >> 16) & 0xFF;
-    instr_bytes[3] = (instr_int >> 24) & 0xFF;
-
-    std::stringstream ss;
-
-    ss << "0x" << std::uppercase << std::hex
-    << std::setw(2) << std::setfill('0') << (int)instr_bytes[3] 
-    << std::setw(2) << std::setfill('0') << (int)instr_bytes[2]
-    << std::setw(2) << std::setfill('0') << (int)instr_bytes[1]
-    << std::setw(2) << std::setfill('0') << (int)instr_bytes[0];
-
-    return ss.str();
+    char hex[11]; // fits in the small string buffer so printing an instruction doesn't allocate
+    std::snprintf(hex, sizeof(hex), "0x%08X", instr_int);
+    return std::string(hex);
 }
 
+// The object is at the same path relative to the object directory as the source is relative to the
+// working directory, so sources with the same name in different directories get different objects.
+// Sources outside of the working directory go under _abs/ with their whole path.
 std::string Yuasm::generate_ofname(std::string fpath) {
-    size_t last_slash_pos = fpath.find_last_of("/\\");
-    std::string fname = (last_slash_pos == std::string::npos) ? fpath : fpath.substr(last_slash_pos + 1);
-    size_t last_dot_pos = fname.find_last_of('.');
-    std::string fname_noext = (last_dot_pos == std::string::npos) ? fname : fname.substr(0, last_dot_pos);
-    return fname_noext + ".o";
+    std::filesystem::path source = std::filesystem::absolute(fpath).lexically_normal();
+    std::filesystem::path rel = source.lexically_relative(std::filesystem::current_path());
+    if (rel.empty() || *rel.begin() == "..") {
+        rel = "_abs" / source.relative_path();
+    }
+    rel.replace_extension(".o");
+    return rel.generic_string();
 }
 
+std::string Yuasm::escape_make_path(std::string_view fpath) {
+    std::string escaped;
+    for (char ch : fpath) {
+        if (ch == ' ' || ch == '#') {
+            escaped.push_back('\\');
+        } else if (ch == '$') {
+            escaped.push_back('$');
+        }
+        escaped.push_back(ch);
+    }
+    return escaped;
+}
 
-bool Yuasm::create_objects_dir_safely() {
-    return std::filesystem::create_directories("objects");
+bool Yuasm::create_objects_dir_safely(const std::string& obj_fpath) {
+    std::filesystem::path dir = std::filesystem::path(obj_fpath).parent_path();
+    std::error_code error; // another assembler may create it at the same time
+    return dir.empty() || std::filesystem::create_directories(dir, error);
 }
\ No newline at end of file
@@ -2,20 +2,98 @@
 #define YUASM_H
 
 #include <fstream>
+#include <iostream>
 #include <string>
+#include <string_view>
 #include <vector>
+#include <array>
 #include <map>
+#include <set>
+#include <unordered_set>
+#include <unordered_map>
+#include <sstream>
 #include <stack>
 #include <memory>
 #include <cstdint>
+#include <initializer_list>
+
+#include "yustats.h"
+#include "yufile.h"
 
 using uint32_t = std::uint32_t;
 
 inline constexpr char newl[] = "\n";
 
+struct YuasmOptions {
+    Stats* stats = nullptr; // phase timings and counters are collected when set (--stats)
+    int jobs = 1; // threads used to assemble the main file (-j), 1 assembles it serially
+    size_t min_chunk_bytes = 64 * 1024; // a file is only split if every thread gets at least this much
+    int opt_level = 0; // -O, 1 runs the peephole optimizer before the object is written, 2 also the dataflow optimizer, 3 also loop invariant code motion
+    long long data_base = -1; // --data-base, passed on to the linker
+    int inline_budget = 0; // --inline, calls to local leaf sections of at most this many instructions are inlined, 0 disables it
+    std::vector<std::pair<std::string, std::string>> defines; // -D name[=value], defined before the first line is read
+    bool sync_output = false; // --fsync, the object and the program are flushed to disk before they replace the old ones
+    std::string obj_fpath; // -o, the object file, <obj_dir>/ + generate_ofname(source) if empty
+    std::string obj_dir = "objects"; // --obj-dir
+    std::string out_dir = "out"; // --out, where the automatic link writes program.bin
+    bool write_deps = false; // -MD, a depfile with the source and every included file is written next to the object
+    std::string dep_fpath; // -MF, the object path with .d instead of .o if empty
+    FileCache* file_cache = nullptr; // yuasmd, the sources and the object of the automatic link are read through it
+    bool auto_link = true; // the object is linked on its own into program.bin, --watch links all of its objects instead
+};
+
+// A whole source file read into memory, pos is the index of the next character to scan
+struct SourceFile {
+    std::string text;
+    size_t pos = 0;
+};
+
+// Symbol names are copied here once per assembly and handed out as views that stay valid
+// as long as the arena, so the section and caller tables don't hold a string per entry
+class SymbolArena {
+public:
+    std::string_view intern(std::string_view name);
+
+private:
+    static constexpr size_t BLOCK_SIZE = 4096;
+
+    std::vector<std::unique_ptr<char[]>> blocks;
+    size_t block_used = BLOCK_SIZE;
+    std::unordered_set<std::string_view> names;
+};
+
+// Collects the listing of a line for the encoding cache. Clearing text keeps its capacity,
+// which an ostringstream doesn't, so capturing a line doesn't allocate once it has grown.
+class ListingBuffer : public std::streambuf {
+public:
+    std::string text;
+
+protected:
+    int_type overflow(int_type ch) override;
+    std::streamsize xsputn(const char* s, std::streamsize n) override;
+};
+
+using MacroMap = std::map<std::string, std::string, std::less<>>; // transparent so it can be searched with views
+
+// Where the main file is cut for parallel assembly, see Yuasm::split_source
+struct SourceSplit {
+    struct Chunk {
+        size_t begin;
+        size_t end;
+        int first_line;
+    };
+
+    std::vector<Chunk> chunks; // the first chunk holds everything up to the last directive that isn't a #define
+    std::vector<std::pair<size_t, size_t>> define_lines; // [begin, end) of the #define lines after the first chunk
+};
+
 class Yuasm {
 public:
-    Yuasm(std::string first_fname);
+    Yuasm(std::string first_fname, YuasmOptions set_options = YuasmOptions());
+
+    bool succeeded() const { return object_written; }
+    const std::string& object_path() const { return obj_fpath; }
+    const std::vector<std::string>& included_files() const { return dependencies; } // with the source itself, as opened
 
     enum State {
         SCAN_FIRST,
@@ -40,6 +118,9 @@ public:
         SCAN_PARAM_YES_COMMA_NO_DASH,
         SCAN_PARAM_NO_COMMA_YES_DASH,
         SCAN_PARAM_NO_COMMA_NO_DASH,
+        SCAN_EXPR,
+        SCAN_DIRECTIVE_ARGS,
+        SCAN_MACRO_ARGS,
         INVALID_STATE
     };
 
@@ -65,49 +146,190 @@ public:
     };
 
 private:
+    friend class Benchmark; // bench/yubench.cpp drives single methods for microbenchmarks
+
+    Yuasm() {} // only used by the benchmarks
+
     static constexpr int DEBUG_LEVEL = 0; // 0: instr info, 1: state completions, 2: full info
 
+    YuasmOptions options;
     State state = SCAN_FIRST;
+    long long chars_scanned = 0; // for stats, counted locally because it's per character
+
+    static constexpr int MAX_PARAMS = 3; // no instruction takes more than three parameters
 
-    std::vector<char> buffer0; // for instructions and function names and macro names
-    std::vector<char> buffer1; // for macro values and instruction parameters
-    std::vector<std::string> params; // for instruction parameters
+    // The scanning buffers and the parameters are reused between instructions and keep their capacity,
+    // so scanning and encoding an instruction doesn't allocate once they have grown to the longest token
+    std::string buffer0; // for instructions and function names and macro names
+    std::string buffer1; // for macro values and instruction parameters
+    std::array<std::string, MAX_PARAMS> params; // for instruction parameters
+    int n_params = 0;
     std::vector<uint32_t> instructions;
     std::vector<char> line_buffer; // used in error messages
     std::stack<int> line_counters; // used in error messages (a counter per file)
     std::stack<std::string> fnames; // used in error messages
+    std::vector<std::string> dependencies; // every file read into the files stack, in the order they were opened
 
-    std::string ofname;
-    std::stack<std::unique_ptr<std::ifstream>> files;
-    std::map<std::string, std::string> macros;
-    std::map<std::string, int> functions; // should be called sections really
-    std::multimap<std::string, int> callers; // caller positions
+    std::ostream* log_out = &std::cout; // per-instruction output, a chunk worker writes to its own buffer
+    std::ostream* log_err = &std::cerr;
+
+    // Lines that encode to the same word without a relocation are only encoded once per assembly,
+    // the word and its listing line are looked up by the mnemonic and the macro expanded parameters
+    struct CachedEncoding {
+        uint32_t word;
+        std::string listing;
+    };
+    static constexpr size_t MAX_ENCODING_CACHE = 1 << 16; // a program of mostly unique lines stops filling it
+    std::unordered_map<std::string, CachedEncoding> encoding_cache;
+    std::string encoding_key; // reused so a lookup doesn't allocate
+    ListingBuffer listing_buffer;
+    std::ostream encoding_listing{&listing_buffer};
+    long long encoding_hits = 0;
+    long long encoding_misses = 0;
+
+    std::string obj_fpath;
+    bool object_written = false;
+    std::stack<std::unique_ptr<SourceFile>> files;
+    MacroMap macros;
+    SymbolArena symbols; // owns the names used as keys in functions and callers
+    std::map<std::string_view, int> functions; // should be called sections really
+    std::vector<std::pair<std::string_view, int>> callers; // caller positions in source order
+    std::vector<std::pair<int, int>> local_branches; // branch -> section of this object, patched by resolve_local_branches
+    std::set<std::string_view> global_names; // from .global, once there is one the other sections are hidden
+    std::set<std::string_view> local_names; // from .local
+    std::set<std::string_view> hidden_sections; // sections left out of the object's DEFs, see apply_visibility
     uint32_t pc = 0; // program counter
 
+    bool in_data = false; // between .data and .text, sections are data labels and instructions aren't allowed
+    std::vector<uint32_t> data; // words from .word, .fill and .ascii, the data location counter is data.size() * 4
+    std::map<std::string_view, int> data_labels; // data label -> offset in data in bytes
+    bool args_quote = false; // inside a string in the arguments of a directive
+    bool args_escape = false; // after a backslash in that string
+
+    // A #rep block being repeated. The body is scanned again from the source for every iteration,
+    // so nothing is copied, and the index macro holds the number of the current iteration.
+    struct RepFrame {
+        size_t file_depth; // the block has to end in the file it started in
+        int line; // of the #rep, for errors
+        size_t body_begin = 0;
+        int body_line = 0;
+        uint32_t count;
+        uint32_t index = 0;
+        std::string index_macro;
+        bool had_macro; // the index macro shadows a macro of the same name until #endrep
+        std::string saved_value;
+    };
+    std::vector<RepFrame> reps;
+
+    // A #macro, the body is kept as text and scanned like an included file for every call
+    struct FunctionMacro {
+        std::vector<std::string> params;
+        std::vector<std::string> labels; // sections defined in the body, every expansion gets its own copy
+        std::string body;
+        std::string fname; // where the body is, for errors
+        int body_line = 0;
+    };
+    std::map<std::string, FunctionMacro, std::less<>> function_macros;
+
+    // A call being expanded, the parameters and local labels are macros until the end of the body
+    struct MacroCall {
+        size_t file_depth;
+        const FunctionMacro* macro;
+        std::vector<std::pair<std::string, std::string>> saved; // the macros they shadow
+        std::vector<std::string> added; // the ones that didn't exist before
+    };
+    std::vector<MacroCall> macro_calls;
+    static constexpr size_t MAX_MACRO_DEPTH = 64; // a macro that calls itself would never end
+    int macro_expansions = 0; // numbers the local labels
+    int macro_args_depth = 0; // parenthesis nesting in the arguments of a call
+    std::string pending_macro; // the macro defined or called on the current line
+    std::vector<std::string> pending_args;
+    bool defining_macro = false; // the body was skipped, the #endmacro is next
+
+    // An open #if, #ifdef or #ifndef. Only the branch that is assembled goes through the FSM, the others are
+    // skipped by skip_lines, so when the FSM sees an #else the branch before it was taken.
+    struct CondFrame {
+        size_t file_depth; // the block has to end in the file it started in
+        int line; // of the #if, for errors
+        bool taken; // a branch of the block is being assembled
+        bool in_else = false;
+    };
+    std::vector<CondFrame> conds;
+
+    // Jumps in the source are made once the line of the directive has ended
+    enum LineAction {
+        NO_LINE_ACTION,
+        BEGIN_REP, // the body starts on the next line
+        REPEAT_REP, // back to the start of the body
+        SKIP_REP, // #rep 0, skip to its #endrep
+        DEFINE_MACRO, // the body is copied up to #endmacro
+        EXPAND_MACRO, // the body is scanned next
+        SKIP_BRANCH // skip to the #else or #endif of the innermost #if
+    };
+    LineAction line_action = NO_LINE_ACTION;
+
     State state_before_block_comment; // TODO not properly implemented
+    State state_before_expr; // the parameter or macro value state that started the expression
+    std::string expr_buffer; // constant expression text including the outer parentheses
+    int expr_depth = 0; // parenthesis nesting depth inside expr_buffer
+    bool after_expr = false; // the next character is the first after the ')' of an expression
 
+    bool define_option_macros();
     bool open_new_file(std::string fname);
+    bool read_source(const std::string& fpath, SourceFile* source);
     bool mainloop();
+    bool assemble_parallel();
     std::string print_state();
-    bool eval_instr(std::string instr, std::vector<std::string> params);
+    bool eval_instr(std::string_view instr, const std::array<std::string, MAX_PARAMS>& params, int n_params);
+    bool encode_instr(std::string_view instr, const std::array<std::string, MAX_PARAMS>& params, int n_params);
+    bool push_param();
+    void substitute_macro(std::string* buffer);
+    bool begin_expr();
+    bool finish_expr();
+    bool end_expr_param(Input category, char ch); // only a separator can follow an expression
+    bool finish_directive(Input category); // evaluates the directive in buffer0 with the arguments in buffer1
+    bool eval_data_directive(std::string_view directive, std::string_view args);
+    bool eval_visibility_directive(std::string_view directive, std::string_view args);
+    bool apply_visibility();
+    bool eval_preproc_directive(std::string_view directive, std::string_view args); // the ones that take the rest of the line
+    bool end_of_line_action();
+    bool define_macro();
+    bool begin_cond(bool condition);
+    bool begin_macro_call();
+    bool expand_macro_call();
+    void end_macro_call();
+    std::string_view skip_lines(std::initializer_list<std::string_view> openers, std::string_view closer,
+                                std::initializer_list<std::string_view> stops);
+    bool optimize();
+    void resolve_local_branches();
     bool write_object();
     bool link_object();
+    bool write_depfile();
     void print_line_to_std_err();
     Input get_next_char_category();
 
-    static void expand_macro(std::vector<char>* buffer, std::map<std::string, std::string> macro_list);
+    static bool expand_macro(std::string* buffer, const MacroMap& macro_list); // returns true if buffer was a macro
+    static int32_t eval_const_expr(const std::string& expr, const MacroMap& macro_list, int depth = 0);
+    static SourceSplit split_source(const std::string& text, int n_chunks, size_t min_chunk_bytes);
     static const Input get_category(char ch);
+    static bool is_data_directive(std::string_view name);
+    static bool is_visibility_directive(std::string_view name); // .global and .local
+    static bool is_line_directive(std::string_view name); // preprocessor directives evaluated by eval_preproc_directive
+    static std::vector<std::string> split_args(std::string_view args); // at the commas outside of parentheses, trimmed
+    static std::string local_label_name(std::string_view label, int expansion);
+    static std::string renumber_local_label(std::string_view name, int offset); // for the labels of a -j chunk
     static bool is_alphabetic(char ch);
     static bool is_numeric(char ch);
-    static uint32_t get_no_of_params_for_instr(std::string instr); // returns -1 if instruction is invalid
-    static uint32_t param_to_int(std::string param);
+    static uint32_t get_no_of_params_for_instr(std::string_view instr); // returns -1 if instruction is invalid
+    static uint32_t param_to_int(std::string_view param);
     static bool is_hex_digit(char c);
     static bool is_binary_digit(char c);
     static uint32_t get_hex_value(char c);
     static std::string get_instr_as_hex(uint32_t instr_int);
     static uint32_t twos_complement(uint32_t val);
-    static std::string generate_ofname(std::string fpath);
-    static bool create_objects_dir_safely();
+    static std::string generate_ofname(std::string fpath); // relative to the object directory
+    static std::string escape_make_path(std::string_view fpath);
+    static bool create_objects_dir_safely(const std::string& obj_fpath);
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,154 @@
+#include "yuasm.h"
+#include "yustats.h"
+#include "yucli.h"
+#include "yuwatch.h"
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <algorithm>
+#include <vector>
+#include <climits>
+#include <cstdint>
+
+int yuasm_command(int argc, char* argv[], FileCache* file_cache) {
+    std::vector<std::string> fpaths;
+    bool stats_enabled = false;
+    bool stats_json = false;
+    std::string stats_fpath; // stats go to stderr if empty
+    int jobs = 1;
+    int opt_level = 0;
+    int inline_budget = 0;
+    long long data_base = -1;
+    std::vector<std::pair<std::string, std::string>> defines;
+    bool sync_output = false;
+    std::string obj_fpath;
+    std::string obj_dir = "objects";
+    std::string out_dir = "out";
+    bool write_deps = false;
+    std::string dep_fpath;
+    bool watch = false;
+
+    for (int i=1; i<argc; i++) {
+        std::string arg (argv[i]);
+        if (arg == "--stats" || arg == "--stats=text") {
+            stats_enabled = true;
+        } else if (arg == "--stats=json") {
+            stats_enabled = true;
+            stats_json = true;
+        } else if (arg == "--stats-file" && i + 1 < argc) {
+            stats_fpath = argv[++i];
+        } else if (arg == "-O" || arg == "-O1") {
+            opt_level = 1;
+        } else if (arg == "-O2") {
+            opt_level = 2;
+        } else if (arg == "-O3") {
+            opt_level = 3;
+        } else if (arg == "-O0") {
+            opt_level = 0;
+        } else if (arg == "--data-base" && i + 1 < argc) {
+            if (!parse_option_number(arg, argv[++i], 0, UINT32_MAX, &data_base, 0)) {
+                return 1;
+            }
+        } else if (arg == "-o" && i + 1 < argc) {
+            obj_fpath = argv[++i];
+        } else if (arg == "--obj-dir" && i + 1 < argc) {
+            obj_dir = argv[++i];
+        } else if (arg == "--out" && i + 1 < argc) {
+            out_dir = argv[++i];
+        } else if (arg == "-MD") {
+            write_deps = true;
+        } else if (arg == "-MF" && i + 1 < argc) {
+            write_deps = true;
+            dep_fpath = argv[++i];
+        } else if (arg == "--watch") {
+            watch = true;
+        } else if (arg == "--fsync") {
+            sync_output = true;
+        } else if (arg == "--inline" && i + 1 < argc) {
+            long long value;
+            if (!parse_option_number(arg, argv[++i], 0, INT_MAX, &value)) {
+                return 1;
+            }
+            inline_budget = value;
+        } else if (arg.rfind("-D", 0) == 0) {
+            std::string define = (arg.size() > 2) ? arg.substr(2) : (i + 1 < argc ? argv[++i] : "");
+            size_t eq = define.find('=');
+            if (define.empty() || eq == 0) {
+                std::cout << "-D expects a macro name\n";
+                return 1;
+            }
+            if (eq == std::string::npos) {
+                defines.push_back({define, "1"});
+            } else {
+                defines.push_back({define.substr(0, eq), define.substr(eq + 1)});
+            }
+        } else if (arg == "-j" && i + 1 < argc) {
+            long long value;
+            if (!parse_option_number(arg, argv[++i], 0, INT_MAX, &value)) {
+                return 1;
+            }
+            jobs = value;
+        } else if (arg.rfind("-j", 0) == 0 && arg.size() > 2) {
+            long long value;
+            if (!parse_option_number("-j", argv[i] + 2, 0, INT_MAX, &value)) {
+                return 1;
+            }
+            jobs = value;
+        } else if (arg.size() > 1 && arg[0] == '-') {
+            std::cout << "Unknown option: " << arg << "\n";
+            return 1;
+        } else {
+            fpaths.push_back(arg);
+        }
+    }
+
+    if (fpaths.empty()) {
+        std::cout << "Please provide the source code file path as an argument\n";
+        std::cout << "Note: only one source file is allowed at the moment, except with --watch\n";
+        std::cout << "Options: --stats[=text|json] [--stats-file path] [-j threads] [-O|-O2|-O3] [--inline max_instrs] [--data-base addr] [-D name[=value]] [-o obj_path] [--obj-dir dir] [--out dir] [-MD] [-MF depfile] [--watch] [--fsync]\n";
+        return 1;
+    }
+    if (fpaths.size() > 1 && !watch) {
+        std::cout << "Only one source file is allowed at the moment, except with --watch\n";
+        return 1;
+    }
+    if (watch && (stats_enabled || (!obj_fpath.empty() && fpaths.size() > 1) || file_cache != nullptr)) {
+        std::cout << "--watch can't be combined with --stats, -o with several sources or yuasmd\n";
+        return 1;
+    }
+
+    Stats stats;
+    YuasmOptions options;
+    options.jobs = std::max(jobs, 1);
+    options.opt_level = opt_level;
+    options.inline_budget = inline_budget;
+    options.data_base = data_base;
+    options.defines = defines;
+    options.sync_output = sync_output;
+    options.obj_fpath = obj_fpath;
+    options.obj_dir = obj_dir;
+    options.out_dir = out_dir;
+    options.write_deps = write_deps;
+    options.dep_fpath = dep_fpath;
+    options.file_cache = file_cache;
+    if (stats_enabled) {
+        options.stats = &stats;
+    }
+
+    if (watch) {
+        Watcher watcher(fpaths, options);
+        return watcher.run();
+    }
+
+    Yuasm yuasm(fpaths[0], options);
+
+    if (stats_enabled) {
+        if (stats_fpath.empty()) {
+            stats.print(std::cerr, stats_json);
+        } else {
+            std::ofstream stats_file(stats_fpath);
+            stats.print(stats_file, stats_json);
+        }
+    }
+    return yuasm.succeeded() ? 0 : 1; // the auto-link may fail for a program of several objects
+}
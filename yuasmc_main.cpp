@@ -0,0 +1,93 @@
+#include "yudaemon.h"
+#include <iostream>
+#include <string>
+#include <vector>
+#include <filesystem>
+#include <cstring>
+#include <cstdlib>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Takes the same arguments as yuasm, or as yulinker after --link, and has yuasmd run them.
+// If no daemon is listening, the yuasm or yulinker next to this program runs them instead.
+int main(int argc, char* argv[]) {
+    std::string socket_fpath = DaemonProtocol::default_socket_path();
+    std::string command = "yuasm";
+
+    // the options of the client come first, everything from the first other argument on is the command line
+    int first = 1;
+    while (first < argc) {
+        std::string arg (argv[first]);
+        if (arg == "--socket" && first + 1 < argc) {
+            socket_fpath = argv[first + 1];
+            first += 2;
+        } else if (arg == "--link") {
+            command = "yulinker";
+            first++;
+        } else if (arg == "--stop") {
+            command = "stop";
+            first++;
+        } else {
+            break;
+        }
+    }
+
+    // Anyone can create the socket in /tmp before the daemon does, the command line and the
+    // working directory are only sent to a socket of this user
+    struct stat socket_stat;
+    if (lstat(socket_fpath.c_str(), &socket_stat) == 0 && (!S_ISSOCK(socket_stat.st_mode) || socket_stat.st_uid != getuid())) {
+        std::cerr << "Error: " << socket_fpath << " isn't a socket of this user, not connecting to it\n";
+        return 1;
+    }
+
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    bool connected = fd >= 0 && socket_fpath.size() < sizeof(addr.sun_path);
+    if (connected) {
+        std::strcpy(addr.sun_path, socket_fpath.c_str());
+        connected = connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0;
+    }
+
+    if (!connected) {
+        if (command == "stop") {
+            std::cerr << "Error: no yuasmd is listening on " << socket_fpath << "\n";
+            return 1;
+        }
+        std::error_code error;
+        std::filesystem::path self = std::filesystem::read_symlink("/proc/self/exe", error);
+        std::string tool = (error ? std::filesystem::path(argv[0]) : self).parent_path() / command;
+        std::vector<char*> tool_argv = {tool.data()};
+        for (int i=first; i<argc; i++) {
+            tool_argv.push_back(argv[i]);
+        }
+        tool_argv.push_back(nullptr);
+        execv(tool.c_str(), tool_argv.data());
+        std::cerr << "Error: no yuasmd is listening on " << socket_fpath << " and " << tool << " could not be run\n";
+        return 1;
+    }
+
+    std::vector<std::string> request = {std::filesystem::current_path().string(), command};
+    for (int i=first; i<argc; i++) {
+        request.push_back(argv[i]);
+    }
+    std::vector<std::string> response;
+    if (!DaemonProtocol::send_message(fd, request) || !DaemonProtocol::receive_message(fd, &response) || response.size() != 3) {
+        std::cerr << "Error: yuasmd on " << socket_fpath << " didn't answer\n";
+        close(fd);
+        return 1;
+    }
+    close(fd);
+
+    std::cout << response[1];
+    std::cerr << response[2];
+    char* end = nullptr;
+    long code = std::strtol(response[0].c_str(), &end, 10);
+    if (response[0].empty() || *end != '\0' || code < 0 || code > 255) {
+        std::cerr << "Error: yuasmd on " << socket_fpath << " sent an invalid exit code\n";
+        return 1;
+    }
+    return code;
+}
@@ -0,0 +1,173 @@
+#include "yuasmd.h"
+#include "yudaemon.h"
+#include "yucli.h"
+
+#include <iostream>
+#include <sstream>
+#include <exception>
+#include <cerrno>
+#include <cstring>
+#include <csignal>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+Yuasmd::Yuasmd(YuasmdOptions set_options) : options(set_options), file_cache(set_options.cache_bytes) {
+    if (options.socket_fpath.empty()) {
+        options.socket_fpath = DaemonProtocol::default_socket_path();
+    }
+}
+
+Yuasmd::~Yuasmd() {
+    if (listen_fd >= 0) {
+        close(listen_fd);
+        unlink(options.socket_fpath.c_str());
+    }
+}
+
+int Yuasmd::run() {
+    if (!open_socket()) {
+        return 1;
+    }
+    std::signal(SIGPIPE, SIG_IGN); // a client that goes away only fails its own response
+
+    std::cout << "yuasmd: listening on " << options.socket_fpath << std::endl;
+    while (true) {
+        int client_fd = accept(listen_fd, nullptr, nullptr);
+        if (client_fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            std::cerr << "Error: yuasmd could not accept a connection: " << std::strerror(errno) << "\n";
+            return 1;
+        }
+        bool keep_running = serve(client_fd);
+        close(client_fd);
+        if (!keep_running) {
+            return 0;
+        }
+    }
+}
+
+bool Yuasmd::open_socket() {
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if (options.socket_fpath.size() >= sizeof(addr.sun_path)) {
+        std::cerr << "Error: socket path is too long: " << options.socket_fpath << "\n";
+        return false;
+    }
+    std::strcpy(addr.sun_path, options.socket_fpath.c_str());
+
+    listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd < 0) {
+        std::cerr << "Error: could not create a socket: " << std::strerror(errno) << "\n";
+        return false;
+    }
+
+    mode_t mask = umask(0077); // only the user who started the daemon can connect to it
+    int bound = bind(listen_fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr));
+    if (bound != 0 && errno == EADDRINUSE) {
+        // a daemon that was killed leaves its socket behind, it is only taken over if nobody answers on it
+        int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+        bool alive = probe >= 0 && connect(probe, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0;
+        if (probe >= 0) {
+            close(probe);
+        }
+        if (alive) {
+            umask(mask);
+            std::cerr << "Error: another yuasmd is listening on " << options.socket_fpath << "\n";
+            close(listen_fd);
+            listen_fd = -1;
+            return false;
+        }
+        unlink(options.socket_fpath.c_str());
+        bound = bind(listen_fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr));
+    }
+    umask(mask);
+
+    if (bound != 0 || listen(listen_fd, 16) != 0) {
+        std::cerr << "Error: could not listen on " << options.socket_fpath << ": " << std::strerror(errno) << "\n";
+        close(listen_fd);
+        listen_fd = -1;
+        return false;
+    }
+    return true;
+}
+
+bool Yuasmd::serve(int client_fd) {
+    // The commands write files anywhere the client asks, the socket mode alone isn't relied on
+    if (!peer_is_owner(client_fd)) {
+        std::cerr << "yuasmd: refused a connection from another user" << std::endl;
+        return true;
+    }
+    std::vector<std::string> request;
+    if (!DaemonProtocol::receive_message(client_fd, &request) || request.size() < 2) {
+        return true; // not a client, or it went away
+    }
+    if (request[1] == "stop") {
+        DaemonProtocol::send_message(client_fd, {"0", "", ""});
+        return false;
+    }
+    DaemonProtocol::send_message(client_fd, run_command(std::move(request)));
+    return true;
+}
+
+bool Yuasmd::peer_is_owner(int client_fd) {
+#ifdef __linux__
+    ucred cred = {};
+    socklen_t len = sizeof(cred);
+    if (getsockopt(client_fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0 || len != sizeof(cred)) {
+        return false;
+    }
+    return cred.uid == getuid();
+#else
+    uid_t uid;
+    gid_t gid;
+    return getpeereid(client_fd, &uid, &gid) == 0 && uid == getuid();
+#endif
+}
+
+std::vector<std::string> Yuasmd::run_command(std::vector<std::string> request) {
+    const std::string& cwd = request[0];
+    const std::string& command = request[1];
+    if (command != "yuasm" && command != "yulinker") {
+        return {"1", "", "Error: yuasmd doesn't know the command " + command + "\n"};
+    }
+    if (chdir(cwd.c_str()) != 0) {
+        return {"1", "", "Error: yuasmd could not change to " + cwd + ": " + std::strerror(errno) + "\n"};
+    }
+
+    std::vector<char*> argv; // the command is argv[0]
+    for (size_t i=1; i<request.size(); i++) {
+        argv.push_back(request[i].data());
+    }
+    argv.push_back(nullptr);
+
+    // The commands print to std::cout and std::cerr, which go to the client instead for the request.
+    // Requests are served one at a time, so nothing else prints in the meantime.
+    std::ostringstream out;
+    std::ostringstream err;
+    std::ios saved_format(nullptr);
+    saved_format.copyfmt(std::cout);
+    std::streambuf* cout_buf = std::cout.rdbuf(out.rdbuf());
+    std::streambuf* cerr_buf = std::cerr.rdbuf(err.rdbuf());
+
+    int code = 1;
+    try {
+        if (command == "yuasm") {
+            code = yuasm_command(argv.size() - 1, argv.data(), &file_cache);
+        } else {
+            code = yulinker_command(argv.size() - 1, argv.data(), &file_cache);
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << "\n";
+    }
+
+    std::cout.rdbuf(cout_buf);
+    std::cerr.rdbuf(cerr_buf);
+    std::cout.copyfmt(saved_format); // a command that left std::hex set doesn't change the next one
+    std::cout.clear();
+    std::cerr.clear();
+    return {std::to_string(code), out.str(), err.str()};
+}
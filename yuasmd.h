@@ -0,0 +1,35 @@
+#ifndef YUASMD_H
+#define YUASMD_H
+
+#include <string>
+#include <vector>
+#include <cstddef>
+
+#include "yufile.h"
+
+struct YuasmdOptions {
+    std::string socket_fpath; // --socket, DaemonProtocol::default_socket_path() if empty
+    size_t cache_bytes = 256 << 20; // --cache-mb, the least recently read files are dropped above this
+};
+
+// Runs the yuasm and yulinker command lines that yuasmc sends, one at a time. The sources, includes and
+// objects they read stay in a FileCache between requests, so a build only reads the files that changed.
+// Macro tables aren't kept since what a header defines depends on -D and the #if state it is included in.
+class Yuasmd {
+public:
+    Yuasmd(YuasmdOptions set_options = YuasmdOptions());
+    ~Yuasmd();
+    int run(); // until a client sends stop, 1 if the socket can't be opened
+
+private:
+    YuasmdOptions options;
+    FileCache file_cache;
+    int listen_fd = -1;
+
+    bool open_socket();
+    bool serve(int client_fd); // false after a stop request
+    static bool peer_is_owner(int client_fd); // the client runs as the user of the daemon
+    std::vector<std::string> run_command(std::vector<std::string> request); // the response
+};
+
+#endif
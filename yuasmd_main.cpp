@@ -0,0 +1,29 @@
+#include "yuasmd.h"
+#include "yucli.h"
+#include <iostream>
+#include <string>
+#include <cstdint>
+
+int main(int argc, char* argv[]) {
+    YuasmdOptions options;
+
+    for (int i=1; i<argc; i++) {
+        std::string arg (argv[i]);
+        if (arg == "--socket" && i + 1 < argc) {
+            options.socket_fpath = argv[++i];
+        } else if (arg == "--cache-mb" && i + 1 < argc) {
+            long long cache_mb;
+            if (!parse_option_number(arg, argv[++i], 0, (long long) (SIZE_MAX >> 21), &cache_mb)) {
+                return 1;
+            }
+            options.cache_bytes = (size_t) cache_mb << 20;
+        } else {
+            std::cout << "Unknown option: " << arg << "\n";
+            std::cout << "Options: [--socket path] [--cache-mb size]\n";
+            return 1;
+        }
+    }
+
+    Yuasmd yuasmd(options);
+    return yuasmd.run();
+}
@@ -0,0 +1,27 @@
+#ifndef YUCLI_H
+#define YUCLI_H
+
+#include "yufile.h"
+#include <iostream>
+#include <string>
+#include <cstdlib>
+#include <cerrno>
+
+// The command lines of yuasm and yulinker, yuasmd runs them for its clients with its file cache
+int yuasm_command(int argc, char* argv[], FileCache* file_cache = nullptr);
+int yulinker_command(int argc, char* argv[], FileCache* file_cache = nullptr);
+
+// Reads the number given to a command line option, base 0 also takes 0x and 0 prefixes
+inline bool parse_option_number(const std::string& option, const char* text, long long min, long long max, long long* value, int base = 10) {
+    errno = 0;
+    char* end = nullptr;
+    long long parsed = std::strtoll(text, &end, base);
+    if (end == text || *end != '\0' || errno == ERANGE || parsed < min || parsed > max) {
+        std::cerr << "Error: " << option << " expects a number from " << min << " to " << max << ", got '" << text << "'\n";
+        return false;
+    }
+    *value = parsed;
+    return true;
+}
+
+#endif
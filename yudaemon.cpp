@@ -0,0 +1,95 @@
+#include "yudaemon.h"
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstdint>
+#include <unistd.h>
+
+std::string DaemonProtocol::default_socket_path() {
+    const char* socket = std::getenv("YUASMD_SOCKET");
+    if (socket != nullptr && socket[0] != '\0') {
+        return socket;
+    }
+    const char* runtime_dir = std::getenv("XDG_RUNTIME_DIR");
+    if (runtime_dir != nullptr && runtime_dir[0] != '\0') {
+        return std::string(runtime_dir) + "/yuasmd.sock";
+    }
+    return "/tmp/yuasmd-" + std::to_string(getuid()) + ".sock";
+}
+
+bool DaemonProtocol::write_all(int fd, const char* bytes, size_t n) {
+    while (n > 0) {
+        ssize_t written = write(fd, bytes, n);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return false;
+        }
+        bytes += written;
+        n -= written;
+    }
+    return true;
+}
+
+bool DaemonProtocol::read_all(int fd, char* bytes, size_t n) {
+    while (n > 0) {
+        ssize_t got = read(fd, bytes, n);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            return false;
+        }
+        bytes += got;
+        n -= got;
+    }
+    return true;
+}
+
+void DaemonProtocol::append_u32(std::string* out, uint32_t val) {
+    for (int shift=24; shift>=0; shift-=8) {
+        out->push_back((char) ((val >> shift) & 0xFF));
+    }
+}
+
+bool DaemonProtocol::read_u32(int fd, uint32_t* val) {
+    unsigned char bytes[4];
+    if (!read_all(fd, reinterpret_cast<char*>(bytes), 4)) {
+        return false;
+    }
+    *val = ((uint32_t) bytes[0] << 24) | ((uint32_t) bytes[1] << 16) | ((uint32_t) bytes[2] << 8) | bytes[3];
+    return true;
+}
+
+bool DaemonProtocol::send_message(int fd, const std::vector<std::string>& parts) {
+    std::string header; // the lengths go out with the first part, the parts themselves aren't copied
+    append_u32(&header, parts.size());
+    for (const std::string& part : parts) {
+        append_u32(&header, part.size());
+        if (!write_all(fd, header.data(), header.size()) || !write_all(fd, part.data(), part.size())) {
+            return false;
+        }
+        header.clear();
+    }
+    return write_all(fd, header.data(), header.size());
+}
+
+bool DaemonProtocol::receive_message(int fd, std::vector<std::string>* parts) {
+    uint32_t n_parts = 0;
+    if (!read_u32(fd, &n_parts) || n_parts > MAX_PARTS) {
+        return false;
+    }
+    parts->assign(n_parts, std::string());
+    for (std::string& part : *parts) {
+        uint32_t size = 0;
+        if (!read_u32(fd, &size) || size > MAX_PART_SIZE) {
+            return false;
+        }
+        part.resize(size);
+        if (!read_all(fd, part.data(), size)) {
+            return false;
+        }
+    }
+    return true;
+}
@@ -0,0 +1,30 @@
+#ifndef YUDAEMON_H
+#define YUDAEMON_H
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+// yuasmd and yuasmc talk over a Unix domain socket, one request and one response per connection.
+// A message is the number of its parts followed by the parts, each as its length and its bytes,
+// the numbers are 32 bits and big endian like in the object files.
+//   request: working directory, command ("yuasm", "yulinker" or "stop"), arguments of the command
+//   response: exit code, stdout, stderr
+class DaemonProtocol {
+public:
+    static std::string default_socket_path(); // $YUASMD_SOCKET, or yuasmd.sock in $XDG_RUNTIME_DIR, or /tmp/yuasmd-<uid>.sock
+    static bool send_message(int fd, const std::vector<std::string>& parts);
+    static bool receive_message(int fd, std::vector<std::string>* parts);
+
+private:
+    static constexpr uint32_t MAX_PARTS = 1 << 16;
+    static constexpr uint32_t MAX_PART_SIZE = 1u << 30;
+
+    static bool write_all(int fd, const char* bytes, size_t n);
+    static bool read_all(int fd, char* bytes, size_t n);
+    static void append_u32(std::string* out, uint32_t val);
+    static bool read_u32(int fd, uint32_t* val);
+};
+
+#endif
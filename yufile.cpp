@@ -0,0 +1,222 @@
+#include "yufile.h"
+
+#include <vector>
+#include <fstream>
+#include <filesystem>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+OutputFile::OutputFile(std::string set_fpath, size_t set_size, bool set_sync) : fpath(set_fpath), file_size(set_size), sync(set_sync) {}
+
+OutputFile::~OutputFile() {
+    if (mapped != nullptr) {
+        munmap(mapped, file_size);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    if (!committed && !tmp_fpath.empty()) {
+        unlink(tmp_fpath.c_str());
+    }
+}
+
+bool OutputFile::open() {
+    // mkstemp makes a unique name, so concurrent writers of the same path don't share a temporary file
+    std::vector<char> name(fpath.begin(), fpath.end());
+    const char suffix[] = ".tmp.XXXXXX";
+    name.insert(name.end(), suffix, suffix + sizeof(suffix)); // with the terminating zero
+    fd = mkstemp(name.data());
+    if (fd < 0) {
+        return fail("could not create a temporary file for " + fpath);
+    }
+    tmp_fpath = name.data();
+
+    // mkstemp creates the file for the owner only, an ofstream would have used the umask
+    mode_t mask = umask(0);
+    umask(mask);
+    fchmod(fd, 0666 & ~mask);
+
+    if (file_size == 0) {
+        return true;
+    }
+    if (ftruncate(fd, file_size) != 0) {
+        return fail("could not resize " + tmp_fpath);
+    }
+    // reserve the blocks now, writing to a mapping of a full disk would crash instead of failing
+    int reserved = posix_fallocate(fd, 0, file_size);
+    if (reserved != 0 && reserved != EOPNOTSUPP && reserved != EINVAL) {
+        errno = reserved;
+        return fail("could not reserve " + std::to_string(file_size) + " bytes for " + tmp_fpath);
+    }
+
+    void* map = mmap(nullptr, file_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        buffer.reset(new unsigned char[file_size]());
+    } else {
+        mapped = static_cast<unsigned char*>(map);
+    }
+    return true;
+}
+
+bool OutputFile::commit() {
+    if (mapped != nullptr) {
+        munmap(mapped, file_size);
+        mapped = nullptr;
+    } else if (buffer) {
+        size_t written = 0;
+        while (written < file_size) {
+            ssize_t n = pwrite(fd, buffer.get() + written, file_size - written, written);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                return fail("could not write " + tmp_fpath);
+            }
+            written += n;
+        }
+    }
+
+    if (sync && fsync(fd) != 0) {
+        return fail("could not flush " + tmp_fpath);
+    }
+    if (close(fd) != 0) {
+        fd = -1;
+        return fail("could not write " + tmp_fpath);
+    }
+    fd = -1;
+
+    if (rename(tmp_fpath.c_str(), fpath.c_str()) != 0) {
+        return fail("could not rename " + tmp_fpath + " to " + fpath);
+    }
+    committed = true;
+
+    if (sync) {
+        // the rename is only durable once the directory is flushed too
+        size_t slash = fpath.rfind('/');
+        std::string dir = (slash == std::string::npos) ? "." : (slash == 0 ? "/" : fpath.substr(0, slash));
+        int dir_fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+        if (dir_fd < 0 || fsync(dir_fd) != 0) {
+            if (dir_fd >= 0) {
+                close(dir_fd);
+            }
+            return fail("could not flush " + dir);
+        }
+        close(dir_fd);
+    }
+    return true;
+}
+
+bool OutputFile::sync_file(const std::string& fpath) {
+    int file_fd = ::open(fpath.c_str(), O_RDONLY);
+    if (file_fd < 0) {
+        return false;
+    }
+    bool synced = fsync(file_fd) == 0;
+    close(file_fd);
+    return synced;
+}
+
+bool OutputFile::fail(const std::string& what) {
+    error_message = what + ": " + std::strerror(errno);
+    return false;
+}
+
+const std::string* FileCache::read(const std::string& fpath, bool* cached) {
+    // the working directory changes between the builds of yuasmd, so relative paths aren't unique
+    std::string key = std::filesystem::absolute(fpath).lexically_normal().string();
+    struct stat st;
+    if (stat(key.c_str(), &st) != 0) {
+        return nullptr;
+    }
+    long long mtime_ns = (long long) st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+
+    auto it = entries.find(key);
+    if (it != entries.end() && it->second.dev == st.st_dev && it->second.ino == st.st_ino
+            && it->second.mtime_ns == mtime_ns && it->second.size == st.st_size) {
+        it->second.last_use = ++use_clock;
+        hits++;
+        if (cached != nullptr) {
+            *cached = true;
+        }
+        return &it->second.contents;
+    }
+    if (cached != nullptr) {
+        *cached = false;
+    }
+
+    std::ifstream file(key, std::ios::binary);
+    if (!file) {
+        return nullptr;
+    }
+    std::string contents(st.st_size, '\0');
+    file.read(contents.data(), contents.size());
+    contents.resize(file.gcount()); // the file may have changed since the stat
+
+    uint64_t hash = 0xcbf29ce484222325; // FNV-1a like the state of yulinker --incremental
+    for (char ch : contents) {
+        hash = (hash ^ (unsigned char) ch) * 0x100000001b3;
+    }
+
+    if (it == entries.end()) {
+        it = entries.insert({key, Entry()}).first;
+        misses++;
+    } else {
+        total_bytes -= it->second.contents.size();
+        if (it->second.hash == hash && it->second.contents.size() == contents.size()) {
+            revalidated++;
+        } else {
+            misses++;
+        }
+    }
+    Entry& entry = it->second;
+    entry.dev = st.st_dev;
+    entry.ino = st.st_ino;
+    entry.mtime_ns = mtime_ns;
+    entry.size = st.st_size;
+    entry.hash = hash;
+    entry.contents = std::move(contents);
+    entry.last_use = ++use_clock;
+    total_bytes += entry.contents.size();
+
+    evict(key);
+    return &entry.contents;
+}
+
+void FileCache::evict(const std::string& keep) {
+    while (total_bytes > max_bytes && entries.size() > 1) {
+        auto oldest = entries.end();
+        for (auto it = entries.begin(); it != entries.end(); ++it) {
+            if (it->first != keep && (oldest == entries.end() || it->second.last_use < oldest->second.last_use)) {
+                oldest = it;
+            }
+        }
+        total_bytes -= oldest->second.contents.size();
+        entries.erase(oldest);
+    }
+}
+
+StringViewBuffer::StringViewBuffer(const std::string& bytes) {
+    char* begin = const_cast<char*>(bytes.data()); // only read, there is no put area
+    setg(begin, begin, begin + bytes.size());
+}
+
+StringViewBuffer::pos_type StringViewBuffer::seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which) {
+    if (!(which & std::ios_base::in)) {
+        return pos_type(off_type(-1));
+    }
+    off_type base = (dir == std::ios_base::beg) ? 0 : (dir == std::ios_base::cur ? gptr() - eback() : egptr() - eback());
+    off_type pos = base + off;
+    if (pos < 0 || pos > egptr() - eback()) {
+        return pos_type(off_type(-1));
+    }
+    setg(eback(), eback() + pos, egptr());
+    return pos_type(pos);
+}
+
+StringViewBuffer::pos_type StringViewBuffer::seekpos(pos_type pos, std::ios_base::openmode which) {
+    return seekoff(off_type(pos), std::ios_base::beg, which);
+}
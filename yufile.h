@@ -0,0 +1,88 @@
+#ifndef YUFILE_H
+#define YUFILE_H
+
+#include <string>
+#include <memory>
+#include <unordered_map>
+#include <streambuf>
+#include <cstddef>
+#include <cstdint>
+
+// An output file whose size is known before it is written, shared by the assembler and the linker.
+// The contents go into a temporary file next to the final one, mapped into memory (or kept in a buffer
+// and written with a single pwrite if it can't be mapped), and commit() renames it into place. Anyone
+// reading the final path sees either the old file or the complete new one, never a half written file.
+class OutputFile {
+public:
+    OutputFile(std::string set_fpath, size_t set_size, bool set_sync = false);
+    ~OutputFile(); // removes the temporary file if commit wasn't reached
+    OutputFile(const OutputFile&) = delete;
+    OutputFile& operator=(const OutputFile&) = delete;
+
+    bool open();
+    unsigned char* data() { return mapped != nullptr ? mapped : buffer.get(); } // size() bytes, zeroed
+    size_t size() const { return file_size; }
+    bool commit(); // with sync, the file and its directory are flushed to disk before and after the rename
+    const std::string& error() const { return error_message; }
+
+    static bool sync_file(const std::string& fpath); // for files that are changed in place
+
+private:
+    std::string fpath;
+    std::string tmp_fpath;
+    size_t file_size;
+    bool sync;
+    int fd = -1;
+    unsigned char* mapped = nullptr;
+    std::unique_ptr<unsigned char[]> buffer; // if mapping failed
+    bool committed = false;
+    std::string error_message;
+
+    bool fail(const std::string& what);
+};
+
+// Contents of the files read by the assembler and the linker, kept in memory between the builds of yuasmd.
+// An entry is used as long as the inode, size and modification time of its file are the same. Otherwise
+// the file is read again, and if its hash didn't change, the entry is only revalidated.
+class FileCache {
+public:
+    explicit FileCache(size_t set_max_bytes = 256 << 20) : max_bytes(set_max_bytes) {}
+
+    // nullptr if the file can't be read, valid until the next read. cached is set if the file wasn't read.
+    const std::string* read(const std::string& fpath, bool* cached = nullptr);
+
+    size_t bytes() const { return total_bytes; }
+    long long hits = 0;
+    long long revalidated = 0; // read again but unchanged, for example after a touch
+    long long misses = 0;
+
+private:
+    struct Entry {
+        uint64_t dev;
+        uint64_t ino;
+        long long mtime_ns;
+        long long size;
+        uint64_t hash;
+        std::string contents;
+        uint64_t last_use;
+    };
+
+    size_t max_bytes; // the least recently used entries are dropped above this
+    size_t total_bytes = 0;
+    uint64_t use_clock = 0;
+    std::unordered_map<std::string, Entry> entries; // by absolute path
+
+    void evict(const std::string& keep);
+};
+
+// Reads a string that belongs to someone else as a stream, for the files that come from a FileCache
+class StringViewBuffer : public std::streambuf {
+public:
+    explicit StringViewBuffer(const std::string& bytes);
+
+protected:
+    pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which) override;
+    pos_type seekpos(pos_type pos, std::ios_base::openmode which) override;
+};
+
+#endif
@@ -1,27 +1,70 @@
 #include "yulinker.h"
+#include "yufile.h"
 #include <fstream>
 #include <iostream>
 #include <sstream>
 #include <iomanip>
 #include <cstdint>
 #include <filesystem>
+#include <set>
+#include <algorithm>
+#include <cstring>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 using uint32_t = std::uint32_t;
 
-Linker::Linker(std::vector<std::string> set_fpaths, bool set_standalone_mode) : standalone_mode(set_standalone_mode) {
+Linker::Linker(std::vector<std::string> set_fpaths, bool set_standalone_mode, LinkerOptions set_options) : standalone_mode(set_standalone_mode), options(set_options) {
     fpaths = set_fpaths;
     int no_of_files = fpaths.size();
     defs.resize(no_of_files);
     callers.resize(no_of_files);
-    create_out_dir_safely();
-    link();
+    data_defs.resize(no_of_files);
+    locals.resize(no_of_files);
+    create_out_dir_safely(output_path());
+    link_ok = link();
 }
 
 bool Linker::link() {
+    if (options.incremental) {
+        bool linked = false;
+        if (!relink(&linked)) {
+            return false;
+        }
+        if (linked) {
+            return true;
+        }
+        clear_objects(); // relink loaded the symbols of the last link
+    }
+
     if (!save_defs_and_callers_and_instrs()) {
         return false;
     }
 
+    if (options.relocatable) {
+        if (!resolve_internal_references() || !write_relocatable_object()) {
+            return false;
+        }
+        std::cout << "Created relocatable object " << output_path() << "\n";
+        return true;
+    }
+
+    if (options.inline_budget > 0 || !options.profile_fpath.empty()) {
+        lift_local_branches();
+    }
+
+    if (options.inline_budget > 0 && !inline_leaf_sections()) {
+        return false;
+    }
+
+    if (!options.profile_fpath.empty() && !order_sections()) {
+        return false;
+    }
+
     if (!place_symbols()) {
         return false;
     }
@@ -30,347 +73,1486 @@ bool Linker::link() {
         return false;
     }
 
+    if (options.incremental && !write_link_state(data.size(), {})) {
+        return false;
+    }
+
     std::cout << "Created program binary\n";
     return true;
 }
 
-bool Linker::save_defs_and_callers_and_instrs() {
-    for (int i=0; i<fpaths.size(); i++) {
-        std::string fpath = fpaths[i];
+// --incremental: the program of the last link is patched if only objects changed that kept the size of
+// their code and data. Their code and data are written over the old ones and their callers are placed
+// again, and so are the callers in the other objects that use a symbol whose definition changed. Only
+// the symbols of the unchanged objects that are needed for that are looked up in the state.
+bool Linker::relink(bool* linked) {
+    *linked = false;
+
+    LinkState state;
+    std::vector<int> changed;
+    bool touched = false; // an object was written again without changing, the state needs its new mtime
+    {
+        Stats::Timer timer(options.stats, Stats::OBJECT_READING);
+
+        std::string reason;
+        if (!read_link_state(&state)) {
+            reason = "there is no state of an earlier link";
+        } else if (state.objects.size() != fpaths.size()) {
+            reason = "the object files aren't the same";
+        } else if (state.data_base_option != options.data_base) {
+            reason = "--data-base changed";
+        } else if (!std::filesystem::exists(output_path()) || std::filesystem::file_size(output_path()) != state.bin_size
+                   || mtime_of(output_path()) != state.bin_mtime) {
+            reason = output_path() + " was changed since the last link";
+        }
+        for (int filei=0; filei<fpaths.size() && reason.empty(); filei++) {
+            const LinkState::Object& object = state.objects[filei];
+            if (object.fpath != fpaths[filei] || !std::filesystem::exists(fpaths[filei])) {
+                reason = "the object files aren't the same";
+                break;
+            }
+            // the hash is only needed if the file was written since the last link
+            object_hashes.push_back(object.hash);
+            if (mtime_of(fpaths[filei]) != object.mtime || std::filesystem::file_size(fpaths[filei]) != object.size) {
+                object_hashes[filei] = hash_file(fpaths[filei]);
+                touched = true;
+                if (object_hashes[filei] != object.hash) {
+                    changed.push_back(filei);
+                }
+            }
+        }
+        if (!reason.empty()) {
+            std::cout << "Linking everything, " << reason << "\n";
+            object_hashes.clear();
+            return true;
+        }
+    }
 
-        // Run through file
+    std::vector<std::string_view> old_blocks;
+    for (const LinkState::Object& object : state.objects) {
+        old_blocks.push_back(std::string_view(state.text).substr(object.block_begin, object.block_size));
+    }
 
-        std::ifstream file(fpath, std::ios::binary);
+    if (changed.empty()) {
+        if (touched && !write_link_state(state.data_end(), old_blocks)) {
+            return false;
+        }
+        std::cout << output_path() << " is up to date\n";
+        *linked = true;
+        return true;
+    }
 
-        // Step 0: get N_defs (32 bits)
+    // Read the changed objects one by one, read_object appends to instrs and data. A symbol whose
+    // definition was added, removed or moved may resolve somewhere else now.
+    std::map<int, std::pair<std::vector<uint32_t>, std::vector<unsigned char>>> new_code;
+    std::set<std::string> moved_symbols;
+    std::set<std::string> moved_data;
+    {
+        Stats::Timer timer(options.stats, Stats::OBJECT_READING);
+
+        std::vector<int> saved_instr_count = instr_count;
+        std::vector<int> saved_data_begin = data_begin;
+        for (int filei : changed) {
+            const LinkState::Object& object = state.objects[filei];
+            std::set<std::pair<std::string, int>> old_defs;
+            std::set<std::pair<std::string, int>> old_data_defs;
+            std::string_view kind;
+            std::string_view name;
+            int loc = 0;
+            for (size_t pos = 0; next_state_entry(old_blocks[filei], &pos, &kind, &name, &loc);) {
+                if (kind == "def") {
+                    old_defs.insert({std::string(name), loc});
+                } else if (kind == "data_def") {
+                    old_data_defs.insert({std::string(name), loc});
+                }
+            }
 
-        unsigned int N_defs = 0;
-        char N_defs_char[4] = {'0'};
-        file.get(N_defs_char[3]);
-        file.get(N_defs_char[2]);
-        file.get(N_defs_char[1]);
-        file.get(N_defs_char[0]);
+            instrs.clear();
+            data.clear();
+            instr_count.clear();
+            data_begin.clear();
+            if (!read_object(filei)) {
+                return false;
+            }
+            if (instrs.size() * 4 != object.code_size || data.size() != object.data_size) {
+                std::cout << "Linking everything, the size of " << fpaths[filei] << " changed\n";
+                return true;
+            }
+            new_code[filei] = {instrs, data};
+
+            std::set<std::pair<std::string, int>> new_defs(defs[filei].begin(), defs[filei].end());
+            std::set<std::pair<std::string, int>> new_data_defs(data_defs[filei].begin(), data_defs[filei].end());
+            std::vector<std::pair<std::string, int>> difference;
+            std::set_symmetric_difference(old_defs.begin(), old_defs.end(), new_defs.begin(), new_defs.end(), std::back_inserter(difference));
+            for (const std::pair<std::string, int>& def : difference) {
+                moved_symbols.insert(def.first);
+            }
+            difference.clear();
+            std::set_symmetric_difference(old_data_defs.begin(), old_data_defs.end(), new_data_defs.begin(), new_data_defs.end(), std::back_inserter(difference));
+            for (const std::pair<std::string, int>& def : difference) {
+                moved_data.insert(def.first);
+            }
+        }
+        instrs.clear();
+        data.clear();
+        instr_count = saved_instr_count;
+        data_begin = saved_data_begin;
+    }
 
-        N_defs += ((unsigned char) N_defs_char[0]);
-        N_defs += ((unsigned char) N_defs_char[1]) << 8;
-        N_defs += ((unsigned char) N_defs_char[2]) << 16;
-        N_defs += ((unsigned char) N_defs_char[3]) << 24;
+    // Index only the symbols that are needed, the first definition in link order wins as usual
+    std::vector<std::pair<int, std::pair<std::string, int>>> moved_callers; // file -> symbol, loc in the file
+    {
+        Stats::Timer timer(options.stats, Stats::SYMBOL_RESOLUTION);
+
+        std::set<std::string> needed_symbols = moved_symbols;
+        std::set<std::string> needed_data = moved_data;
+        for (int filei : changed) {
+            for (std::multimap<std::string, int>::iterator it = callers[filei].begin(); it != callers[filei].end(); ++it) {
+                needed_symbols.insert(it->first); // a caller can be a branch or a data reference
+                needed_data.insert(it->first);
+            }
+        }
 
-        if (DEBUG_LEVEL >= 12) {
-            std::cout << "N_defs for " << fpath << ": " << N_defs << "\n";
+        std::vector<bool> needed_length(MAX_NAME_LENGTH + 1, false);
+        for (const std::set<std::string>* names : {&needed_symbols, &needed_data}) {
+            for (const std::string& name : *names) {
+                needed_length[std::min<size_t>(name.size(), MAX_NAME_LENGTH)] = true;
+            }
         }
 
-        // Step 1: run through the definitions
+        symbol_index.clear();
+        data_index.clear();
+        for (int filei=0; filei<fpaths.size(); filei++) {
+            const LinkState::Object& object = state.objects[filei];
+            if (new_code.count(filei) > 0) {
+                for (std::multimap<std::string, int>::iterator it = defs[filei].begin(); it != defs[filei].end(); ++it) {
+                    if (needed_symbols.count(it->first) > 0) {
+                        symbol_index.insert({it->first, object.code_begin + it->second});
+                    }
+                }
+                for (std::multimap<std::string, int>::iterator it = data_defs[filei].begin(); it != data_defs[filei].end(); ++it) {
+                    if (needed_data.count(it->first) > 0) {
+                        data_index.insert({it->first, object.data_begin + it->second});
+                    }
+                }
+                continue;
+            }
 
-        for (int defi=0; defi<N_defs; defi++) {
-            // Step 1.1: get length of the symbol name (16 bits)
+            std::string_view kind;
+            std::string_view name;
+            int loc = 0;
+            std::string name_string;
+            for (size_t pos = 0; next_state_entry(old_blocks[filei], &pos, &kind, &name, &loc);) {
+                if (!needed_length[std::min<size_t>(name.size(), MAX_NAME_LENGTH)]) {
+                    continue; // most lines are thrown out here without a lookup
+                }
+                name_string.assign(name);
+                if (kind == "def" && needed_symbols.count(name_string) > 0) {
+                    symbol_index.insert({name_string, object.code_begin + loc});
+                } else if (kind == "data_def" && needed_data.count(name_string) > 0) {
+                    data_index.insert({name_string, object.data_begin + loc});
+                } else if (kind == "call" && (moved_symbols.count(name_string) > 0 || moved_data.count(name_string) > 0)) {
+                    moved_callers.push_back({filei, {name_string, loc}});
+                }
+            }
+        }
+    }
 
-            unsigned int len = 0;
-            char len_char[2] = {'0'};
-            file.get(len_char[1]);
-            file.get(len_char[0]);
+    data_base = state.data_base;
 
-            len += ((unsigned char) len_char[0]);
-            len += ((unsigned char) len_char[1]) << 8;
+    // If anything goes wrong from here on the program is half patched, without a state the next link is a full one
+    std::filesystem::remove(output_path() + ".state");
+    std::fstream bin_file(output_path(), std::ios::binary | std::ios::in | std::ios::out);
+    if (!bin_file) {
+        std::cerr << "Error: could not open " << output_path() << " for writing\n";
+        return false;
+    }
 
-            if (DEBUG_LEVEL >= 12) {
-                std::cout << "* len for " << fpath << " symbol no " << defi << ": " << len << "\n";
+    for (std::map<int, std::pair<std::vector<uint32_t>, std::vector<unsigned char>>>::iterator code = new_code.begin(); code != new_code.end(); ++code) {
+        const LinkState::Object& object = state.objects[code->first];
+        std::vector<uint32_t>& words = code->second.first;
+        std::vector<unsigned char>& object_data = code->second.second;
+        {
+            Stats::Timer timer(options.stats, Stats::RELOCATION);
+            for (std::multimap<std::string, int>::iterator it = callers[code->first].begin(); it != callers[code->first].end(); ++it) {
+                if (!relocate(it->first, object.code_begin + it->second, &words[it->second / 4])) {
+                    return false;
+                }
             }
-            // Step 1.2: get symbol name
+        }
 
-            std::vector<char> symbol_name_chars;
-            for (int symi=0; symi<len; symi++) {
-                char cur_char = '0';
-                file.get(cur_char);
-                symbol_name_chars.push_back(cur_char);
+        Stats::Timer timer(options.stats, Stats::BINARY_WRITING);
+        swap_byte_order(words.data(), words.size(), words.data());
+        bin_file.seekp(object.code_begin);
+        bin_file.write(reinterpret_cast<const char*>(words.data()), words.size() * 4);
+        bin_file.seekp(data_base + object.data_begin);
+        bin_file.write(reinterpret_cast<const char*>(object_data.data()), object_data.size());
+    }
 
-                if (DEBUG_LEVEL >= 12) {
-                    std::cout << "symbol current char: " << cur_char  << "(" << (int) cur_char << ")" << "\n";
-                }
+    // The callers in the unchanged objects are patched in the program itself
+    {
+        Stats::Timer timer(options.stats, Stats::RELOCATION);
+        for (const std::pair<int, std::pair<std::string, int>>& caller : moved_callers) {
+            int caller_abs_loc = state.objects[caller.first].code_begin + caller.second.second;
+            uint32_t word = 0;
+            bin_file.seekg(caller_abs_loc);
+            bin_file.read(reinterpret_cast<char*>(&word), 4);
+            swap_byte_order(&word, 1, &word);
+            if (!relocate(caller.second.first, caller_abs_loc, &word)) {
+                return false;
             }
-            std::string symbol_name(symbol_name_chars.data(), symbol_name_chars.size());
+            swap_byte_order(&word, 1, &word);
+            bin_file.seekp(caller_abs_loc);
+            bin_file.write(reinterpret_cast<const char*>(&word), 4);
+        }
+    }
 
-            if (DEBUG_LEVEL >= 12) {
-                std::cout << "+ symbol name: " << symbol_name << "\n";
+    bin_file.close();
+    if (!bin_file || (options.sync_output && !OutputFile::sync_file(output_path()))) {
+        std::cerr << "Error: could not write " << output_path() << "\n";
+        return false;
+    }
+
+    for (int filei : changed) {
+        old_blocks[filei] = std::string_view(); // written from the new symbols
+    }
+    if (!write_link_state(state.data_end(), old_blocks)) {
+        return false;
+    }
+
+    if (options.stats != nullptr) {
+        options.stats->count("link.incremental_objects", changed.size());
+        options.stats->count("link.incremental_relocations", moved_callers.size());
+    }
+    std::cout << "Relinked " << changed.size() << " of " << fpaths.size() << " object(s) into " << output_path() << ", "
+              << moved_callers.size() << " caller(s) in other objects placed again\n";
+    *linked = true;
+    return true;
+}
+
+// The state is a text file with a header and then every object followed by a block with its symbols and callers:
+//   yulinker-state 2
+//   data_base <option> <address>
+//   bin <size> <mtime>
+//   object <hash> <mtime> <file size> <code begin> <code size> <data begin> <data size> <block size> <path>
+//   def <name> <loc>, data_def <name> <offset> and call <name> <loc> lines, <block size> bytes
+// The blocks are only parsed where they are needed, and copied as they are for the objects that didn't change.
+bool Linker::read_link_state(LinkState* state) {
+    std::string fpath = output_path() + ".state";
+    std::ifstream file(fpath, std::ios::binary);
+    if (!file) {
+        return false;
+    }
+    state->text.resize(std::filesystem::file_size(fpath));
+    file.read(&state->text[0], state->text.size());
+
+    std::istringstream header(state->text);
+    std::string line;
+    std::string key;
+    if (!std::getline(header, line) || line != "yulinker-state 2") {
+        return false;
+    }
+    if (!(header >> key >> state->data_base_option >> state->data_base) || key != "data_base") {
+        return false;
+    }
+    if (!(header >> key >> state->bin_size >> state->bin_mtime) || key != "bin") {
+        return false;
+    }
+    header.get();
+
+    size_t pos = header.tellg();
+    while (pos < state->text.size()) {
+        size_t end = state->text.find('\n', pos);
+        if (end == std::string::npos) {
+            return false;
+        }
+        std::istringstream fields(state->text.substr(pos, end - pos));
+        LinkState::Object object;
+        if (!(fields >> key >> std::hex >> object.hash >> std::dec >> object.mtime >> object.size >> object.code_begin >> object.code_size
+                     >> object.data_begin >> object.data_size >> object.block_size) || key != "object" || fields.get() != ' ') {
+            return false;
+        }
+        std::getline(fields, object.fpath); // can contain spaces
+        object.block_begin = end + 1;
+        pos = object.block_begin + object.block_size;
+        if (pos > state->text.size() || state->objects.size() >= fpaths.size()) {
+            return false;
+        }
+        state->objects.push_back(object);
+        instr_count.push_back(object.code_size / 4);
+        data_begin.push_back(object.data_begin);
+    }
+    return true;
+}
+
+bool Linker::write_link_state(int data_end, const std::vector<std::string_view>& old_blocks) {
+    if (object_hashes.size() != fpaths.size()) {
+        object_hashes.clear();
+        for (const std::string& fpath : fpaths) {
+            object_hashes.push_back(hash_file(fpath));
+        }
+    }
+
+    std::string text;
+    text += "yulinker-state 2\n";
+    text += "data_base " + std::to_string(options.data_base) + " " + std::to_string(data_base) + "\n";
+    text += "bin " + std::to_string(std::filesystem::file_size(output_path())) + " " + std::to_string(mtime_of(output_path())) + "\n";
+
+    int code_begin = 0;
+    std::string block;
+    for (int filei=0; filei<fpaths.size(); filei++) {
+        block.clear();
+        if (filei < old_blocks.size() && !old_blocks[filei].empty()) {
+            block.assign(old_blocks[filei]);
+        } else {
+            for (std::multimap<std::string, int>::iterator it = defs[filei].begin(); it != defs[filei].end(); ++it) {
+                block += "def " + it->first + " " + std::to_string(it->second) + "\n";
+            }
+            for (std::multimap<std::string, int>::iterator it = data_defs[filei].begin(); it != data_defs[filei].end(); ++it) {
+                block += "data_def " + it->first + " " + std::to_string(it->second) + "\n";
+            }
+            for (std::multimap<std::string, int>::iterator it = callers[filei].begin(); it != callers[filei].end(); ++it) {
+                block += "call " + it->first + " " + std::to_string(it->second) + "\n";
             }
+        }
 
-            // Step 1.3: get symbol address (32 bits)
+        std::ostringstream object;
+        int data_size = ((filei + 1 < data_begin.size()) ? data_begin[filei + 1] : data_end) - data_begin[filei];
+        object << "object " << std::hex << object_hashes[filei] << std::dec << " " << mtime_of(fpaths[filei]) << " "
+               << std::filesystem::file_size(fpaths[filei]) << " " << code_begin << " " << instr_count[filei] * 4 << " "
+               << data_begin[filei] << " " << data_size << " " << block.size() << " " << fpaths[filei] << "\n";
+        text += object.str();
+        text += block;
+        code_begin += instr_count[filei] * 4;
+    }
 
-            unsigned int loc = 0;
-            char loc_char[4] = {'0'};
-            file.get(loc_char[3]);
-            file.get(loc_char[2]);
-            file.get(loc_char[1]);
-            file.get(loc_char[0]);
+    OutputFile file(output_path() + ".state", text.size(), options.sync_output);
+    if (!file.open()) {
+        std::cerr << "Error: " << file.error() << "\n";
+        return false;
+    }
+    std::copy(text.begin(), text.end(), file.data());
+    if (!file.commit()) {
+        std::cerr << "Error: " << file.error() << "\n";
+        return false;
+    }
+    return true;
+}
+
+void Linker::clear_objects() {
+    for (int filei=0; filei<fpaths.size(); filei++) {
+        defs[filei].clear();
+        callers[filei].clear();
+        data_defs[filei].clear();
+        locals[filei].clear();
+    }
+    instr_count.clear();
+    instrs.clear();
+    data_begin.clear();
+    data.clear();
+}
+
+bool Linker::save_defs_and_callers_and_instrs() {
+    Stats::Timer timer(options.stats, Stats::OBJECT_READING);
+
+    for (int i=0; i<fpaths.size(); i++) {
+        if (!read_object(i)) {
+            return false;
+        }
+    }
+
+    if (DEBUG_LEVEL >= 11) {
+        std::cout << "defs\n";
+        print_vmsi(defs);
+        std::cout << "\ncallers\n";
+        print_vmsi(callers);
+        std::cout << "\ninstrs\n";
+        print_words(instrs);
+    }
+
+    return true;
+}
+
+// Appends the instructions and data of object i and saves its symbols and branches
+bool Linker::read_object(int i) {
+    const std::string& fpath = fpaths[i];
+
+    // Run through file, from memory if yuasmd keeps the objects
+
+    std::ifstream disk_file;
+    std::unique_ptr<StringViewBuffer> cached_file;
+    const std::string* cached_bytes = nullptr;
+    std::istream file(nullptr);
+    if (options.file_cache != nullptr) {
+        bool cached = false;
+        cached_bytes = options.file_cache->read(fpath, &cached);
+        if (cached_bytes == nullptr) {
+            std::cerr << "Error: could not read object file " << fpath << "\n";
+            return false;
+        }
+        cached_file = std::make_unique<StringViewBuffer>(*cached_bytes);
+        file.rdbuf(cached_file.get());
+        if (options.stats != nullptr && cached) {
+            options.stats->count("link.cached_objects");
+        }
+    } else {
+        disk_file.open(fpath, std::ios::binary);
+        file.rdbuf(disk_file.rdbuf());
+    }
+
+    // Step 0: get N_defs (32 bits)
+
+    unsigned int N_defs = 0;
+    char N_defs_char[4] = {'0'};
+    file.get(N_defs_char[3]);
+    file.get(N_defs_char[2]);
+    file.get(N_defs_char[1]);
+    file.get(N_defs_char[0]);
+
+    N_defs += ((unsigned char) N_defs_char[0]);
+    N_defs += ((unsigned char) N_defs_char[1]) << 8;
+    N_defs += ((unsigned char) N_defs_char[2]) << 16;
+    N_defs += ((unsigned char) N_defs_char[3]) << 24;
+
+    if (DEBUG_LEVEL >= 12) {
+        std::cout << "N_defs for " << fpath << ": " << N_defs << "\n";
+    }
+
+    // Step 1: run through the definitions
 
-            loc += ((unsigned char) loc_char[0]);
-            loc += ((unsigned char) loc_char[1]) << 8;
-            loc += ((unsigned char) loc_char[2]) << 16;
-            loc += ((unsigned char) loc_char[3]) << 24;
+    for (int defi=0; defi<N_defs; defi++) {
+        // Step 1.1: get length of the symbol name (16 bits)
+
+        unsigned int len = 0;
+        char len_char[2] = {'0'};
+        file.get(len_char[1]);
+        file.get(len_char[0]);
+
+        len += ((unsigned char) len_char[0]);
+        len += ((unsigned char) len_char[1]) << 8;
+
+        if (DEBUG_LEVEL >= 12) {
+            std::cout << "* len for " << fpath << " symbol no " << defi << ": " << len << "\n";
+        }
+        // Step 1.2: get symbol name
+
+        std::vector<char> symbol_name_chars;
+        for (int symi=0; symi<len; symi++) {
+            char cur_char = '0';
+            file.get(cur_char);
+            symbol_name_chars.push_back(cur_char);
 
             if (DEBUG_LEVEL >= 12) {
-                std::cout << "+ symbol address: " << loc << "\n";
+                std::cout << "symbol current char: " << cur_char  << "(" << (int) cur_char << ")" << "\n";
             }
+        }
+        std::string symbol_name(symbol_name_chars.data(), symbol_name_chars.size());
 
-            // Step 1.4: save symbol name and address to map
-
-            defs[i].insert({symbol_name, loc});
+        if (DEBUG_LEVEL >= 12) {
+            std::cout << "+ symbol name: " << symbol_name << "\n";
         }
 
-        // Step 2: get N_callers (32 bits)
+        // Step 1.3: get symbol address (32 bits)
 
-        unsigned int N_callers = 0;
-        char N_callers_char[4] = {'0'};
-        file.get(N_callers_char[3]);
-        file.get(N_callers_char[2]);
-        file.get(N_callers_char[1]);
-        file.get(N_callers_char[0]);
+        unsigned int loc = 0;
+        char loc_char[4] = {'0'};
+        file.get(loc_char[3]);
+        file.get(loc_char[2]);
+        file.get(loc_char[1]);
+        file.get(loc_char[0]);
 
-        N_callers += ((unsigned char) N_callers_char[0]);
-        N_callers += ((unsigned char) N_callers_char[1]) << 8;
-        N_callers += ((unsigned char) N_callers_char[2]) << 16;
-        N_callers += ((unsigned char) N_callers_char[3]) << 24;
+        loc += ((unsigned char) loc_char[0]);
+        loc += ((unsigned char) loc_char[1]) << 8;
+        loc += ((unsigned char) loc_char[2]) << 16;
+        loc += ((unsigned char) loc_char[3]) << 24;
 
         if (DEBUG_LEVEL >= 12) {
-            std::cout << "N_callers for " << fpath << ": " << N_callers << "\n";
+            std::cout << "+ symbol address: " << loc << "\n";
         }
-        // Step 3: run through the callers
 
-        for (int calleri=0; calleri<N_callers; calleri++) {
-            // Step 3.1: get length of the symbol name (16 bits)
+        // Step 1.4: save symbol name and address to map
 
-            unsigned int len = 0;
-            char len_char[2] = {'0'};
-            file.get(len_char[1]);
-            file.get(len_char[0]);
+        defs[i].insert({symbol_name, loc});
+    }
 
-            len += ((unsigned char) len_char[0]);
-            len += ((unsigned char) len_char[1]) << 8;
+    // Step 2: get N_callers (32 bits)
 
-            if (DEBUG_LEVEL >= 12) {
-                std::cout << "* len for " << fpath << " symbol no " << calleri << ": " << len << "\n";
-            }
+    unsigned int N_callers = 0;
+    char N_callers_char[4] = {'0'};
+    file.get(N_callers_char[3]);
+    file.get(N_callers_char[2]);
+    file.get(N_callers_char[1]);
+    file.get(N_callers_char[0]);
 
-            // Step 3.2: get symbol name
+    N_callers += ((unsigned char) N_callers_char[0]);
+    N_callers += ((unsigned char) N_callers_char[1]) << 8;
+    N_callers += ((unsigned char) N_callers_char[2]) << 16;
+    N_callers += ((unsigned char) N_callers_char[3]) << 24;
 
-            std::vector<char> symbol_name_chars;
-            for (int symi=0; symi<len; symi++) {
-                char cur_char = '0';
-                file.get(cur_char);
-                symbol_name_chars.push_back(cur_char);
+    if (DEBUG_LEVEL >= 12) {
+        std::cout << "N_callers for " << fpath << ": " << N_callers << "\n";
+    }
+    // Step 3: run through the callers
 
-                if (DEBUG_LEVEL >= 12) {
-                    std::cout << "symbol current char: " << cur_char  << "(" << (int) cur_char << ")" << "\n";
-                }
-            }
-            std::string symbol_name(symbol_name_chars.data(), symbol_name_chars.size());
+    for (int calleri=0; calleri<N_callers; calleri++) {
+        // Step 3.1: get length of the symbol name (16 bits)
 
-            if (DEBUG_LEVEL >= 12) {
-                std::cout << "+ symbol name: " << symbol_name << "\n";
-            }
+        unsigned int len = 0;
+        char len_char[2] = {'0'};
+        file.get(len_char[1]);
+        file.get(len_char[0]);
 
-            // Step 3.3: get caller address (32 bits)
+        len += ((unsigned char) len_char[0]);
+        len += ((unsigned char) len_char[1]) << 8;
+
+        if (DEBUG_LEVEL >= 12) {
+            std::cout << "* len for " << fpath << " symbol no " << calleri << ": " << len << "\n";
+        }
 
-            unsigned int loc = 0;
-            char loc_char[4] = {'0'};
-            file.get(loc_char[3]);
-            file.get(loc_char[2]);
-            file.get(loc_char[1]);
-            file.get(loc_char[0]);
+        // Step 3.2: get symbol name
 
-            loc += ((unsigned char) loc_char[0]);
-            loc += ((unsigned char) loc_char[1]) << 8;
-            loc += ((unsigned char) loc_char[2]) << 16;
-            loc += ((unsigned char) loc_char[3]) << 24;
+        std::vector<char> symbol_name_chars;
+        for (int symi=0; symi<len; symi++) {
+            char cur_char = '0';
+            file.get(cur_char);
+            symbol_name_chars.push_back(cur_char);
 
             if (DEBUG_LEVEL >= 12) {
-                std::cout << "+ caller address: " << loc << "\n";
+                std::cout << "symbol current char: " << cur_char  << "(" << (int) cur_char << ")" << "\n";
             }
+        }
+        std::string symbol_name(symbol_name_chars.data(), symbol_name_chars.size());
+
+        if (DEBUG_LEVEL >= 12) {
+            std::cout << "+ symbol name: " << symbol_name << "\n";
+        }
+
+        // Step 3.3: get caller address (32 bits)
+
+        unsigned int loc = 0;
+        char loc_char[4] = {'0'};
+        file.get(loc_char[3]);
+        file.get(loc_char[2]);
+        file.get(loc_char[1]);
+        file.get(loc_char[0]);
+
+        loc += ((unsigned char) loc_char[0]);
+        loc += ((unsigned char) loc_char[1]) << 8;
+        loc += ((unsigned char) loc_char[2]) << 16;
+        loc += ((unsigned char) loc_char[3]) << 24;
+
+        if (DEBUG_LEVEL >= 12) {
+            std::cout << "+ caller address: " << loc << "\n";
+        }
+
+        // Step 3.4: save symbol name and address to map
+
+        callers[i].insert({symbol_name, loc});
+    }
+
+    // Step 4: get the data labels and the data
+
+    unsigned int N_data_defs = read_u32(file);
+    for (int datai=0; datai<N_data_defs && file; datai++) {
+        unsigned int len = ((unsigned char) file.get()) << 8;
+        len += (unsigned char) file.get();
+        std::string symbol_name(len, '\0');
+        file.read(&symbol_name[0], len);
+        data_defs[i].insert({symbol_name, (int) read_u32(file)});
+    }
+
+    unsigned int data_size = read_u32(file);
+    data_begin.push_back(data.size());
+    data.resize(data.size() + data_size);
+    file.read(reinterpret_cast<char*>(data.data() + data_begin.back()), data_size);
+    if (!file || data_size % 4 != 0) {
+        std::cerr << "Error: object file " << fpath << " has truncated or misaligned data\n";
+        return false;
+    }
+
+    if (DEBUG_LEVEL >= 12) {
+        std::cout << "N_data_defs for " << fpath << ": " << N_data_defs << ", data size: " << data_size << "\n";
+    }
+
+    // Step 5: get the branches the assembler already patched
+
+    unsigned int N_locals = read_u32(file);
+    for (int locali=0; locali<N_locals && file; locali++) {
+        int loc = read_u32(file);
+        locals[i].push_back({loc, (int) read_u32(file)});
+    }
+    if (!file) {
+        std::cerr << "Error: object file " << fpath << " is truncated\n";
+        return false;
+    }
+    if (options.stats != nullptr) {
+        options.stats->count("link.local_branches", N_locals);
+    }
 
-            // Step 3.4: save symbol name and address to map
+    // Step 6: save instructions to instrs vector, the rest of the file is read in one go
 
-            callers[i].insert({symbol_name, loc});
+    uintmax_t file_size = (cached_bytes != nullptr) ? cached_bytes->size() : std::filesystem::file_size(fpath);
+    uintmax_t count_bytes = file_size - (uintmax_t) file.tellg();
+    if (count_bytes % 4 != 0) {
+        std::cerr << "Error: object file misalignment\n";
+        return false;
+    }
+
+    int count = count_bytes / 4;
+    size_t first = instrs.size();
+    instrs.resize(first + count);
+    file.read(reinterpret_cast<char*>(instrs.data() + first), count_bytes);
+    if (!file) {
+        std::cerr << "Error: object file " << fpath << " is truncated\n";
+        return false;
+    }
+    swap_byte_order(instrs.data() + first, count, instrs.data() + first);
+
+    if (DEBUG_LEVEL >= 13) {
+        for (int k=0; k<count; k++) {
+            std::cout << std::hex << std::setw(8) << std::setfill('0') << instrs[first + k] << std::dec << "\n";
         }
+    }
 
-        // Step 4: save instructions to instrs vector
+    if (options.stats != nullptr) {
+        options.stats->count("link.bytes_in", file_size);
+    }
+
+    instr_count.push_back(count);
+    return true;
+}
 
-        int count_bytes = 0;
-        char byte;
-        while (file.get(byte)) {
-            instrs.push_back((unsigned char) byte);
-            count_bytes++;
 
-            std::stringstream ss;
-            ss << std::hex << std::setw(2) << std::setfill('0') << (unsigned int) (unsigned char) byte;
-            
-            if (DEBUG_LEVEL >= 13) {
-                std::cout << ss.str() << "\n";
+// Inlining and section ordering move code, so they need every branch as a caller. The branches the
+// assembler resolved get the name of a section at their target that relocation resolves to the same
+// place, or a name of their own if all of those are shadowed by a section in an earlier object.
+void Linker::lift_local_branches() {
+    index_symbols();
+
+    int begin = 0;
+    for (int filei=0; filei<locals.size(); filei++) {
+        std::map<int, std::string> name_at;
+        for (std::multimap<std::string, int>::iterator it = defs[filei].begin(); it != defs[filei].end(); ++it) {
+            if (symbol_index[it->first] == begin * 4 + it->second) {
+                name_at.insert({it->second, it->first});
             }
         }
 
-        file.close();
+        for (const std::pair<int, int>& local : locals[filei]) {
+            std::map<int, std::string>::iterator it = name_at.find(local.second);
+            if (it == name_at.end()) {
+                std::string name = "@" + std::to_string(filei) + "." + std::to_string(local.second); // can't be a section name
+                defs[filei].insert({name, local.second});
+                it = name_at.insert({local.second, name}).first;
+            }
+            callers[filei].insert({it->second, local.first});
 
-        if (count_bytes % 4 != 0) {
-            std::cerr << "Error: object file misalignment\n";
-            return false;
+            // place_symbols expects the distance to be zero, jumpif and brif keep rcond in the low half of the last byte
+            uint32_t& word = instrs[begin + local.first / 4];
+            uint32_t op = word >> 24;
+            word &= (op == 0x22 || op == 0x27) ? 0xFF00000F : 0xFF000000;
         }
+        locals[filei].clear();
+        begin += instr_count[filei];
+    }
+}
 
-        int count = count_bytes / 4;
+// The section at the target of a resolved branch has no name in the object, so it's shown as the object file
+// and the offset of the target in it
+std::string Linker::display_name(const std::string& name) {
+    if (name.empty() || name[0] != '@') {
+        return name;
+    }
+    size_t dot = name.find('.');
+    int filei = std::stoi(name.substr(1, dot - 1));
+    return fpaths[filei] + "+" + name.substr(dot + 1);
+}
 
-        instr_count.push_back(count);
+// Replaces br X with the body of X when X is a section of at most inline_budget instructions that runs
+// straight into a ret, also across objects. X itself stays where it is. The code after an inlined call
+// moves, so this is only done if every jump distance in the program is one the linker patches.
+bool Linker::inline_leaf_sections() {
+    Stats::Timer timer(options.stats, Stats::RELOCATION);
+
+    std::vector<int> file_begin = {0}; // index of the first instruction of each file
+    for (int filei=0; filei<instr_count.size(); filei++) {
+        file_begin.push_back(file_begin.back() + instr_count[filei]);
     }
 
-    if (DEBUG_LEVEL >= 11) {
-        std::cout << "defs\n";
-        print_vmsi(defs);
-        std::cout << "\ncallers\n";
-        print_vmsi(callers);
-        std::cout << "\ninstrs\n";
-        print_vuc(instrs);
+    int unpatched = find_unpatched_distance();
+    if (unpatched >= 0) {
+        std::cout << "Not inlining: " << fpaths[unpatched] << " has a jump distance that isn't a symbol\n";
+        return true;
+    }
+
+    std::vector<std::map<int, std::string>> caller_at(callers.size()); // per file: instruction index -> symbol
+    for (int filei=0; filei<callers.size(); filei++) {
+        for (std::map<std::string, int>::iterator it = callers[filei].begin(); it != callers[filei].end(); ++it) {
+            caller_at[filei][it->second / 4] = it->first;
+        }
+    }
+
+    // The first definition of a name is the one place_symbols uses
+    std::map<std::string, std::vector<uint32_t>> leaves;
+    std::set<std::string> seen;
+    for (int filei=0; filei<defs.size(); filei++) {
+        for (std::map<std::string, int>::iterator it = defs[filei].begin(); it != defs[filei].end(); ++it) {
+            if (!seen.insert(it->first).second) {
+                continue;
+            }
+            std::vector<uint32_t> body;
+            for (int k=it->second / 4; k<instr_count[filei] && (int) body.size() <= options.inline_budget; k++) {
+                uint32_t word = instrs[file_begin[filei] + k];
+                uint32_t op = word >> 24;
+                if (op == 0x24) {
+                    leaves[it->first] = body;
+                    break;
+                }
+                if ((op >= 0x20 && op <= 0x27) || caller_at[filei].count(k) > 0) {
+                    break; // a data reference would need a relocation of its own
+                }
+                body.push_back(word);
+            }
+        }
     }
 
+    std::vector<uint32_t> new_instrs;
+    new_instrs.reserve(instrs.size());
+    for (int filei=0; filei<instr_count.size(); filei++) {
+        std::vector<int> new_index(instr_count[filei] + 1); // file local
+        std::set<int> inlined;
+        int file_start = new_instrs.size();
+
+        for (int k=0; k<instr_count[filei]; k++) {
+            uint32_t word = instrs[file_begin[filei] + k];
+            new_index[k] = new_instrs.size() - file_start;
+
+            std::map<int, std::string>::iterator caller = caller_at[filei].find(k);
+            std::map<std::string, std::vector<uint32_t>>::iterator leaf = leaves.end();
+            if ((word >> 24) == 0x26 && caller != caller_at[filei].end()) {
+                leaf = leaves.find(caller->second);
+            }
+            if (leaf == leaves.end()) {
+                new_instrs.push_back(word);
+                continue;
+            }
+
+            std::cout << "Inline, " << fpaths[filei] << " pc=" << k * 4 << ": br " << display_name(leaf->first) << " replaced by its "
+                      << leaf->second.size() << " instruction(s)\n";
+            new_instrs.insert(new_instrs.end(), leaf->second.begin(), leaf->second.end());
+            inlined.insert(k);
+            if (options.stats != nullptr) {
+                options.stats->count("link.inlined_calls");
+            }
+        }
+        new_index[instr_count[filei]] = new_instrs.size() - file_start;
+
+        std::multimap<std::string, int> new_defs;
+        for (std::map<std::string, int>::iterator it = defs[filei].begin(); it != defs[filei].end(); ++it) {
+            new_defs.insert({it->first, new_index[it->second / 4] * 4});
+        }
+        std::multimap<std::string, int> new_callers;
+        for (std::map<std::string, int>::iterator it = callers[filei].begin(); it != callers[filei].end(); ++it) {
+            if (inlined.count(it->second / 4) == 0) {
+                new_callers.insert({it->first, new_index[it->second / 4] * 4});
+            }
+        }
+        defs[filei] = new_defs;
+        callers[filei] = new_callers;
+        instr_count[filei] = new_index[instr_count[filei]];
+    }
+    instrs = new_instrs;
     return true;
 }
 
-bool Linker::place_symbols() {
-    for (int filei=0; filei<callers.size(); filei++) {
-        std::multimap<std::string, int> cur_map = callers[filei];
-        // Step 0: initiate loop
+// Moves groups of sections so that hot callers and callees are next to each other and cold code is at the end.
+// A group starts at a section that can't be fallen into (the instruction before it is a jump, ret or end)
+// and runs up to the next such section, so the code inside a group keeps its fallthroughs. The group with
+// the first instruction stays first. Groups are chained by the heaviest call edges first, the way Pettis and
+// Hansen do it, and the chains are ordered by how hot they are per instruction. Afterwards the whole program
+// is a single object, the definitions and callers are kept in file order so the first definition still wins.
+bool Linker::order_sections() {
+    Stats::Timer timer(options.stats, Stats::RELOCATION);
+
+    std::map<std::string, long long> section_counts;
+    std::map<std::pair<std::string, std::string>, long long> edge_weights;
+    if (!read_profile(&section_counts, &edge_weights)) {
+        return false;
+    }
 
-        for (std::map<std::string, int>::iterator it = cur_map.begin(); it != cur_map.end(); ++it) {
-            std::string symbol_name = it->first;
-            int caller_rel_loc = it->second;
-            int caller_abs_loc = caller_rel_loc;
-            for (int i=0; i<filei; i++) {
-                caller_abs_loc += instr_count[i] * 4;
+    int unpatched = find_unpatched_distance();
+    if (unpatched >= 0) {
+        std::cout << "Not reordering: " << fpaths[unpatched] << " has a jump distance that isn't a symbol\n";
+        return true;
+    }
+
+    std::vector<int> file_begin = {0};
+    for (int filei=0; filei<instr_count.size(); filei++) {
+        file_begin.push_back(file_begin.back() + instr_count[filei]);
+    }
+    int n = file_begin.back();
+    if (n == 0) {
+        return true;
+    }
+
+    // Step 1: the first definition of every name, and the execution count of every instruction
+
+    std::map<std::string, int> def_at; // name -> instruction index
+    std::vector<long long> count_at(n, 0);
+    std::vector<bool> starts_section(n + 1, false);
+    for (int filei=0; filei<defs.size(); filei++) {
+        for (std::map<std::string, int>::iterator it = defs[filei].begin(); it != defs[filei].end(); ++it) {
+            int index = file_begin[filei] + it->second / 4;
+            def_at.insert({it->first, index});
+            if (it->first[0] == '@') {
+                def_at.insert({display_name(it->first), index}); // how the profile names a hidden section
+            }
+            starts_section[index] = true;
+        }
+    }
+    std::set<std::string> unknown;
+    for (std::map<std::string, long long>::iterator it = section_counts.begin(); it != section_counts.end(); ++it) {
+        if (def_at.count(it->first) == 0) {
+            unknown.insert(it->first);
+        }
+    }
+    for (auto it = edge_weights.begin(); it != edge_weights.end(); ++it) {
+        for (const std::string& name : {it->first.first, it->first.second}) {
+            if (def_at.count(name) == 0) {
+                unknown.insert(name);
+            }
+        }
+    }
+    for (const std::string& name : unknown) {
+        std::cerr << "Warning: " << options.profile_fpath << ": no section " << name << ", its entries are ignored\n";
+    }
+    {
+        std::vector<long long> count_from(n + 1, -1);
+        for (std::map<std::string, int>::iterator it = def_at.begin(); it != def_at.end(); ++it) {
+            std::map<std::string, long long>::iterator count = section_counts.find(it->first);
+            if (count != section_counts.end()) {
+                count_from[it->second] = std::max(count_from[it->second], count->second);
+            }
+        }
+        long long cur = 0;
+        for (int k=0; k<n; k++) {
+            if (starts_section[k]) {
+                cur = std::max(count_from[k], 0LL);
             }
+            count_at[k] = cur;
+        }
+    }
 
-            // now abs_loc points to the index of the control instruction that
-            // we need to put the jump address to
+    // Step 2: cut the program into groups
 
-            // step 1: find the symbol.
+    std::vector<int> group_begin;
+    std::vector<int> group_of(n + 1);
+    for (int k=0; k<n; k++) {
+        uint32_t prev_op = k > 0 ? instrs[k - 1] >> 24 : 0;
+        if (k == 0 || (starts_section[k] && (prev_op == 0x20 || prev_op == 0x24 || prev_op == 0x25))) {
+            group_begin.push_back(k);
+        }
+        group_of[k] = group_begin.size() - 1;
+    }
+    group_of[n] = group_begin.size(); // a section at the very end stays at the very end
+    int n_groups = group_begin.size();
+    group_begin.push_back(n);
 
-            int def_abs_loc = find_symbol(symbol_name);
-            if (def_abs_loc < 0) {
-                std::cerr << "Error: symbol not found: " << symbol_name << "\n";
-                if (!standalone_mode) {
-                    std::cerr << "Please call the linker manually with all object files\n";
-                } else {
-                    std::cerr << "Please make sure to call the linker with all object files\n";
+    std::vector<long long> group_weight(n_groups, 0);
+    for (int k=0; k<n; k++) {
+        group_weight[group_of[k]] += count_at[k];
+    }
+
+    // Step 3: call edges between groups, from the profile or estimated from the execution counts
+
+    std::map<std::pair<int, int>, long long> group_edges;
+    auto add_edge = [&](int a, int b, long long weight) {
+        if (a != b && a < n_groups && b < n_groups && weight > 0) {
+            group_edges[{std::min(a, b), std::max(a, b)}] += weight;
+        }
+    };
+    if (!edge_weights.empty()) {
+        for (auto it = edge_weights.begin(); it != edge_weights.end(); ++it) {
+            std::map<std::string, int>::iterator caller = def_at.find(it->first.first);
+            std::map<std::string, int>::iterator callee = def_at.find(it->first.second);
+            if (caller != def_at.end() && callee != def_at.end()) {
+                add_edge(group_of[caller->second], group_of[callee->second], it->second);
+            }
+        }
+    } else {
+        for (int filei=0; filei<callers.size(); filei++) {
+            for (std::map<std::string, int>::iterator it = callers[filei].begin(); it != callers[filei].end(); ++it) {
+                std::map<std::string, int>::iterator callee = def_at.find(it->first);
+                if (callee == def_at.end() || callee->second >= n) {
+                    continue;
                 }
-                return false;
+                int caller_index = file_begin[filei] + it->second / 4;
+                add_edge(group_of[caller_index], group_of[callee->second], std::min(count_at[caller_index], count_at[callee->second]));
             }
-            
-            // step 2: calculate jump amount to reach symbol
+        }
+    }
 
-            int loc_diff = def_abs_loc - caller_abs_loc;
+    // Step 4: chain the groups along the heaviest edges
 
-            // step 3: calculate necessary bits
+    std::vector<std::pair<long long, std::pair<int, int>>> sorted_edges;
+    for (auto it = group_edges.begin(); it != group_edges.end(); ++it) {
+        sorted_edges.push_back({it->second, it->first});
+    }
+    std::stable_sort(sorted_edges.begin(), sorted_edges.end(), [](const auto& a, const auto& b) { return a.first > b.first; });
 
-            // step 3.1
-            // for jump and br: 24 bits
-            // for jumpif and brif: 20 bits
+    std::vector<std::vector<int>> chains(n_groups);
+    std::vector<int> chain_of(n_groups);
+    for (int g=0; g<n_groups; g++) {
+        chains[g] = {g};
+        chain_of[g] = g;
+    }
+    for (const auto& edge : sorted_edges) {
+        int a = edge.second.first;
+        int b = edge.second.second;
+        int ca = chain_of[a];
+        int cb = chain_of[b];
+        if (ca == cb) {
+            continue;
+        }
+        // put a and b next to each other if the ends allow it, but the first group has to stay in front
+        bool b_first = chains[cb][0] == 0 || (chains[ca][0] != 0 && chains[cb].back() == b && chains[ca].back() != a);
+        int front = b_first ? cb : ca;
+        int back = b_first ? ca : cb;
+        for (int g : chains[back]) {
+            chains[front].push_back(g);
+            chain_of[g] = front;
+        }
+        chains[back].clear();
+    }
 
-            int val = 0;
-            unsigned char instr_bytes[4];
+    // Step 5: the chain with the entry first, then hot chains by weight per instruction, then cold code in source order
 
-            if (DEBUG_LEVEL >= 11) {
-                std::cout << symbol_name << " found at " << def_abs_loc << "\n";
-                std::cout << "loc_diff: " << loc_diff << "\n";
-                std::cout << "caller_abs_loc: " << caller_abs_loc << ", value: " << (uint32_t) instrs[caller_abs_loc] << "\n";
-                std::cout << "def_abs_loc: " << def_abs_loc << ", value: " << (uint32_t) instrs[def_abs_loc] << "\n";
+    std::vector<int> chain_order;
+    for (int c=0; c<n_groups; c++) {
+        if (!chains[c].empty() && c != chain_of[0]) {
+            chain_order.push_back(c);
+        }
+    }
+    auto density = [&](int c) {
+        long long weight = 0;
+        long long size = 0;
+        for (int g : chains[c]) {
+            weight += group_weight[g];
+            size += group_begin[g + 1] - group_begin[g];
+        }
+        return (double) weight / size;
+    };
+    std::vector<double> chain_density(n_groups, 0);
+    for (int c : chain_order) {
+        chain_density[c] = density(c);
+    }
+    std::stable_sort(chain_order.begin(), chain_order.end(), [&](int a, int b) { return chain_density[a] > chain_density[b]; });
+    chain_order.insert(chain_order.begin(), chain_of[0]);
+
+    // Step 6: move the code and everything that points into it
+
+    std::vector<int> new_index(n + 1);
+    std::vector<uint32_t> new_instrs;
+    new_instrs.reserve(instrs.size());
+    int moved_groups = 0;
+    int next_group = 0; // in source order, to count how many groups moved
+    for (int c : chain_order) {
+        for (int g : chains[c]) {
+            if (g != next_group) {
+                moved_groups++;
+            }
+            next_group = g + 1;
+            for (int k=group_begin[g]; k<group_begin[g + 1]; k++) {
+                new_index[k] = new_instrs.size();
+                new_instrs.push_back(instrs[k]);
             }
+        }
+    }
+    new_index[n] = n;
 
-            if (instrs[caller_abs_loc] == 0x20 || instrs[caller_abs_loc] == 0x26) {
-                val += loc_diff & 0xFFFFFF;
-                uint32_t uint_val = (uint32_t) val;
-                instr_bytes[0] = (uint_val) & 0xFF;
-                instr_bytes[1] = (uint_val >> 8) & 0xFF;
-                instr_bytes[2] = (uint_val >> 16) & 0xFF;
+    std::multimap<std::string, int> new_defs;
+    std::multimap<std::string, int> new_callers;
+    for (int filei=0; filei<defs.size(); filei++) {
+        for (std::map<std::string, int>::iterator it = defs[filei].begin(); it != defs[filei].end(); ++it) {
+            new_defs.insert({it->first, new_index[file_begin[filei] + it->second / 4] * 4});
+        }
+        for (std::map<std::string, int>::iterator it = callers[filei].begin(); it != callers[filei].end(); ++it) {
+            new_callers.insert({it->first, new_index[file_begin[filei] + it->second / 4] * 4});
+        }
+        defs[filei].clear();
+        callers[filei].clear();
+        instr_count[filei] = 0;
+    }
+    defs[0] = new_defs;
+    callers[0] = new_callers;
+    instr_count[0] = n;
+    instrs = new_instrs;
+
+    std::cout << "Reordered sections using " << options.profile_fpath << ", " << moved_groups << " of " << n_groups << " group(s) moved\n";
+    if (options.stats != nullptr) {
+        options.stats->count("link.moved_section_groups", moved_groups);
+    }
+    return true;
+}
 
+// A profile has one entry per line, either "section count" for how often a section was entered or
+// "caller callee weight" for how often caller called callee. Everything after # is a comment.
+bool Linker::read_profile(std::map<std::string, long long>* section_counts, std::map<std::pair<std::string, std::string>, long long>* edge_weights) {
+    std::ifstream file(options.profile_fpath);
+    if (!file) {
+        std::cerr << "Error: could not open profile " << options.profile_fpath << "\n";
+        return false;
+    }
 
-                // step 4: modify instrs 
+    std::string line;
+    int line_no = 0;
+    while (std::getline(file, line)) {
+        line_no++;
+        size_t comment = line.find('#');
+        if (comment != std::string::npos) {
+            line.erase(comment);
+        }
 
-                instrs[caller_abs_loc + 1] = instr_bytes[2];
-                instrs[caller_abs_loc + 2] = instr_bytes[1];
-                instrs[caller_abs_loc + 3] = instr_bytes[0];
+        std::istringstream fields(line);
+        std::vector<std::string> tokens;
+        std::string token;
+        while (fields >> token) {
+            tokens.push_back(token);
+        }
+        if (tokens.empty()) {
+            continue;
+        }
 
-            } else if (instrs[caller_abs_loc] == 0x22 || instrs[caller_abs_loc] == 0x27) {
-                val += loc_diff & 0xFFFFF;
-                uint32_t uint_val = (uint32_t) val;
-                
-                instr_bytes[0] = (uint_val) & 0xFF;
-                instr_bytes[1] = (uint_val >> 8) & 0xFF;
+        long long value = -1;
+        try {
+            size_t used = 0;
+            value = std::stoll(tokens.back(), &used);
+            if (used != tokens.back().size()) {
+                value = -1;
+            }
+        } catch (const std::exception&) {
+            value = -1;
+        }
 
-                instr_bytes[0] = (uint_val << 4) & 0xF0; // MSH: val & 0xF, LSH (rcond): leave as it is
-                instr_bytes[1] = (uint_val >> 4) & 0xFF;
-                instr_bytes[2] = (uint_val >> 12) & 0xFF;
+        if (value < 0 || (tokens.size() != 2 && tokens.size() != 3)) {
+            std::cerr << "Error: " << options.profile_fpath << ":" << line_no << ": expected \"section count\" or \"caller callee weight\"\n";
+            return false;
+        }
+        if (tokens.size() == 2) {
+            (*section_counts)[tokens[0]] += value;
+        } else {
+            (*edge_weights)[{tokens[0], tokens[1]}] += value;
+        }
+    }
+    return true;
+}
 
-                // step 4: modify instrs 
-                
-                instrs[caller_abs_loc + 1] = instr_bytes[2];
-                instrs[caller_abs_loc + 2] = instr_bytes[1];
-                instrs[caller_abs_loc + 3] |= instr_bytes[0]; // don't touch the LSH (rcond)
+// Index of a file with a jumpd, jumpifd or numeric jump distance, -1 if the linker patches every distance
+int Linker::find_unpatched_distance() {
+    int begin = 0;
+    for (int filei=0; filei<instr_count.size(); filei++) {
+        std::set<int> patched;
+        for (std::map<std::string, int>::iterator it = callers[filei].begin(); it != callers[filei].end(); ++it) {
+            patched.insert(it->second / 4);
+        }
+        for (int k=0; k<instr_count[filei]; k++) {
+            uint32_t op = instrs[begin + k] >> 24;
+            if (op == 0x21 || op == 0x23 || ((op == 0x20 || op == 0x22 || op == 0x26 || op == 0x27) && patched.count(k) == 0)) {
+                return filei;
             }
+        }
+        begin += instr_count[filei];
+    }
+    return -1;
+}
 
+// One hash lookup per caller instead of a search through every object. The first definition of a name wins.
+void Linker::index_symbols() {
+    Stats::Timer timer(options.stats, Stats::SYMBOL_RESOLUTION);
 
-            if (DEBUG_LEVEL >= 12) {
-                // for debug or sth
-                std::stringstream ss;
+    symbol_index.clear();
+    data_index.clear();
+    int begin = 0;
+    for (int filei=0; filei<defs.size(); filei++) {
+        for (std::multimap<std::string, int>::iterator it = defs[filei].begin(); it != defs[filei].end(); ++it) {
+            symbol_index.insert({it->first, begin + it->second});
+        }
+        begin += instr_count[filei] * 4;
+    }
+    for (int filei=0; filei<data_defs.size(); filei++) {
+        for (std::multimap<std::string, int>::iterator it = data_defs[filei].begin(); it != data_defs[filei].end(); ++it) {
+            data_index.insert({it->first, data_begin[filei] + it->second});
+        }
+    }
+}
+
+bool Linker::place_symbols() {
+    index_symbols();
+    if (options.stats != nullptr) {
+        options.stats->count("link.indexed_symbols", symbol_index.size());
+    }
 
-                ss << "0x" << std::uppercase << std::hex
-                << std::setw(2) << std::setfill('0') << (int)instr_bytes[3] 
-                << std::setw(2) << std::setfill('0') << (int)instr_bytes[2]
-                << std::setw(2) << std::setfill('0') << (int)instr_bytes[1]
-                << std::setw(2) << std::setfill('0') << (int)instr_bytes[0];
+    Stats::Timer timer(options.stats, Stats::RELOCATION);
 
-                std::cout << ss.str() << "\n";  
-            }      
+    uint32_t code_size = instrs.size() * 4;
+    data_base = (options.data_base >= 0) ? options.data_base : code_size;
+    if (!data.empty() && (data_base < code_size || data_base % 4 != 0)) {
+        std::cerr << "Error: the data base address must be a multiple of 4 after the code, which ends at " << code_size << "\n";
+        return false;
+    }
+
+    int file_begin = 0; // location of the first instruction of the file in bytes
+    for (int filei=0; filei<callers.size(); filei++) {
+        for (std::multimap<std::string, int>::iterator it = callers[filei].begin(); it != callers[filei].end(); ++it) {
+            int caller_abs_loc = file_begin + it->second;
+            if (!relocate(it->first, caller_abs_loc, &instrs[caller_abs_loc / 4])) {
+                return false;
+            }
         }
+        file_begin += instr_count[filei] * 4;
     }
     return true;
 }
 
-int Linker::find_symbol(std::string symbol_name) {
-    for (int filei=0; filei<defs.size(); filei++) {
-        std::multimap<std::string, int> cur_map = defs[filei];
+// Puts the location of symbol_name into the word of the caller at caller_abs_loc
+bool Linker::relocate(const std::string& symbol_name, int caller_abs_loc, uint32_t* word) {
+    // word is the control instruction that we need to put the jump address to,
+    // or a load or store of a data label
 
-        for (std::map<std::string, int>::iterator it = cur_map.begin(); it != cur_map.end(); ++it) {
-            std::string cur_symbol_name = it->first;
+    uint32_t op = *word >> 24;
+    if (op == 0x00 || op == 0x01 || op == 0x04 || op == 0x05) {
+        return place_data_reference(symbol_name, word);
+    }
 
-            if (cur_symbol_name == symbol_name) {
-                // Match
+    // step 1: find the symbol.
 
-                int rel_loc = it->second;
-                int abs_loc = rel_loc;
-                for (int i=0; i<filei; i++) {
-                    abs_loc += instr_count[i] * 4;
-                }
+    int def_abs_loc = -1;
+    {
+        Stats::Timer resolution_timer(options.stats, Stats::SYMBOL_RESOLUTION);
+        def_abs_loc = find_symbol(symbol_name);
+    }
+    if (def_abs_loc < 0) {
+        std::cerr << "Error: symbol not found: " << symbol_name << "\n";
+        if (!standalone_mode) {
+            std::cerr << "Please call the linker manually with all object files\n";
+        } else {
+            std::cerr << "Please make sure to call the linker with all object files\n";
+        }
+        return false;
+    }
+    
+    // step 2: calculate jump amount to reach symbol
 
-                return abs_loc;
-            }
+    uint32_t loc_diff = def_abs_loc - caller_abs_loc;
+
+    if (DEBUG_LEVEL >= 11) {
+        std::cout << symbol_name << " found at " << def_abs_loc << "\n";
+        std::cout << "loc_diff: " << (int) loc_diff << "\n";
+        std::cout << "caller_abs_loc: " << caller_abs_loc << ", value: " << op << "\n";
+    }
+
+    if (options.stats != nullptr) {
+        switch (op) {
+            case 0x20: options.stats->count("link.relocations.jump"); break;
+            case 0x22: options.stats->count("link.relocations.jumpif"); break;
+            case 0x26: options.stats->count("link.relocations.br"); break;
+            case 0x27: options.stats->count("link.relocations.brif"); break;
+            default: options.stats->count("link.relocations.other"); break;
         }
     }
-    return -1;
+
+    // step 3: put the distance into the word
+
+    patch_distance(word, loc_diff);
+
+    if (DEBUG_LEVEL >= 12) {
+        std::cout << "0x" << std::uppercase << std::hex << std::setw(8) << std::setfill('0') << *word << std::dec << std::nouppercase << "\n";
+    }
+    return true;
+}
+
+int Linker::find_symbol(const std::string& symbol_name) {
+    std::unordered_map<std::string, int>::iterator it = symbol_index.find(symbol_name);
+    return (it != symbol_index.end()) ? it->second : -1;
+}
+
+int Linker::find_data_symbol(const std::string& symbol_name) {
+    std::unordered_map<std::string, int>::iterator it = data_index.find(symbol_name);
+    return (it != data_index.end()) ? it->second : -1;
+}
+
+// uloadm, loadm and loadd get the absolute address of the data label in their 20 bit value,
+// stored gets it in the 20 bits above rs
+bool Linker::place_data_reference(const std::string& symbol_name, uint32_t* word) {
+    int offset = find_data_symbol(symbol_name);
+    if (offset < 0) {
+        std::cerr << "Error: data label not found: " << symbol_name << "\n";
+        if (!standalone_mode) {
+            std::cerr << "Please call the linker manually with all object files\n";
+        } else {
+            std::cerr << "Please make sure to call the linker with all object files\n";
+        }
+        return false;
+    }
+
+    uint32_t op = *word >> 24;
+    uint32_t addr = data_base + offset;
+    uint32_t limit = (op == 0x01) ? 0x80000 : 0x100000; // loadm sign extends
+    if (addr >= limit) {
+        std::cerr << "Error: address " << addr << " of " << symbol_name << " doesn't fit in the instruction, use a lower data base address\n";
+        return false;
+    }
+
+    if (op == 0x04) {
+        *word = (*word & 0xFF00000F) | (addr << 4); // don't touch rs
+    } else {
+        *word = (*word & 0xFFF00000) | addr; // don't touch rd
+    }
+
+    if (options.stats != nullptr) {
+        options.stats->count("link.relocations.data");
+    }
+    return true;
 }
 
 bool Linker::write_binary() {
+    Stats::Timer timer(options.stats, Stats::BINARY_WRITING);
+
     if (DEBUG_LEVEL >= 11) {
-        print_vuc(instrs);
+        print_words(instrs);
     }
 
-    std::ofstream bin_file("out/program.bin", std::ios::binary);
+    // The data goes at its base address, the gap after the code is zero
+    size_t code_size = instrs.size() * 4;
+    size_t size = data.empty() ? code_size : data_base + data.size();
+    OutputFile bin_file(output_path(), size, options.sync_output);
+    if (!bin_file.open()) {
+        std::cerr << "Error: " << bin_file.error() << "\n";
+        return false;
+    }
 
-    for (int i=0; i<instrs.size(); i++) {
-        bin_file.write(reinterpret_cast<const char*>(&instrs[i]), sizeof(instrs[i]));
+    swap_byte_order(instrs.data(), instrs.size(), bin_file.data());
+    std::copy(data.begin(), data.end(), bin_file.data() + (size - data.size()));
+
+    if (!bin_file.commit()) {
+        std::cerr << "Error: " << bin_file.error() << "\n";
+        return false;
     }
 
-    bin_file.close();
+    if (options.stats != nullptr) {
+        options.stats->count("link.bytes_out", size);
+    }
+    return true;
+}
+
+// -r: a branch to a section of one of the objects is patched like place_symbols would and kept as a local branch
+// of the merged object, so the later link still can move the code. Other branches and all data references stay
+// callers, the data is only placed by the final link. Like in an object from the assembler, a section of the
+// merged object wins over one of the same name in the objects it is linked with later.
+bool Linker::resolve_internal_references() {
+    index_symbols();
+
+    Stats::Timer timer(options.stats, Stats::RELOCATION);
+
+    std::multimap<std::string, int> merged_defs;
+    std::multimap<std::string, int> merged_callers;
+    std::multimap<std::string, int> merged_data_defs;
+    std::vector<std::pair<int, int>> merged_locals;
+    int resolved = 0;
+
+    int file_begin = 0; // in bytes
+    for (int filei=0; filei<callers.size(); filei++) {
+        for (std::multimap<std::string, int>::iterator it = defs[filei].begin(); it != defs[filei].end(); ++it) {
+            if (symbol_index[it->first] == file_begin + it->second && merged_defs.count(it->first) == 0) {
+                merged_defs.insert({it->first, file_begin + it->second});
+            }
+        }
+        for (std::multimap<std::string, int>::iterator it = data_defs[filei].begin(); it != data_defs[filei].end(); ++it) {
+            if (merged_data_defs.count(it->first) == 0) {
+                merged_data_defs.insert({it->first, data_begin[filei] + it->second});
+            }
+        }
+        for (const std::pair<int, int>& local : locals[filei]) {
+            merged_locals.push_back({file_begin + local.first, file_begin + local.second});
+        }
+
+        for (std::multimap<std::string, int>::iterator it = callers[filei].begin(); it != callers[filei].end(); ++it) {
+            int caller_abs_loc = file_begin + it->second;
+            uint32_t& word = instrs[caller_abs_loc / 4];
+            uint32_t op = word >> 24;
+            int def_abs_loc = -1;
+            if (op == 0x20 || op == 0x22 || op == 0x26 || op == 0x27) {
+                Stats::Timer resolution_timer(options.stats, Stats::SYMBOL_RESOLUTION);
+                def_abs_loc = find_symbol(it->first);
+            }
+            if (def_abs_loc < 0) {
+                merged_callers.insert({it->first, caller_abs_loc});
+                continue;
+            }
+            patch_distance(&word, def_abs_loc - caller_abs_loc);
+            merged_locals.push_back({caller_abs_loc, def_abs_loc});
+            resolved++;
+        }
+        file_begin += instr_count[filei] * 4;
+    }
+
+    if (options.stats != nullptr) {
+        options.stats->count("link.resolved_internal", resolved);
+        options.stats->count("link.kept_callers", merged_callers.size());
+    }
+
+    // Afterwards everything is in the first object, like after order_sections
+    for (int filei=0; filei<defs.size(); filei++) {
+        defs[filei].clear();
+        callers[filei].clear();
+        data_defs[filei].clear();
+        locals[filei].clear();
+        instr_count[filei] = 0;
+        data_begin[filei] = 0;
+    }
+    defs[0] = merged_defs;
+    callers[0] = merged_callers;
+    data_defs[0] = merged_data_defs;
+    locals[0] = merged_locals;
+    instr_count[0] = instrs.size();
     return true;
 }
 
+// Same format as Yuasm::write_object, the whole object is put together in memory and written at once
+bool Linker::write_relocatable_object() {
+    Stats::Timer timer(options.stats, Stats::BINARY_WRITING);
+
+    std::vector<unsigned char> bytes;
+    auto put_u32 = [&bytes](uint32_t val) {
+        bytes.insert(bytes.end(), {(unsigned char) (val >> 24), (unsigned char) (val >> 16), (unsigned char) (val >> 8), (unsigned char) val});
+    };
+    auto put_symbols = [&bytes, &put_u32](const std::multimap<std::string, int>& symbols) {
+        put_u32(symbols.size());
+        for (std::multimap<std::string, int>::const_iterator it = symbols.begin(); it != symbols.end(); ++it) {
+            bytes.insert(bytes.end(), {(unsigned char) (it->first.size() >> 8), (unsigned char) it->first.size()});
+            bytes.insert(bytes.end(), it->first.begin(), it->first.end());
+            put_u32(it->second);
+        }
+    };
+
+    put_symbols(defs[0]);
+    put_symbols(callers[0]);
+    put_symbols(data_defs[0]);
+    put_u32(data.size());
+    bytes.insert(bytes.end(), data.begin(), data.end());
+    put_u32(locals[0].size());
+    for (const std::pair<int, int>& local : locals[0]) {
+        put_u32(local.first);
+        put_u32(local.second);
+    }
+
+    OutputFile obj_file(output_path(), bytes.size() + instrs.size() * 4, options.sync_output);
+    if (!obj_file.open()) {
+        std::cerr << "Error: " << obj_file.error() << "\n";
+        return false;
+    }
+    std::copy(bytes.begin(), bytes.end(), obj_file.data());
+    swap_byte_order(instrs.data(), instrs.size(), obj_file.data() + bytes.size());
+    if (!obj_file.commit()) {
+        std::cerr << "Error: " << obj_file.error() << "\n";
+        return false;
+    }
+
+    if (options.stats != nullptr) {
+        options.stats->count("link.bytes_out", obj_file.size());
+    }
+    return true;
+}
+
+std::string Linker::output_path() const {
+    if (!options.output_fpath.empty()) {
+        return options.output_fpath;
+    }
+    return options.out_dir + (options.relocatable ? "/partial.o" : "/program.bin");
+}
+
 // Static functions
 
+// One "kind name loc" line of a block of the link state, returns false at the end of the block
+bool Linker::next_state_entry(std::string_view block, size_t* pos, std::string_view* kind, std::string_view* name, int* loc) {
+    size_t end = block.find('\n', *pos);
+    if (end == std::string_view::npos) {
+        return false;
+    }
+    std::string_view line = block.substr(*pos, end - *pos);
+    *pos = end + 1;
+
+    size_t space0 = line.find(' ');
+    size_t space1 = line.rfind(' ');
+    if (space0 == std::string_view::npos || space1 == space0) {
+        return false;
+    }
+    *kind = line.substr(0, space0);
+    *name = line.substr(space0 + 1, space1 - space0 - 1);
+    *loc = 0;
+    for (char ch : line.substr(space1 + 1)) {
+        *loc = *loc * 10 + (ch - '0');
+    }
+    return true;
+}
+
+uint64_t Linker::hash_file(const std::string& fpath) {
+    std::ifstream file(fpath, std::ios::binary);
+    if (!file) {
+        return 0;
+    }
+    uint64_t hash = 0xcbf29ce484222325;
+    std::vector<char> buffer(64 * 1024);
+    while (file.read(buffer.data(), buffer.size()) || file.gcount() > 0) {
+        for (std::streamsize i=0; i<file.gcount(); i++) {
+            hash = (hash ^ (unsigned char) buffer[i]) * 0x100000001b3;
+        }
+    }
+    return hash;
+}
+
+long long Linker::mtime_of(const std::string& fpath) {
+    std::error_code error;
+    std::filesystem::file_time_type time = std::filesystem::last_write_time(fpath, error);
+    return error ? -1 : (long long) time.time_since_epoch().count();
+}
+
+uint32_t Linker::read_u32(std::istream& file) {
+    uint32_t val = 0;
+    for (int i=0; i<4; i++) {
+        val = (val << 8) | (unsigned char) file.get();
+    }
+    return val;
+}
+
+// Object files and the binary are big endian. Four words are swapped at once where the target has
+// 128 bit vectors (SSE2 is part of every x86-64, NEON of every AArch64), the rest one by one.
+void Linker::swap_byte_order(const uint32_t* words, size_t n, void* out) {
+    unsigned char* to = static_cast<unsigned char*>(out); // not necessarily aligned
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    size_t i = 0;
+#if defined(__SSE2__)
+    for (; i + 4 <= n; i += 4) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(words + i));
+        v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8)); // swap the bytes of each half
+        v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(2, 3, 0, 1)); // then the halves of each word
+        v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(to + i * 4), v);
+    }
+#elif defined(__ARM_NEON)
+    for (; i + 4 <= n; i += 4) {
+        vst1q_u8(to + i * 4, vrev32q_u8(vreinterpretq_u8_u32(vld1q_u32(words + i))));
+    }
+#endif
+    for (; i < n; i++) {
+        uint32_t word = __builtin_bswap32(words[i]);
+        std::memcpy(to + i * 4, &word, 4);
+    }
+#else
+    std::memmove(to, words, n * 4);
+#endif
+}
+
 void Linker::print_vmsi(std::vector<std::multimap<std::string, int>> vmsi) {
     for (int i=0; i<vmsi.size(); i++) {
         std::cout << "Vector index " << i << ": \n";
@@ -381,18 +1563,28 @@ void Linker::print_vmsi(std::vector<std::multimap<std::string, int>> vmsi) {
     }
 }
 
-void Linker::print_vuc(std::vector<unsigned char> vuc) {
-    for (int i=0; i<vuc.size(); i++) {
+// jump and br take the distance in their low 24 bits, jumpif and brif in the 20 bits above rcond
+void Linker::patch_distance(uint32_t* word, uint32_t distance) {
+    uint32_t op = *word >> 24;
+    if (op == 0x20 || op == 0x26) {
+        *word = (*word & 0xFF000000) | (distance & 0xFFFFFF);
+    } else if (op == 0x22 || op == 0x27) {
+        *word = (*word & 0xFF00000F) | ((distance & 0xFFFFF) << 4); // don't touch rcond
+    }
+}
+
+void Linker::print_words(const std::vector<uint32_t>& words) {
+    for (int i=0; i<words.size(); i++) {
         std::stringstream ss;
-        ss << std::hex << std::setw(2) << std::setfill('0') << (unsigned int) vuc[i];
+        ss << std::hex << std::setw(4) << std::setfill('0') << (words[i] >> 16) << " "
+           << std::setw(4) << std::setfill('0') << (words[i] & 0xFFFF) << " ";
         std::cout << ss.str();
-        if (i % 2 == 1) {
-            std::cout << " ";
-        }
     }
     std::cout << "\n";
 }
 
-bool Linker::create_out_dir_safely() {
-    return std::filesystem::create_directories("out");
+bool Linker::create_out_dir_safely(const std::string& out_fpath) {
+    std::filesystem::path dir = std::filesystem::path(out_fpath).parent_path();
+    std::error_code error; // another linker may create it at the same time
+    return dir.empty() || std::filesystem::create_directories(dir, error);
 }
\ No newline at end of file
@@ -2,35 +2,120 @@
 #define YULINKER_H
 
 #include <string>
+#include <string_view>
 #include <vector>
 #include <map>
+#include <unordered_map>
+#include <fstream>
+#include <cstdint>
+
+#include "yustats.h"
+
+class FileCache;
+
+struct LinkerOptions {
+    Stats* stats = nullptr; // phase timings and counters are collected when set (--stats)
+    int inline_budget = 0; // --inline, calls to leaf sections of at most this many instructions are inlined, 0 disables it
+    std::string profile_fpath; // --profile, section execution counts or call edge weights to order the sections by
+    long long data_base = -1; // --data-base, address of the data in program.bin, right after the code if negative
+    bool relocatable = false; // -r, merge the objects into one object instead of a program
+    std::string output_fpath; // -o, <out_dir>/program.bin (<out_dir>/partial.o with -r) if empty
+    std::string out_dir = "out"; // --out
+    bool incremental = false; // --incremental, only the objects that changed since the last link are written, see Linker::relink
+    bool sync_output = false; // --fsync, the outputs are flushed to disk before they replace the old ones
+    FileCache* file_cache = nullptr; // yuasmd, the objects are read through it
+};
 
 class Linker {
 public:
-    Linker(std::vector<std::string> set_fpaths, bool set_standalone_mode);
+    Linker(std::vector<std::string> set_fpaths, bool set_standalone_mode, LinkerOptions set_options = LinkerOptions());
+    bool succeeded() const { return link_ok; }
 
 private:
+    friend class Benchmark; // bench/yubench.cpp drives single methods for microbenchmarks
+
     static constexpr int DEBUG_LEVEL = 10;
+    static constexpr size_t MAX_NAME_LENGTH = 65535; // the length of a symbol name in an object file has 16 bits
 
     bool standalone_mode;
+    LinkerOptions options;
+    bool link_ok = false; // the output was written
 
     std::vector<std::string> fpaths;
     std::vector<std::multimap<std::string, int>> defs; // should be map but gotta change the print function
     std::vector<std::multimap<std::string, int>> callers;
     std::vector<int> instr_count;
-    std::vector<unsigned char> instrs;
+    std::vector<uint32_t> instrs; // one word per instruction in host byte order
+    std::vector<std::multimap<std::string, int>> data_defs; // data label -> offset in the data of its file
+    std::vector<int> data_begin; // offset of the data of each file in data
+    std::vector<unsigned char> data;
+    uint32_t data_base = 0;
+    std::vector<std::vector<std::pair<int, int>>> locals; // branches the assembler patched: caller loc -> target loc in the same file
+    std::unordered_map<std::string, int> symbol_index; // name -> absolute location of its first definition, see index_symbols
+    std::unordered_map<std::string, int> data_index; // data label -> offset in data of its first definition
+
+    // What the last --incremental link put where, kept next to the program as <output>.state
+    struct LinkState {
+        struct Object {
+            std::string fpath;
+            uint64_t hash;
+            long long mtime; // the file is only hashed again if its mtime or size changed
+            uint64_t size;
+            int code_begin; // in bytes, like the other three
+            int code_size;
+            int data_begin;
+            int data_size;
+            size_t block_begin; // the symbols and callers of the object in text
+            size_t block_size;
+        };
+        long long data_base_option; // --data-base of the link
+        uint32_t data_base;
+        uint64_t bin_size;
+        long long bin_mtime; // anything else that writes the program makes the state useless
+        std::vector<Object> objects;
+        std::string text;
+
+        int data_end() const {
+            return objects.empty() ? 0 : objects.back().data_begin + objects.back().data_size;
+        }
+    };
+    std::vector<uint64_t> object_hashes; // of the files in fpaths, for the state
 
     bool link();
+    bool relink(bool* linked); // linked is false if a full link is needed
+    bool read_link_state(LinkState* state);
+    bool write_link_state(int data_end, const std::vector<std::string_view>& old_blocks); // the old block of an object is reused if it isn't empty
+    void clear_objects();
     bool save_defs_and_callers_and_instrs();
+    bool read_object(int i);
     std::multimap<std::string, int> get_defs(std::string fpath); // should be map but gotta change the print function
     std::multimap<std::string, int> get_callers(std::string fpath);
+    void lift_local_branches();
+    std::string display_name(const std::string& name); // object file and offset for the names lift_local_branches makes up
+    bool inline_leaf_sections();
+    bool order_sections();
+    bool read_profile(std::map<std::string, long long>* section_counts, std::map<std::pair<std::string, std::string>, long long>* edge_weights);
+    int find_unpatched_distance(); // returns -1 if every jump distance is a symbol
+    void index_symbols(); // after the passes that move code
     bool place_symbols();
-    int find_symbol(std::string symbol_name);
+    int find_symbol(const std::string& symbol_name);
+    int find_data_symbol(const std::string& symbol_name); // returns the offset in data, -1 if not found
+    bool relocate(const std::string& symbol_name, int caller_abs_loc, uint32_t* word);
+    bool place_data_reference(const std::string& symbol_name, uint32_t* word);
     bool write_binary();
+    bool resolve_internal_references(); // -r
+    bool write_relocatable_object();
+    std::string output_path() const; // options.output_fpath or the default of the mode
 
+    static uint32_t read_u32(std::istream& file);
+    static uint64_t hash_file(const std::string& fpath); // FNV-1a, 0 if the file can't be read
+    static long long mtime_of(const std::string& fpath);
+    static bool next_state_entry(std::string_view block, size_t* pos, std::string_view* kind, std::string_view* name, int* loc);
+    static void patch_distance(uint32_t* word, uint32_t distance); // of a jump, jumpif, br or brif
+    static void swap_byte_order(const uint32_t* words, size_t n, void* out); // big endian <-> host order into out, which can be words itself
     static void print_vmsi(std::vector<std::multimap<std::string, int>> vmsi);
-    static void print_vuc(std::vector<unsigned char> vuc);
-    static bool create_out_dir_safely();
+    static void print_words(const std::vector<uint32_t>& words);
+    static bool create_out_dir_safely(const std::string& out_fpath);
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,105 @@
+#include "yulinker.h"
+#include "yustats.h"
+#include "yucli.h"
+#include <vector>
+#include <string>
+#include <iostream>
+#include <fstream>
+#include <climits>
+#include <cstdint>
+
+int yulinker_command(int argc, char* argv[], FileCache* file_cache) {
+    std::vector<std::string> files;
+    bool stats_enabled = false;
+    bool stats_json = false;
+    std::string stats_fpath; // stats go to stderr if empty
+    int inline_budget = 0;
+    std::string profile_fpath;
+    long long data_base = -1;
+    bool relocatable = false;
+    bool incremental = false;
+    bool sync_output = false;
+    std::string output_fpath;
+    std::string out_dir = "out";
+
+    for (int i=1; i<argc; i++) {
+        std::string arg (argv[i]);
+        if (arg == "--stats" || arg == "--stats=text") {
+            stats_enabled = true;
+        } else if (arg == "--stats=json") {
+            stats_enabled = true;
+            stats_json = true;
+        } else if (arg == "--stats-file" && i + 1 < argc) {
+            stats_fpath = argv[++i];
+        } else if (arg == "--profile" && i + 1 < argc) {
+            profile_fpath = argv[++i];
+        } else if (arg == "--data-base" && i + 1 < argc) {
+            if (!parse_option_number(arg, argv[++i], 0, UINT32_MAX, &data_base, 0)) {
+                return 1;
+            }
+        } else if (arg == "--inline" && i + 1 < argc) {
+            long long value;
+            if (!parse_option_number(arg, argv[++i], 0, INT_MAX, &value)) {
+                return 1;
+            }
+            inline_budget = value;
+        } else if (arg == "--fsync") {
+            sync_output = true;
+        } else if (arg == "--incremental") {
+            incremental = true;
+        } else if (arg == "-r") {
+            relocatable = true;
+        } else if (arg == "-o" && i + 1 < argc) {
+            output_fpath = argv[++i];
+        } else if (arg == "--out" && i + 1 < argc) {
+            out_dir = argv[++i];
+        } else if (arg.size() > 1 && arg[0] == '-') {
+            std::cout << "Unknown option: " << arg << "\n";
+            return 1;
+        } else {
+            files.push_back(arg);
+        }
+    }
+
+    if (files.empty()) {
+        std::cout << "Please provide the object file paths as arguments\n";
+        std::cout << "Options: --stats[=text|json] [--stats-file path] [--inline max_instrs] [--profile path] [--data-base addr] [-r] [-o path] [--out dir] [--incremental] [--fsync]\n";
+        return 1;
+    }
+
+    if (relocatable && (inline_budget > 0 || !profile_fpath.empty() || data_base >= 0)) {
+        std::cout << "-r can't be combined with --inline, --profile or --data-base, use them for the final link\n";
+        return 1;
+    }
+    if (incremental && (relocatable || inline_budget > 0 || !profile_fpath.empty())) {
+        std::cout << "--incremental can't be combined with -r, --inline or --profile, they move code between objects\n";
+        return 1;
+    }
+
+    Stats stats;
+    LinkerOptions options;
+    options.inline_budget = inline_budget;
+    options.profile_fpath = profile_fpath;
+    options.data_base = data_base;
+    options.relocatable = relocatable;
+    options.output_fpath = output_fpath;
+    options.out_dir = out_dir;
+    options.incremental = incremental;
+    options.sync_output = sync_output;
+    options.file_cache = file_cache;
+    if (stats_enabled) {
+        options.stats = &stats;
+    }
+
+    Linker linker(files, true, options);
+
+    if (stats_enabled) {
+        if (stats_fpath.empty()) {
+            stats.print(std::cerr, stats_json);
+        } else {
+            std::ofstream stats_file(stats_fpath);
+            stats.print(stats_file, stats_json);
+        }
+    }
+    return linker.succeeded() ? 0 : 1;
+}
@@ -0,0 +1,1068 @@
+#include "yuopt.h"
+
+#include <set>
+#include <algorithm>
+
+Optimizer::Optimizer(std::vector<uint32_t>* set_instructions, std::map<std::string_view, int>* set_functions,
+                     std::vector<std::pair<std::string_view, int>>* set_callers, std::ostream* set_log, Stats* set_stats,
+                     const std::set<std::string_view>* set_hidden)
+    : instructions(set_instructions), functions(set_functions), callers(set_callers), log(set_log), stats(set_stats), hidden(set_hidden) {
+    code.reserve(instructions->size());
+    for (size_t i=0; i<instructions->size(); i++) {
+        code.push_back({(*instructions)[i], std::string_view(), (int) i * 4});
+    }
+    for (auto it = callers->begin(); it != callers->end(); ++it) {
+        code[it->second / 4].symbol = it->first;
+    }
+
+    n_original = code.size();
+    label_count.assign(code.size() + 1, 0);
+    for (auto it = functions->begin(); it != functions->end(); ++it) {
+        int index = it->second / 4;
+        labels.insert({it->first, index});
+        label_count[index]++;
+    }
+
+    // Removing instructions changes distances, which is only fine if the linker patches all of them.
+    // jumpd and jumpifd take the distance from a register and numeric jump distances are fixed.
+    for (const Instr& instr : code) {
+        uint8_t op = instr.word >> 24;
+        if (op == 0x21 || op == 0x23) {
+            can_remove = false;
+        } else if ((op == 0x20 || op == 0x22 || op == 0x26 || op == 0x27) && instr.symbol.empty()) {
+            can_remove = false;
+        }
+    }
+}
+
+int Optimizer::peephole() {
+    pass_name = "Peephole";
+    int rewrites = 0;
+    for (int round=0; round<MAX_ROUNDS; round++) {
+        int round_rewrites = 0;
+        for (int i=0; i<(int) code.size(); i++) {
+            if (code[i].removed) {
+                continue;
+            }
+            if (tail_call(i) || jump_to_next(i) || thread_jump(i) || dead_load(i)) {
+                round_rewrites++;
+            }
+        }
+
+        rewrites += round_rewrites;
+        if (round_rewrites == 0) {
+            break;
+        }
+    }
+    return rewrites;
+}
+
+int Optimizer::dataflow() {
+    // Without known branch targets there is no CFG to work on
+    if (!can_remove) {
+        return 0;
+    }
+    pass_name = "Dataflow";
+
+    int rewrites = 0;
+    for (int round=0; round<MAX_ROUNDS; round++) {
+        std::vector<int> block_of;
+        std::vector<Block> blocks = build_cfg(&block_of);
+        std::vector<RegValues> in = propagate_constants(blocks);
+
+        int round_rewrites = 0;
+        for (size_t b=0; b<blocks.size(); b++) {
+            if (in[b].visited) {
+                round_rewrites += rewrite_block(blocks[b], in[b]);
+            }
+        }
+
+        // folded branches change the CFG
+        blocks = build_cfg(&block_of);
+        round_rewrites += remove_unreachable(blocks);
+        blocks = build_cfg(&block_of);
+        round_rewrites += remove_dead_code(blocks);
+
+        rewrites += round_rewrites;
+        if (round_rewrites == 0) {
+            break;
+        }
+    }
+    return rewrites;
+}
+
+int Optimizer::hoist_loop_invariants() {
+    if (!can_remove) {
+        return 0;
+    }
+    pass_name = "LICM";
+
+    int moved = 0;
+    for (int round=0; round<MAX_ROUNDS; round++) {
+        compact();
+
+        std::vector<int> block_of;
+        std::vector<Block> blocks = build_cfg(&block_of);
+        std::vector<int> idom = dominators(blocks);
+        std::vector<uint16_t> live_in = liveness(blocks);
+        std::vector<std::vector<int>> preds(blocks.size());
+        for (size_t b=0; b<blocks.size(); b++) {
+            for (int succ : blocks[b].succs) {
+                preds[succ].push_back(b);
+            }
+        }
+
+        // A back edge goes to a block that dominates its source, the header of a natural loop
+        std::map<int, std::vector<int>> back_edges;
+        for (size_t b=0; b<blocks.size(); b++) {
+            for (int succ : blocks[b].succs) {
+                if (dominates(idom, succ, b)) {
+                    back_edges[succ].push_back(b);
+                }
+            }
+        }
+
+        std::map<int, std::vector<int>> hoisted; // code index of the header -> instructions moved in front of it
+        std::vector<bool> taken(code.size(), false);
+        for (auto it = back_edges.begin(); it != back_edges.end(); ++it) {
+            int header = it->first;
+            if (blocks[header].entry) {
+                continue; // can be entered from outside without passing a preheader
+            }
+
+            std::vector<bool> in_loop(blocks.size(), false);
+            std::vector<int> stack;
+            in_loop[header] = true;
+            for (int src : it->second) {
+                if (!in_loop[src]) {
+                    in_loop[src] = true;
+                    stack.push_back(src);
+                }
+            }
+            while (!stack.empty()) {
+                int b = stack.back();
+                stack.pop_back();
+                for (int pred : preds[b]) {
+                    if (!in_loop[pred]) {
+                        in_loop[pred] = true;
+                        stack.push_back(pred);
+                    }
+                }
+            }
+
+            // The preheader goes right before the header, so the loop may only be entered by falling into it
+            int header_index = blocks[header].instrs[0];
+            bool single_entry = true;
+            for (int pred : preds[header]) {
+                if (in_loop[pred]) {
+                    continue;
+                }
+                int last = blocks[pred].instrs.back();
+                uint8_t op = code[last].word >> 24;
+                bool jumps_here = (op == 0x20 || op == 0x22) && resolve(code[last].symbol) == header_index;
+                if (pred != header - 1 || jumps_here) {
+                    single_entry = false;
+                }
+            }
+            if (!single_entry) {
+                continue;
+            }
+
+            // What the loop writes, and what is read after it leaves
+            uint16_t loop_defs = 0;
+            int def_count[16] = {0};
+            bool loop_writes_mem = false;
+            std::vector<int> loop_instrs;
+            for (size_t b=0; b<blocks.size(); b++) {
+                if (!in_loop[b]) {
+                    continue;
+                }
+                for (int i : blocks[b].instrs) {
+                    InstrInfo info = decode(code[i].word);
+                    loop_instrs.push_back(i);
+                    loop_writes_mem |= info.writes_mem;
+                    for (int r=0; r<16; r++) {
+                        def_count[r] += info.defs >> r & 1;
+                    }
+                }
+            }
+
+            std::vector<std::pair<int, uint16_t>> exits; // loop block, registers live where it leaves the loop
+            for (size_t b=0; b<blocks.size(); b++) {
+                if (!in_loop[b]) {
+                    continue;
+                }
+                uint16_t live = blocks[b].exit ? 0xFFFF : 0;
+                bool leaves = blocks[b].exit;
+                for (int succ : blocks[b].succs) {
+                    if (!in_loop[succ]) {
+                        live |= live_in[succ];
+                        leaves = true;
+                    }
+                }
+                if (leaves) {
+                    exits.push_back({(int) b, live});
+                }
+            }
+
+            // An instruction is invariant if nothing it reads is written in the loop (except by what was
+            // already hoisted), it is the only write to its register, the loop doesn't read the register
+            // before writing it, and it runs on every way out of the loop where the register is still read.
+            std::vector<int> moved_here;
+            bool changed = true;
+            while (changed) {
+                changed = false;
+                loop_defs = 0;
+                for (int i : loop_instrs) {
+                    if (!taken[i]) {
+                        loop_defs |= decode(code[i].word).defs;
+                    }
+                }
+
+                for (int i : loop_instrs) {
+                    InstrInfo info = decode(code[i].word);
+                    if (taken[i] || has_side_effects(info) || info.defs == 0 || (info.reads_mem && loop_writes_mem)) {
+                        continue;
+                    }
+                    int rd = (code[i].word >> 20) & 0xF;
+                    if (def_count[rd] != 1 || (live_in[header] >> rd & 1) || (info.uses & loop_defs)) {
+                        continue;
+                    }
+                    bool on_every_exit = true;
+                    for (const auto& exit : exits) {
+                        if ((exit.second >> rd & 1) && !dominates(idom, block_of[i], exit.first)) {
+                            on_every_exit = false;
+                        }
+                    }
+                    if (!on_every_exit) {
+                        continue;
+                    }
+
+                    taken[i] = true;
+                    moved_here.push_back(i);
+                    changed = true;
+                    break; // loop_defs has changed
+                }
+            }
+
+            if (!moved_here.empty()) {
+                std::sort(moved_here.begin(), moved_here.end());
+                hoisted[header_index] = moved_here;
+            }
+        }
+
+        if (hoisted.empty()) {
+            break;
+        }
+
+        // Insert from the back so the indices of the headers in front stay valid
+        for (auto it = hoisted.rbegin(); it != hoisted.rend(); ++it) {
+            int header_index = it->first;
+            std::string header_name;
+            for (auto label = labels.begin(); label != labels.end(); ++label) {
+                if (label->second == header_index) {
+                    header_name = label->first;
+                }
+            }
+
+            std::vector<Instr> preheader;
+            for (int i : it->second) {
+                preheader.push_back(code[i]);
+                report("opt.licm.hoisted", i, "r" + std::to_string((code[i].word >> 20) & 0xF) + " is loop invariant, moved in front of " + header_name);
+                remove(i);
+                moved++;
+            }
+            code.insert(code.begin() + header_index, preheader.begin(), preheader.end());
+            for (auto label = labels.begin(); label != labels.end(); ++label) {
+                if (label->second >= header_index) {
+                    label->second += preheader.size();
+                }
+            }
+        }
+        label_count.assign(code.size() + 1, 0);
+        for (auto label = labels.begin(); label != labels.end(); ++label) {
+            label_count[label->second]++;
+        }
+    }
+    return moved;
+}
+
+// br X --> the body of X, if X is a local section of at most max_size instructions that runs straight
+// into a ret. X itself stays where it is since other objects can still branch to it.
+int Optimizer::inline_leaf_sections(int max_size) {
+    if (!can_remove) {
+        return 0;
+    }
+    pass_name = "Inline";
+    compact();
+
+    std::map<std::string_view, std::vector<Instr>> leaves;
+    for (auto label = labels.begin(); label != labels.end(); ++label) {
+        std::vector<Instr> body;
+        for (size_t k=label->second; k<code.size() && (int) body.size() <= max_size; k++) {
+            InstrInfo info = decode(code[k].word);
+            if (info.op == 0x24) {
+                leaves[label->first] = body;
+                break;
+            }
+            if (info.control) {
+                break;
+            }
+            body.push_back(code[k]);
+        }
+    }
+
+    // From the back so the indices in front stay valid
+    int inlined = 0;
+    for (int i=(int) code.size()-1; i>=0; i--) {
+        if ((code[i].word >> 24) != 0x26 || code[i].symbol.empty()) {
+            continue;
+        }
+        auto leaf = leaves.find(code[i].symbol);
+        if (leaf == leaves.end()) {
+            continue;
+        }
+
+        std::vector<Instr> body = leaf->second;
+        for (Instr& instr : body) {
+            instr.orig_pc = code[i].orig_pc; // later reports point at the call
+        }
+        report("opt.inline.inlined_calls", i, "br " + std::string(code[i].symbol) + " replaced by its "
+               + std::to_string(body.size()) + " instruction(s)");
+        code.erase(code.begin() + i);
+        code.insert(code.begin() + i, body.begin(), body.end());
+        for (auto label = labels.begin(); label != labels.end(); ++label) {
+            if (label->second > i) {
+                label->second += (int) body.size() - 1;
+            }
+        }
+        inlined++;
+    }
+
+    label_count.assign(code.size() + 1, 0);
+    for (auto label = labels.begin(); label != labels.end(); ++label) {
+        label_count[label->second]++;
+    }
+    return inlined;
+}
+
+void Optimizer::compact() {
+    std::vector<int> new_index(code.size() + 1);
+    int n_live = 0;
+    for (size_t i=0; i<code.size(); i++) {
+        new_index[i] = n_live;
+        if (!code[i].removed) {
+            code[n_live++] = code[i];
+        }
+    }
+    new_index[code.size()] = n_live;
+    code.resize(n_live);
+
+    // a section that started at a removed instruction moves to the next live one
+    label_count.assign(code.size() + 1, 0);
+    for (auto it = labels.begin(); it != labels.end(); ++it) {
+        it->second = new_index[it->second];
+        label_count[it->second]++;
+    }
+}
+
+void Optimizer::store() {
+    compact();
+
+    instructions->clear();
+    callers->clear();
+    for (size_t i=0; i<code.size(); i++) {
+        if (!code[i].symbol.empty()) {
+            callers->push_back({code[i].symbol, (int) i * 4});
+        }
+        instructions->push_back(code[i].word);
+    }
+
+    for (auto it = functions->begin(); it != functions->end(); ++it) {
+        it->second = labels[it->first] * 4;
+    }
+
+    if (stats != nullptr) {
+        stats->count("opt.removed_instrs", n_original - code.size());
+    }
+}
+
+InstrInfo Optimizer::decode(uint32_t word) {
+    uint8_t op = word >> 24;
+    uint16_t rd = 1 << ((word >> 20) & 0xF); // also raddr of storen and rs of jumpd and jumpifd
+    uint16_t rs1 = 1 << ((word >> 16) & 0xF); // also raddr of loadr and rs of storen
+    uint16_t rs2 = 1 << ((word >> 12) & 0xF);
+    uint16_t low = 1 << (word & 0xF); // rs of stored, rcond of jumpif and brif
+
+    InstrInfo info = {op, 0, 0, false, false, false};
+    switch (op) {
+        case 0x00: case 0x01: info.defs = rd; break; // uloadm, loadm
+        case 0x02: info.defs = rd; info.uses = rs1; info.reads_mem = true; break; // loadr
+        case 0x03: info.uses = rd | rs1; info.writes_mem = true; break; // storen
+        case 0x04: info.uses = low; info.writes_mem = true; break; // stored
+        case 0x05: info.defs = rd; info.reads_mem = true; break; // loadd
+
+        case 0x20: case 0x24: case 0x25: info.control = true; break; // jump, ret, end
+        case 0x21: info.uses = rd; info.control = true; break; // jumpd
+        case 0x22: info.uses = low; info.control = true; break; // jumpif
+        case 0x23: info.uses = rd | low; info.control = true; break; // jumpifd
+
+        // a branch runs code that can read and write anything
+        case 0x26: info.defs = 0xFFFF; info.uses = 0xFFFF; info.control = true; info.reads_mem = true; info.writes_mem = true; break;
+        case 0x27: info.defs = 0xFFFF; info.uses = 0xFFFF; info.control = true; info.reads_mem = true; info.writes_mem = true; break;
+
+        default: info.defs = rd; info.uses = rs1 | rs2; break; // arithmetic, logical, shift and comparison
+    }
+    return info;
+}
+
+std::vector<Optimizer::Block> Optimizer::build_cfg(std::vector<int>* block_of) const {
+    std::vector<Block> blocks;
+    block_of->assign(code.size(), -1);
+
+    // A hidden section can only be entered from this file, every exported section can be entered from another
+    // object however this file reaches it. Sections that are branched to with br or brif are always entries
+    // since calls aren't edges.
+    std::set<std::string_view> called;
+    for (const Instr& instr : code) {
+        uint8_t op = instr.word >> 24;
+        if (!instr.removed && (op == 0x26 || op == 0x27) && !instr.symbol.empty()) {
+            called.insert(instr.symbol);
+        }
+    }
+    std::vector<bool> outside_entry(code.size() + 1, false);
+    for (auto it = labels.begin(); it != labels.end(); ++it) {
+        bool is_hidden = (hidden != nullptr && hidden->count(it->first) > 0);
+        if (called.count(it->first) > 0 || !is_hidden) {
+            outside_entry[live_at_or_after(it->second)] = true;
+        }
+    }
+
+    // Blocks start at the first instruction, at sections and after control instructions
+    bool after_control = true;
+    for (int i=live_at_or_after(0); i<(int) code.size(); i=next_live(i)) {
+        bool target = is_target(i);
+        if (after_control || target) {
+            blocks.push_back(Block());
+            blocks.back().entry = (target && outside_entry[i]) || blocks.size() == 1;
+        }
+        blocks.back().instrs.push_back(i);
+        (*block_of)[i] = blocks.size() - 1;
+        after_control = decode(code[i].word).control;
+    }
+
+    for (size_t b=0; b<blocks.size(); b++) {
+        Block& block = blocks[b];
+        int last = block.instrs.back();
+        uint8_t op = code[last].word >> 24;
+        bool falls_through = (op != 0x20 && op != 0x24 && op != 0x25);
+        bool jumps = (op == 0x20 || op == 0x22); // br and brif come back, the callee is an entry of its own
+
+        if (falls_through) {
+            if (b + 1 < blocks.size()) {
+                block.succs.push_back(b + 1);
+            } else {
+                block.exit = true; // into whatever the linker puts after us
+            }
+        }
+        if (jumps) {
+            int t = resolve(code[last].symbol);
+            if (t >= 0 && t < (int) code.size()) {
+                block.succs.push_back((*block_of)[t]);
+            } else {
+                block.exit = true;
+            }
+        }
+        if (op == 0x24 || op == 0x25) {
+            block.exit = true; // end too, the registers it leaves behind are the result of the program
+        }
+    }
+    return blocks;
+}
+
+std::vector<Optimizer::RegValues> Optimizer::propagate_constants(const std::vector<Block>& blocks) const {
+    // Forward dataflow: a register is known at the start of a block if it has the same value at the end of
+    // every predecessor. Entries can be reached from anywhere, nothing is known there.
+    std::vector<RegValues> in(blocks.size());
+    std::vector<int> worklist;
+    for (size_t b=0; b<blocks.size(); b++) {
+        if (blocks[b].entry) {
+            in[b].visited = true;
+            worklist.push_back(b);
+        }
+    }
+
+    while (!worklist.empty()) {
+        int b = worklist.back();
+        worklist.pop_back();
+
+        RegValues out = in[b];
+        for (int i : blocks[b].instrs) {
+            transfer(code[i], &out);
+        }
+
+        for (int succ : blocks[b].succs) {
+            RegValues& next = in[succ];
+            if (!next.visited) {
+                next = out;
+                worklist.push_back(succ);
+                continue;
+            }
+
+            uint16_t known = next.known & out.known;
+            for (int r=0; r<16; r++) {
+                if ((known >> r & 1) && next.val[r] != out.val[r]) {
+                    known &= ~(1 << r);
+                }
+            }
+            if (known != next.known) {
+                next.known = known;
+                worklist.push_back(succ);
+            }
+        }
+    }
+    return in;
+}
+
+int Optimizer::rewrite_block(const Block& block, RegValues state) {
+    int rewrites = 0;
+    int copy_of[16]; // copy_of[r] == s if r holds the same value as s, -1 if not known
+    for (int r=0; r<16; r++) {
+        copy_of[r] = -1;
+    }
+
+    for (int i : block.instrs) {
+        Instr& instr = code[i];
+        InstrInfo info = decode(instr.word);
+        int rd = (instr.word >> 20) & 0xF;
+
+        // Copy propagation: read the original instead of the copy
+        if (!info.control || info.op == 0x22) {
+            for (int r=0; r<16; r++) {
+                if ((info.uses >> r & 1) && copy_of[r] >= 0) {
+                    uint32_t word = replace_use(instr.word, r, copy_of[r]);
+                    if (word != instr.word) {
+                        report("opt.dataflow.copies", i, "r" + std::to_string(r) + " is a copy of r" + std::to_string(copy_of[r]) + ", reading r" + std::to_string(copy_of[r]));
+                        instr.word = word;
+                        rewrites++;
+                    }
+                }
+            }
+            info = decode(instr.word);
+        }
+
+        // Constant folding, the result becomes a single load
+        uint32_t value;
+        if (info.op >= 0x10 && !info.control && evaluate(instr.word, state, &value)) {
+            uint32_t word;
+            if (make_load(rd, value, &word)) {
+                report("opt.dataflow.constants", i, "r" + std::to_string(rd) + " is always " + std::to_string((int32_t) value) + ", loaded directly");
+                instr.word = word;
+                info = decode(word);
+                rewrites++;
+            }
+        }
+
+        // Strength reduction: mul by 2 is an add, mul by 2^k a shift if some register holds k
+        if (info.op == 0x12) {
+            int rs1 = (instr.word >> 16) & 0xF;
+            int rs2 = (instr.word >> 12) & 0xF;
+            int other = -1;
+            uint32_t factor = 0;
+            if ((state.known >> rs2 & 1) && !(state.known >> rs1 & 1)) {
+                other = rs1;
+                factor = state.val[rs2];
+            } else if ((state.known >> rs1 & 1) && !(state.known >> rs2 & 1)) {
+                other = rs2;
+                factor = state.val[rs1];
+            }
+
+            if (other >= 0 && factor >= 2 && (factor & (factor - 1)) == 0) {
+                uint32_t shift = 0;
+                while ((1u << shift) != factor) {
+                    shift++;
+                }
+
+                int shift_reg = -1;
+                for (int r=0; r<16 && shift > 1; r++) {
+                    if ((state.known >> r & 1) && state.val[r] == shift) {
+                        shift_reg = r;
+                        break;
+                    }
+                }
+
+                if (shift == 1) {
+                    instr.word = (0x10 << 24) | (rd << 20) | (other << 16) | (other << 12);
+                    report("opt.dataflow.strength_reductions", i, "mul by 2 -> add r" + std::to_string(other) + " r" + std::to_string(other));
+                    rewrites++;
+                } else if (shift_reg >= 0) {
+                    instr.word = (0x40 << 24) | (rd << 20) | (other << 16) | (shift_reg << 12);
+                    report("opt.dataflow.strength_reductions", i, "mul by " + std::to_string(factor) + " -> lshift by r" + std::to_string(shift_reg));
+                    rewrites++;
+                }
+                info = decode(instr.word);
+            }
+        }
+
+        // Conditional control with a known condition
+        if ((info.op == 0x22 || info.op == 0x27) && (state.known >> (instr.word & 0xF) & 1)) {
+            bool taken = state.val[instr.word & 0xF] != 0;
+            std::string name = op_name(info.op) + " " + std::string(instr.symbol);
+            if (taken) {
+                instr.word = (info.op == 0x22 ? 0x20 : 0x26) << 24;
+                report("opt.dataflow.folded_branches", i, name + " is always taken -> " + op_name(instr.word >> 24));
+            } else {
+                report("opt.dataflow.folded_branches", i, name + " is never taken, removed");
+                remove(i);
+            }
+            rewrites++;
+            return rewrites; // the block ends here either way
+        }
+
+        // Track copies, any write invalidates copies of and from the written registers
+        info = decode(instr.word);
+        for (int r=0; r<16; r++) {
+            if (info.defs >> r & 1) {
+                copy_of[r] = -1;
+                for (int c=0; c<16; c++) {
+                    if (copy_of[c] == r) {
+                        copy_of[c] = -1;
+                    }
+                }
+            }
+        }
+        if (!info.control && info.op >= 0x10) {
+            int rs1 = (instr.word >> 16) & 0xF;
+            int rs2 = (instr.word >> 12) & 0xF;
+            bool zero2 = (state.known >> rs2 & 1) && state.val[rs2] == 0;
+            bool one2 = (state.known >> rs2 & 1) && state.val[rs2] == 1;
+            bool copy = false;
+            switch (info.op) {
+                case 0x10: case 0x11: case 0x31: case 0x34: case 0x40: case 0x41: copy = zero2; break; // add, sub, or, xor, shifts by 0
+                case 0x12: case 0x13: copy = one2; break; // mul and div by 1
+                case 0x30: copy = (rs1 == rs2); break; // and r r
+                default: break;
+            }
+            if (info.op == 0x31 && rs1 == rs2) {
+                copy = true; // or r r
+            }
+            if (copy && rs1 != rd) {
+                copy_of[rd] = (copy_of[rs1] >= 0) ? copy_of[rs1] : rs1;
+            }
+        }
+
+        transfer(instr, &state);
+    }
+    return rewrites;
+}
+
+std::vector<uint16_t> Optimizer::liveness(const std::vector<Block>& blocks) const {
+    // Backward liveness. Whatever leaves the object or reaches end may be read by someone else.
+    std::vector<uint16_t> live_in(blocks.size(), 0);
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (int b=(int) blocks.size()-1; b>=0; b--) {
+            uint16_t live = blocks[b].exit ? 0xFFFF : 0;
+            for (int succ : blocks[b].succs) {
+                live |= live_in[succ];
+            }
+            for (int k=(int) blocks[b].instrs.size()-1; k>=0; k--) {
+                InstrInfo info = decode(code[blocks[b].instrs[k]].word);
+                live = (live & ~info.defs) | info.uses;
+            }
+            if (live != live_in[b]) {
+                live_in[b] = live;
+                changed = true;
+            }
+        }
+    }
+
+    return live_in;
+}
+
+std::vector<int> Optimizer::dominators(const std::vector<Block>& blocks) const {
+    // Cooper, Harvey and Kennedy's iterative algorithm on reverse postorder. A virtual root (blocks.size())
+    // precedes all entries, blocks that can't be reached keep -1.
+    int root = blocks.size();
+    std::vector<int> order; // postorder
+    std::vector<int> postorder_index(blocks.size() + 1, -1);
+    std::vector<char> visited(blocks.size(), 0);
+    std::vector<std::pair<int, size_t>> stack;
+    for (size_t e=0; e<blocks.size(); e++) {
+        if (!blocks[e].entry || visited[e]) {
+            continue;
+        }
+        visited[e] = 1;
+        stack.push_back({(int) e, 0});
+        while (!stack.empty()) {
+            int b = stack.back().first;
+            size_t& next = stack.back().second;
+            if (next < blocks[b].succs.size()) {
+                int succ = blocks[b].succs[next++];
+                if (!visited[succ]) {
+                    visited[succ] = 1;
+                    stack.push_back({succ, 0});
+                }
+            } else {
+                postorder_index[b] = order.size();
+                order.push_back(b);
+                stack.pop_back();
+            }
+        }
+    }
+    postorder_index[root] = order.size();
+
+    std::vector<std::vector<int>> preds(blocks.size());
+    for (size_t b=0; b<blocks.size(); b++) {
+        for (int succ : blocks[b].succs) {
+            preds[succ].push_back(b);
+        }
+        if (blocks[b].entry) {
+            preds[b].push_back(root);
+        }
+    }
+
+    std::vector<int> idom(blocks.size() + 1, -1);
+    idom[root] = root;
+    auto intersect = [&](int a, int b) {
+        while (a != b) {
+            while (postorder_index[a] < postorder_index[b]) {
+                a = idom[a];
+            }
+            while (postorder_index[b] < postorder_index[a]) {
+                b = idom[b];
+            }
+        }
+        return a;
+    };
+
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (int k=(int) order.size()-1; k>=0; k--) {
+            int b = order[k];
+            int new_idom = -1;
+            for (int pred : preds[b]) {
+                if (idom[pred] < 0) {
+                    continue;
+                }
+                new_idom = (new_idom < 0) ? pred : intersect(pred, new_idom);
+            }
+            if (new_idom != idom[b]) {
+                idom[b] = new_idom;
+                changed = true;
+            }
+        }
+    }
+    return idom;
+}
+
+bool Optimizer::dominates(const std::vector<int>& idom, int a, int b) {
+    if (idom[b] < 0) {
+        return false;
+    }
+    int root = idom.size() - 1;
+    while (b != a && b != root) {
+        b = idom[b];
+    }
+    return b == a;
+}
+
+int Optimizer::remove_dead_code(const std::vector<Block>& blocks) {
+    std::vector<uint16_t> live_in = liveness(blocks);
+
+    int removed = 0;
+    for (size_t b=0; b<blocks.size(); b++) {
+        uint16_t live = blocks[b].exit ? 0xFFFF : 0;
+        for (int succ : blocks[b].succs) {
+            live |= live_in[succ];
+        }
+        for (int k=(int) blocks[b].instrs.size()-1; k>=0; k--) {
+            int i = blocks[b].instrs[k];
+            InstrInfo info = decode(code[i].word);
+            if (info.defs != 0 && (info.defs & live) == 0 && !has_side_effects(info)) {
+                report("opt.dataflow.dead_stores", i, "r" + std::to_string((code[i].word >> 20) & 0xF) + " is never read, removed");
+                remove(i);
+                removed++;
+                continue;
+            }
+            live = (live & ~info.defs) | info.uses;
+        }
+    }
+    return removed;
+}
+
+int Optimizer::remove_unreachable(const std::vector<Block>& blocks) {
+    std::vector<bool> reached(blocks.size(), false);
+    std::vector<int> worklist;
+    for (size_t b=0; b<blocks.size(); b++) {
+        if (blocks[b].entry) {
+            reached[b] = true;
+            worklist.push_back(b);
+        }
+    }
+    while (!worklist.empty()) {
+        int b = worklist.back();
+        worklist.pop_back();
+        for (int succ : blocks[b].succs) {
+            if (!reached[succ]) {
+                reached[succ] = true;
+                worklist.push_back(succ);
+            }
+        }
+    }
+
+    int removed = 0;
+    for (size_t b=0; b<blocks.size(); b++) {
+        if (reached[b]) {
+            continue;
+        }
+        report("opt.dataflow.unreachable_blocks", blocks[b].instrs[0], std::to_string(blocks[b].instrs.size()) + " unreachable instruction(s) removed");
+        for (int i : blocks[b].instrs) {
+            remove(i);
+            removed++;
+        }
+    }
+    return removed;
+}
+
+int Optimizer::next_live(int i) const {
+    return live_at_or_after(i + 1);
+}
+
+int Optimizer::live_at_or_after(int i) const {
+    while (i < (int) code.size() && code[i].removed) {
+        i++;
+    }
+    return i;
+}
+
+int Optimizer::resolve(std::string_view symbol) const {
+    auto it = labels.find(symbol);
+    if (it == labels.end()) {
+        return -1;
+    }
+    return live_at_or_after(it->second);
+}
+
+bool Optimizer::is_target(int i) const {
+    if (label_count[i] > 0) {
+        return true;
+    }
+    for (int j=i-1; j>=0 && code[j].removed; j--) {
+        if (label_count[j] > 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void Optimizer::remove(int i) {
+    code[i].removed = true;
+    code[i].symbol = std::string_view();
+}
+
+void Optimizer::report(const char* counter, int i, const std::string& what) {
+    *log << pass_name << ", pc=" << code[i].orig_pc << ": " << what << "\n";
+    if (stats != nullptr) {
+        stats->count(counter);
+    }
+}
+
+// br X; ret --> jump X, X returns straight to our caller. The ret is dropped if nothing else jumps to it.
+bool Optimizer::tail_call(int i) {
+    int j = next_live(i);
+    if ((code[i].word >> 24) != 0x26 || code[i].symbol.empty() || j >= (int) code.size() || (code[j].word >> 24) != 0x24) {
+        return false;
+    }
+
+    code[i].word = (code[i].word & 0xFFFFFF) | (0x20 << 24);
+    report("opt.peephole.tail_calls", i, "br " + std::string(code[i].symbol) + "; ret -> jump " + std::string(code[i].symbol));
+    if (can_remove && !is_target(j)) {
+        remove(j);
+    }
+    return true;
+}
+
+// jump X or jumpif X when X is the next instruction anyway
+bool Optimizer::jump_to_next(int i) {
+    uint8_t op = code[i].word >> 24;
+    if (!can_remove || (op != 0x20 && op != 0x22) || code[i].symbol.empty()) {
+        return false;
+    }
+    if (resolve(code[i].symbol) != next_live(i)) {
+        return false;
+    }
+
+    report("opt.peephole.jumps_to_next", i, op_name(op) + " " + std::string(code[i].symbol) + " to the next instruction removed");
+    remove(i);
+    return true;
+}
+
+// A control transfer to a section that starts with jump Y goes to Y directly
+bool Optimizer::thread_jump(int i) {
+    uint8_t op = code[i].word >> 24;
+    if ((op != 0x20 && op != 0x22 && op != 0x26 && op != 0x27) || code[i].symbol.empty()) {
+        return false;
+    }
+
+    std::set<std::string_view> seen = {code[i].symbol};
+    std::string_view target = code[i].symbol;
+    while (true) {
+        int t = resolve(target);
+        if (t < 0 || t >= (int) code.size() || t == i || (code[t].word >> 24) != 0x20 || code[t].symbol.empty()) {
+            break;
+        }
+        if (!seen.insert(code[t].symbol).second) {
+            return false; // the jumps form a loop, leave it alone
+        }
+        target = code[t].symbol;
+    }
+    if (target == code[i].symbol) {
+        return false;
+    }
+
+    report("opt.peephole.threaded_jumps", i, op_name(op) + " " + std::string(code[i].symbol) + " -> " + op_name(op) + " " + std::string(target));
+    code[i].symbol = target;
+    return true;
+}
+
+// loadm rd val that is overwritten before anything reads it
+bool Optimizer::dead_load(int i) {
+    InstrInfo info = decode(code[i].word);
+    if (!can_remove || (info.op != 0x00 && info.op != 0x01)) {
+        return false;
+    }
+
+    for (int k=next_live(i); k<(int) code.size(); k=next_live(k)) {
+        InstrInfo next = decode(code[k].word);
+        if (next.control || (next.uses & info.defs)) {
+            return false;
+        }
+        if (next.defs & info.defs) {
+            report("opt.peephole.dead_loads", i, op_name(info.op) + " r" + std::to_string((code[i].word >> 20) & 0xF)
+                   + " overwritten at pc=" + std::to_string(code[k].orig_pc) + " removed");
+            remove(i);
+            return true;
+        }
+    }
+    return false;
+}
+
+void Optimizer::transfer(const Instr& instr, RegValues* state) {
+    uint32_t word = instr.word;
+    InstrInfo info = decode(word);
+    uint32_t value;
+    bool known = !info.control && instr.symbol.empty() && evaluate(word, *state, &value); // the linker fills in data addresses
+    state->known &= ~info.defs;
+    if (known) {
+        int rd = (word >> 20) & 0xF;
+        state->known |= 1 << rd;
+        state->val[rd] = value;
+    }
+}
+
+bool Optimizer::evaluate(uint32_t word, const RegValues& state, uint32_t* result) {
+    uint8_t op = word >> 24;
+    if (op == 0x00) {
+        *result = word & 0xFFFFF;
+        return true;
+    }
+    if (op == 0x01) {
+        *result = (word & 0x80000) ? (word | 0xFFF00000) : (word & 0xFFFFF); // sign extended
+        return true;
+    }
+    if (op < 0x10 || (op >= 0x20 && op < 0x30)) {
+        return false;
+    }
+
+    int rs1 = (word >> 16) & 0xF;
+    int rs2 = (word >> 12) & 0xF;
+    bool known1 = state.known >> rs1 & 1;
+    bool known2 = state.known >> rs2 & 1;
+    uint32_t a = state.val[rs1];
+    uint32_t b = state.val[rs2];
+
+    // x * 0 and x & 0 don't need the other operand
+    if ((op == 0x12 || op == 0x30) && ((known1 && a == 0) || (known2 && b == 0))) {
+        *result = 0;
+        return true;
+    }
+    if (!known1 || !known2) {
+        return false;
+    }
+
+    // Only what doesn't depend on how the machine treats signs and big shifts is folded
+    bool non_negative = (int32_t) a >= 0 && (int32_t) b >= 0;
+    switch (op) {
+        case 0x10: *result = a + b; return true;
+        case 0x11: *result = a - b; return true;
+        case 0x12: *result = a * b; return true;
+        case 0x13: if (!non_negative || b == 0) return false; *result = a / b; return true;
+        case 0x30: *result = a & b; return true;
+        case 0x31: *result = a | b; return true;
+        case 0x32: *result = ~(a & b); return true;
+        case 0x33: *result = ~(a | b); return true;
+        case 0x34: *result = a ^ b; return true;
+        case 0x40: if (b >= 32) return false; *result = a << b; return true;
+        case 0x41: if (b >= 32 || (int32_t) a < 0) return false; *result = a >> b; return true;
+        case 0x50: if (!non_negative) return false; *result = a < b; return true;
+        case 0x51: if (!non_negative) return false; *result = a <= b; return true;
+        case 0x52: if (!non_negative) return false; *result = a > b; return true;
+        case 0x53: if (!non_negative) return false; *result = a >= b; return true;
+        case 0x54: *result = a == b; return true;
+        default: return false;
+    }
+}
+
+bool Optimizer::make_load(int rd, uint32_t value, uint32_t* word) {
+    int32_t signed_value = (int32_t) value;
+    if (signed_value >= -0x80000 && signed_value < 0x80000) {
+        *word = (0x01 << 24) | (rd << 20) | (value & 0xFFFFF); // loadm
+        return true;
+    }
+    if (value < 0x100000) {
+        *word = (0x00 << 24) | (rd << 20) | value; // uloadm
+        return true;
+    }
+    return false;
+}
+
+uint32_t Optimizer::replace_use(uint32_t word, int from, int to) {
+    uint8_t op = word >> 24;
+    auto replace_field = [&](int shift) {
+        if (((word >> shift) & 0xF) == (uint32_t) from) {
+            word = (word & ~(0xF << shift)) | (to << shift);
+        }
+    };
+
+    switch (op) {
+        case 0x02: replace_field(16); break; // loadr raddr
+        case 0x03: replace_field(20); replace_field(16); break; // storen raddr rs
+        case 0x04: case 0x22: replace_field(0); break; // stored rs, jumpif rcond
+        default:
+            if (op >= 0x10 && (op < 0x20 || op >= 0x30)) {
+                replace_field(16);
+                replace_field(12);
+            }
+            break;
+    }
+    return word;
+}
+
+bool Optimizer::has_side_effects(const InstrInfo& info) {
+    return info.control || info.writes_mem || info.op == 0x13; // keep div, a division by zero may trap
+}
+
+std::string Optimizer::op_name(uint8_t op) {
+    switch (op) {
+        case 0x00: return "uloadm";
+        case 0x01: return "loadm";
+        case 0x20: return "jump";
+        case 0x22: return "jumpif";
+        case 0x26: return "br";
+        case 0x27: return "brif";
+        default: return "op " + std::to_string(op);
+    }
+}
@@ -0,0 +1,110 @@
+#ifndef YUOPT_H
+#define YUOPT_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <map>
+#include <set>
+#include <ostream>
+#include <cstdint>
+
+#include "yustats.h"
+
+// Registers an instruction reads and writes and what else it does, decoded from the formats in instructions.txt
+struct InstrInfo {
+    uint8_t op;
+    uint16_t defs; // bit i set if r[i] is written
+    uint16_t uses; // bit i set if r[i] is read
+    bool control; // anything that can change the pc other than by one instruction
+    bool reads_mem;
+    bool writes_mem;
+};
+
+// Optimization passes over the encoded instructions of one object, run by the assembler before write_object.
+// The instructions are copied into a working list, the passes mark instructions as removed or rewrite them,
+// and store() writes the remaining instructions back and moves the section addresses and callers with them.
+class Optimizer {
+public:
+    Optimizer(std::vector<uint32_t>* set_instructions, std::map<std::string_view, int>* set_functions,
+              std::vector<std::pair<std::string_view, int>>* set_callers, std::ostream* set_log, Stats* set_stats,
+              const std::set<std::string_view>* set_hidden = nullptr);
+
+    int peephole(); // returns the number of rewrites
+    int dataflow(); // constant and copy propagation, strength reduction, dead and unreachable code removal
+    int hoist_loop_invariants(); // assumes sections that are only jumped to are entered from this file only
+    int inline_leaf_sections(int max_size); // returns the number of inlined calls
+    void store();
+
+    static InstrInfo decode(uint32_t word);
+
+private:
+    static constexpr int MAX_ROUNDS = 16; // passes are repeated until nothing changes, but not forever
+
+    // A basic block of live instructions. Every exported section start is an entry because other objects can branch to it.
+    struct Block {
+        std::vector<int> instrs; // indices into code
+        std::vector<int> succs; // indices into the block list
+        bool entry = false;
+        bool exit = false; // control can leave the object (ret, end, a jump to another object, the end of the code)
+    };
+
+    // Known register values at a point, a register is known if its bit is set
+    struct RegValues {
+        bool visited = false;
+        uint16_t known = 0;
+        uint32_t val[16] = {0};
+    };
+
+    struct Instr {
+        uint32_t word;
+        std::string_view symbol; // the section a control instruction or the data label a load or store refers to, empty if none
+        int orig_pc; // for the report
+        bool removed = false;
+    };
+
+    std::vector<uint32_t>* instructions;
+    std::map<std::string_view, int>* functions;
+    std::vector<std::pair<std::string_view, int>>* callers;
+    std::ostream* log;
+    Stats* stats;
+    const std::set<std::string_view>* hidden; // sections other objects can't branch to (.local), may be null
+
+    std::vector<Instr> code;
+    size_t n_original; // instructions before optimization
+    std::map<std::string_view, int> labels; // section name -> index in code (may be code.size() for an empty last section)
+    std::vector<int> label_count; // number of sections starting at each index, size code.size() + 1
+    bool can_remove = true; // false if any branch distance isn't a symbol the linker patches
+    const char* pass_name = "Peephole"; // for the report
+
+    int next_live(int i) const; // first instruction after i that isn't removed, code.size() if none
+    int live_at_or_after(int i) const;
+    int resolve(std::string_view symbol) const; // index of the first live instruction of a local section, -1 if not local
+    bool is_target(int i) const; // true if a section starts at i or at a removed instruction right before it
+    void remove(int i);
+    void report(const char* counter, int i, const std::string& what);
+
+    void compact(); // drops the removed instructions from code
+    std::vector<Block> build_cfg(std::vector<int>* block_of) const;
+    std::vector<uint16_t> liveness(const std::vector<Block>& blocks) const; // registers live at the start of each block
+    std::vector<int> dominators(const std::vector<Block>& blocks) const; // immediate dominator of each block
+    std::vector<RegValues> propagate_constants(const std::vector<Block>& blocks) const;
+    int rewrite_block(const Block& block, RegValues state);
+    int remove_dead_code(const std::vector<Block>& blocks);
+    int remove_unreachable(const std::vector<Block>& blocks);
+
+    bool tail_call(int i);
+    bool jump_to_next(int i);
+    bool thread_jump(int i);
+    bool dead_load(int i);
+
+    static std::string op_name(uint8_t op);
+    static bool dominates(const std::vector<int>& idom, int a, int b);
+    static void transfer(const Instr& instr, RegValues* state);
+    static bool evaluate(uint32_t word, const RegValues& state, uint32_t* result);
+    static bool make_load(int rd, uint32_t value, uint32_t* word);
+    static uint32_t replace_use(uint32_t word, int from, int to);
+    static bool has_side_effects(const InstrInfo& info);
+};
+
+#endif
@@ -0,0 +1,105 @@
+#include "yustats.h"
+
+#include <iomanip>
+
+Stats::Timer::Timer(Stats* set_stats, Phase set_phase) : stats(set_stats), phase(set_phase) {
+    if (stats == nullptr) {
+        return;
+    }
+    parent = stats->current;
+    stats->current = phase;
+    wall_start = std::chrono::steady_clock::now();
+    cpu_start = thread_cpu_ms();
+}
+
+Stats::Timer::~Timer() {
+    if (stats == nullptr) {
+        return;
+    }
+
+    std::chrono::duration<double, std::milli> wall = std::chrono::steady_clock::now() - wall_start;
+    double cpu = thread_cpu_ms() - cpu_start;
+
+    stats->wall_ms[phase] += wall.count();
+    stats->cpu_ms[phase] += cpu;
+    if (parent != N_PHASES) { // exclusive times, the parent only keeps what it did itself
+        stats->wall_ms[parent] -= wall.count();
+        stats->cpu_ms[parent] -= cpu;
+    }
+    stats->current = parent;
+}
+
+void Stats::count(const std::string& name, long long n) {
+    counters[name] += n;
+}
+
+void Stats::count_max(const std::string& name, long long val) {
+    long long& cur = counters[name];
+    if (val > cur) {
+        cur = val;
+    }
+}
+
+void Stats::merge(const Stats& other) {
+    // Wall times aren't added, the workers run at the same time as the thread that waits for them
+    for (int i=0; i<N_PHASES; i++) {
+        cpu_ms[i] += other.cpu_ms[i];
+    }
+    for (auto it = other.counters.begin(); it != other.counters.end(); ++it) {
+        if (it->first.size() > 4 && it->first.compare(it->first.size() - 4, 4, "_max") == 0) {
+            count_max(it->first, it->second);
+        } else {
+            count(it->first, it->second);
+        }
+    }
+}
+
+void Stats::print(std::ostream& out, bool json) const {
+    out << std::fixed << std::setprecision(3);
+
+    if (json) {
+        out << "{\"phases\": {";
+        for (int i=0; i<N_PHASES; i++) {
+            out << (i > 0 ? ", " : "") << "\"" << phase_name((Phase) i) << "\": {\"wall_ms\": " << wall_ms[i]
+                << ", \"cpu_ms\": " << cpu_ms[i] << "}";
+        }
+        out << "}, \"counters\": {";
+        bool first = true;
+        for (auto it = counters.begin(); it != counters.end(); ++it) {
+            out << (first ? "" : ", ") << "\"" << it->first << "\": " << it->second;
+            first = false;
+        }
+        out << "}}\n";
+        return;
+    }
+
+    out << std::left << std::setw(32) << "phase" << std::right << std::setw(14) << "wall (ms)" << std::setw(14) << "cpu (ms)" << "\n";
+    for (int i=0; i<N_PHASES; i++) {
+        out << std::left << std::setw(32) << phase_name((Phase) i) << std::right << std::setw(14) << wall_ms[i]
+            << std::setw(14) << cpu_ms[i] << "\n";
+    }
+    out << "\n" << std::left << std::setw(32) << "counter" << std::right << std::setw(14) << "value" << "\n";
+    for (auto it = counters.begin(); it != counters.end(); ++it) {
+        out << std::left << std::setw(32) << it->first << std::right << std::setw(14) << it->second << "\n";
+    }
+}
+
+double Stats::thread_cpu_ms() {
+    timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+const char* Stats::phase_name(Phase phase) {
+    switch (phase) {
+        case LEXING: return "lexing";
+        case MACRO_EXPANSION: return "macro_expansion";
+        case ENCODING: return "encoding";
+        case OBJECT_WRITING: return "object_writing";
+        case OBJECT_READING: return "object_reading";
+        case SYMBOL_RESOLUTION: return "symbol_resolution";
+        case RELOCATION: return "relocation";
+        case BINARY_WRITING: return "binary_writing";
+        default: return "unknown";
+    }
+}
@@ -0,0 +1,56 @@
+#ifndef YUSTATS_H
+#define YUSTATS_H
+
+#include <string>
+#include <map>
+#include <chrono>
+#include <ctime>
+#include <ostream>
+
+// Phase timings and counters collected with --stats, shared by the assembler and the linker
+class Stats {
+public:
+    enum Phase {
+        LEXING,
+        MACRO_EXPANSION,
+        ENCODING,
+        OBJECT_WRITING,
+        OBJECT_READING,
+        SYMBOL_RESOLUTION,
+        RELOCATION,
+        BINARY_WRITING,
+        N_PHASES
+    };
+
+    // Measures the lifetime of the object and adds it to a phase.
+    // Timers can be nested, the time of an inner phase is not counted in the outer one.
+    // Does nothing if stats is null so it can be left in place when --stats isn't given.
+    class Timer {
+    public:
+        Timer(Stats* set_stats, Phase set_phase);
+        ~Timer();
+
+    private:
+        Stats* stats;
+        Phase phase;
+        Phase parent;
+        std::chrono::steady_clock::time_point wall_start;
+        double cpu_start; // ms of cpu time used by the calling thread
+    };
+
+    void count(const std::string& name, long long n = 1);
+    void count_max(const std::string& name, long long val);
+    void merge(const Stats& other); // adds the counters and cpu times of a worker thread
+    void print(std::ostream& out, bool json) const;
+
+    static const char* phase_name(Phase phase);
+    static double thread_cpu_ms(); // per thread so the timers of parallel workers don't count each other
+
+private:
+    double wall_ms[N_PHASES] = {0};
+    double cpu_ms[N_PHASES] = {0};
+    Phase current = N_PHASES; // innermost running phase, N_PHASES if none
+    std::map<std::string, long long> counters;
+};
+
+#endif
@@ -0,0 +1,181 @@
+#include "yuwatch.h"
+#include "yulinker.h"
+
+#include <iostream>
+#include <filesystem>
+#include <algorithm>
+#include <chrono>
+#include <cerrno>
+#include <cstring>
+#include <poll.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+Watcher::Watcher(std::vector<std::string> fpaths, YuasmOptions set_options) : options(set_options) {
+    options.auto_link = false; // all objects are linked together by link()
+    options.file_cache = &file_cache;
+    for (const std::string& fpath : fpaths) {
+        units.emplace_back(fpath);
+    }
+}
+
+Watcher::~Watcher() {
+    if (inotify_fd >= 0) {
+        close(inotify_fd);
+    }
+}
+
+int Watcher::run() {
+#ifdef __linux__
+    inotify_fd = inotify_init1(IN_CLOEXEC);
+#endif
+    if (inotify_fd < 0) {
+        std::cerr << "Error: --watch needs inotify: " << std::strerror(errno) << "\n";
+        return 1;
+    }
+
+    bool all_ok = true;
+    for (Unit& unit : units) {
+        all_ok = assemble(&unit) && all_ok; // every source is assembled, so all their includes are watched
+    }
+    if (all_ok && !link()) {
+        std::cout << "watch: the link failed" << std::endl;
+    }
+
+    while (true) {
+        std::cout << "watch: waiting for changes" << std::endl;
+        std::set<std::string> changed;
+        if (!wait_for_changes(&changed)) {
+            return 1;
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        int n_assembled = 0;
+        all_ok = true;
+        for (Unit& unit : units) {
+            bool affected = std::any_of(changed.begin(), changed.end(), [&unit](const std::string& fpath) {
+                return unit.dependencies.count(fpath) > 0;
+            });
+            if (affected) {
+                assemble(&unit);
+                n_assembled++;
+            }
+            all_ok = all_ok && unit.ok;
+        }
+        bool linked = all_ok && link();
+
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        std::cout << "watch: assembled " << n_assembled << " of " << units.size() << " sources"
+                  << (linked ? " and linked" : all_ok ? ", the link failed" : ", not linked until the errors are fixed")
+                  << " in " << ms << " ms" << std::endl;
+    }
+}
+
+bool Watcher::assemble(Unit* unit) {
+    Yuasm yuasm(unit->fpath, options);
+    unit->ok = yuasm.succeeded();
+    unit->obj_fpath = yuasm.object_path();
+
+    // After an error the files after it weren't opened, the ones from before are still watched
+    if (unit->ok) {
+        unit->dependencies.clear();
+    }
+    unit->dependencies.insert(absolute_path(unit->fpath)); // even if it couldn't be opened
+    for (const std::string& fpath : yuasm.included_files()) {
+        unit->dependencies.insert(absolute_path(fpath));
+    }
+    for (const std::string& fpath : unit->dependencies) {
+        watch_dir(std::filesystem::path(fpath).parent_path().string());
+    }
+    return unit->ok;
+}
+
+bool Watcher::link() {
+    std::vector<std::string> objects;
+    for (const Unit& unit : units) {
+        objects.push_back(unit.obj_fpath);
+    }
+    LinkerOptions linker_options;
+    linker_options.data_base = options.data_base;
+    linker_options.sync_output = options.sync_output;
+    linker_options.out_dir = options.out_dir;
+    linker_options.incremental = true;
+    linker_options.file_cache = &file_cache;
+    Linker linker(objects, true, linker_options);
+    return linker.succeeded();
+}
+
+bool Watcher::watch_dir(const std::string& dir) {
+    if (dirs.count(dir) > 0) {
+        return true;
+    }
+#ifdef __linux__
+    // The directory is watched rather than the file, editors that save by renaming a new file
+    // over the old one would end the watch of the file
+    int wd = inotify_add_watch(inotify_fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+    if (wd < 0) {
+        return false;
+    }
+    watched_dirs[wd] = dir;
+    dirs.insert(dir);
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool Watcher::wait_for_changes(std::set<std::string>* changed) {
+#ifdef __linux__
+    alignas(inotify_event) char buffer[64 * 1024];
+    int timeout = -1; // until the first change, then until nothing else happens for SETTLE_MS
+    while (true) {
+        pollfd pfd = {inotify_fd, POLLIN, 0};
+        int ready = poll(&pfd, 1, timeout);
+        if (ready < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ready < 0) {
+            std::cerr << "Error: --watch: " << std::strerror(errno) << "\n";
+            return false;
+        }
+        if (ready == 0) {
+            return true;
+        }
+
+        ssize_t n = read(inotify_fd, buffer, sizeof(buffer));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            std::cerr << "Error: --watch: " << std::strerror(errno) << "\n";
+            return false;
+        }
+        for (ssize_t pos = 0; pos < n; ) {
+            const inotify_event* event = reinterpret_cast<const inotify_event*>(buffer + pos);
+            pos += sizeof(inotify_event) + event->len;
+            auto dir = watched_dirs.find(event->wd);
+            if (event->len == 0 || dir == watched_dirs.end()) {
+                continue;
+            }
+            std::string fpath = dir->second + "/" + event->name;
+            for (const Unit& unit : units) {
+                if (unit.dependencies.count(fpath) > 0) {
+                    changed->insert(fpath);
+                    break;
+                }
+            }
+        }
+        if (!changed->empty()) {
+            timeout = SETTLE_MS;
+        }
+    }
+#else
+    return false;
+#endif
+}
+
+std::string Watcher::absolute_path(const std::string& fpath) {
+    return std::filesystem::absolute(fpath).lexically_normal().string();
+}
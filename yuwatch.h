@@ -0,0 +1,49 @@
+#ifndef YUWATCH_H
+#define YUWATCH_H
+
+#include <string>
+#include <vector>
+#include <set>
+#include <map>
+
+#include "yuasm.h"
+#include "yufile.h"
+
+// yuasm --watch: assembles the sources and links their objects, then waits for a source or a file it
+// includes to change and does it again for the sources that use the file, until it is interrupted.
+// The link is incremental, so only the objects that changed are written into program.bin, and the
+// files that didn't change are read from a FileCache.
+class Watcher {
+public:
+    Watcher(std::vector<std::string> fpaths, YuasmOptions set_options);
+    ~Watcher();
+    int run();
+
+private:
+    static constexpr int SETTLE_MS = 2; // more events of the same save are waited for this long
+
+    struct Unit {
+        explicit Unit(const std::string& set_fpath) : fpath(set_fpath) {}
+
+        std::string fpath;
+        std::string obj_fpath;
+        std::set<std::string> dependencies; // absolute, the source itself and every file it included
+        bool ok = false; // its object is up to date
+    };
+
+    std::vector<Unit> units;
+    YuasmOptions options;
+    FileCache file_cache;
+    int inotify_fd = -1;
+    std::map<int, std::string> watched_dirs; // watch descriptor -> absolute directory
+    std::set<std::string> dirs;
+
+    bool assemble(Unit* unit);
+    bool link();
+    bool watch_dir(const std::string& dir);
+    bool wait_for_changes(std::set<std::string>* changed); // absolute paths, false if inotify fails
+
+    static std::string absolute_path(const std::string& fpath);
+};
+
+#endif